@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include "arena.h"
+
+void arena_init(arena_t *arena, const char *name, uintptr_t base, size_t size)
+{
+	arena->name = name;
+	arena->base = base;
+	arena->end = base + size;
+	arena->next = base;
+	arena->blocks = NULL;
+	arena->count = 0;
+	arena->capacity = 0;
+}
+
+void arena_reset(arena_t *arena)
+{
+	arena->next = arena->base;
+	arena->count = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+	free(arena->blocks);
+	arena->blocks = NULL;
+	arena->count = 0;
+	arena->capacity = 0;
+}
+
+static uintptr_t align_up(uintptr_t addr, size_t align)
+{
+	return (addr + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+uintptr_t arena_alloc(arena_t *arena, const char *name, size_t size,
+		      size_t align, arena_fit_t *fit)
+{
+	// Step past the places that do not fit. addr only drops below
+	// next if it wraps around.
+	uintptr_t addr = align_up(arena->next, align);
+	for (;;)
+	{
+		if (addr < arena->next || addr > arena->end || arena->end - addr < size)
+			return 0;
+		if (!fit || fit(addr, size))
+			break;
+		addr += align;
+	}
+
+	if (arena->count == arena->capacity)
+	{
+		size_t capacity = arena->capacity? arena->capacity * 2:32;
+		struct arena_block *blocks = realloc(arena->blocks, capacity * sizeof *blocks);
+		if (!blocks)
+			return 0;
+		arena->blocks = blocks;
+		arena->capacity = capacity;
+	}
+	arena->blocks[arena->count++] = (struct arena_block){ name, addr, size };
+	arena->next = addr + size;
+	return addr;
+}
+
+int arena_sub(arena_t *arena, arena_t *sub, const char *name, size_t size,
+	      size_t align)
+{
+	uintptr_t addr = arena_alloc(arena, name, size, align, NULL);
+	if (!addr)
+		return -1;
+	arena_init(sub, name, addr, size);
+	return 0;
+}
+
+size_t arena_left(const arena_t *arena, size_t align)
+{
+	uintptr_t addr = align_up(arena->next, align);
+	return addr < arena->end? arena->end - addr:0;
+}
+
+void arena_dump(const arena_t *arena, FILE *fp)
+{
+	fprintf(fp, "%s: %08lx-%08lx, %lu bytes free\n", arena->name,
+		(unsigned long)arena->base, (unsigned long)arena->end,
+		(unsigned long)(arena->end - arena->next));
+	for (size_t i = 0; i < arena->count; ++i)
+	{
+		const struct arena_block *block = &arena->blocks[i];
+		fprintf(fp, "  %08lx %8lx  %s\n", (unsigned long)block->addr,
+			(unsigned long)block->size, block->name);
+	}
+}
+
+int arena_within_64k(uintptr_t addr, size_t size)
+{
+	return addr >> 16 == (addr + size - 1) >> 16;
+}
+
+int arena_within_16m(uintptr_t addr, size_t size)
+{
+	return addr >> 24 == (addr + size - 1) >> 24;
+}
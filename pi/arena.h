@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A named piece of an arena. */
+struct arena_block
+{
+	const char *name;
+	uintptr_t addr;
+	size_t size;
+};
+
+/* Bump allocation from the bus address range [base, end). Every
+ * allocation is named so that a dump of the arena says what went
+ * where, and arena_reset() gives them all back at once. */
+typedef struct
+{
+	const char *name;
+	uintptr_t base;
+	uintptr_t end;
+	uintptr_t next;
+	struct arena_block *blocks;
+	size_t count;
+	size_t capacity;
+} arena_t;
+
+/* Says whether the size bytes at addr may be used, for placements
+ * with a constraint beyond alignment. */
+typedef int arena_fit_t(uintptr_t addr, size_t size);
+
+void arena_init(arena_t *arena, const char *name, uintptr_t base, size_t size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+/* Returns the bus address of size bytes aligned to align, a power of
+ * two, for which fit holds if it is not NULL, or 0 if there is no
+ * room. */
+uintptr_t arena_alloc(arena_t *arena, const char *name, size_t size,
+		      size_t align, arena_fit_t *fit);
+/* Allocates size bytes of arena as the arena sub. Returns -1 if there
+ * is no room. */
+int arena_sub(arena_t *arena, arena_t *sub, const char *name, size_t size,
+	      size_t align);
+/* How many bytes are left after aligning to align. */
+size_t arena_left(const arena_t *arena, size_t align);
+void arena_dump(const arena_t *arena, FILE *fp);
+
+/* Fits for arena_alloc(): the bytes do not straddle a 64 KB or 16 MB
+ * boundary, so a carry never reaches the third or fourth byte of an
+ * address in them. */
+int arena_within_64k(uintptr_t addr, size_t size);
+int arena_within_16m(uintptr_t addr, size_t size);
+
+#endif
@@ -1,29 +1,38 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "arena.h"
+#include "bulk.h"
 #include "common.h"
 #include "dma.h"
+#include "reloc.h"
 #include "uart.h"
 
 #define UART0_DR 0x7e201000
 #define UART0_FR 0x7e201018
 
-static void setup_cb(volatile struct control_block *cb,
-			 volatile void *dest, volatile void *src, size_t size,
-			 volatile struct control_block *next)
+/* The program as read from disk. positions maps each of the count
+ * offsets in the compacted program back to an offset in text. */
+typedef struct
 {
-	cb->ti = TI_SRC_INC | TI_DEST_INC;
-	cb->source_ad = src? virtual_to_bus(src):0;
-	cb->dest_ad = dest? virtual_to_bus(dest):0;
-	cb->txfr_len = size;
-	cb->stride = 0;
-	cb->nextconbk = next? virtual_to_bus(next):0;
-}
-
-static size_t copy_program(volatile uint8_t *program, const char *program_path)
+	const char *path;
+	char *text;
+	size_t size;
+	size_t *positions;
+	size_t count;
+} source_t;
+
+static void read_program(source_t *source, const char *program_path)
 {
 	FILE *fp = fopen(program_path, "r");
 	if (!fp)
@@ -39,13 +48,218 @@ static size_t copy_program(volatile uint8_t *program, const char *program_path)
 		exit(1);
 	}
 	rewind(fp);
-	if (fread((void *)program, program_size, 1, fp) != 1)
+	source->path = program_path;
+	source->text = malloc(program_size + 1);
+	source->size = program_size;
+	if (program_size && fread(source->text, program_size, 1, fp) != 1)
 	{
 		perror(program_path);
 		exit(1);
 	}
-	program[program_size] = 0;
-	return program_size + 1;
+	source->text[program_size] = 0;
+	fclose(fp);
+}
+
+/* Copies only the eight command bytes of the source into program,
+ * followed by the terminating 0, and records where each came from.
+ * Returns the size of the compacted program. */
+static size_t compact_program(volatile uint8_t *program, source_t *source)
+{
+	size_t size = 0;
+	source->positions = malloc((source->size + 1) * sizeof *source->positions);
+	for (size_t i = 0; i < source->size; ++i)
+	{
+		if (!strchr("+-<>[],.", source->text[i]) || !source->text[i])
+			continue;
+		source->positions[size] = i;
+		program[size++] = source->text[i];
+	}
+	source->positions[size] = source->size;
+	program[size++] = 0;
+	source->count = size;
+	return size;
+}
+
+/* Moves line and column, the place in the source of offset from in
+ * text, on to offset to. */
+static void walk_source(const source_t *source, size_t from, size_t to,
+			size_t *line, size_t *column)
+{
+	for (size_t i = from; i < to; ++i)
+	{
+		if (source->text[i] == '\n')
+		{
+			++*line;
+			*column = 1;
+		}
+		else
+			++*column;
+	}
+}
+
+/* Finds the line and column in the source of offset off of the
+ * compacted program. */
+static void source_position(const source_t *source, size_t off,
+			    size_t *line, size_t *column)
+{
+	*line = 1;
+	*column = 1;
+	walk_source(source, 0, source->positions[off], line, column);
+}
+
+static void source_error(const source_t *source, size_t off, const char *msg)
+{
+	size_t line, column;
+	source_position(source, off, &line, &column);
+	fprintf(stderr, "%s:%zu:%zu: %s\n", source->path, line, column, msg);
+	exit(1);
+}
+
+/* Returns the offset of the matching bracket for every bracket in
+ * the program. */
+static size_t *match_brackets(const volatile uint8_t *program, size_t program_size,
+			      const source_t *source)
+{
+	size_t *match = malloc(program_size * sizeof *match);
+	size_t *stack = malloc(program_size * sizeof *stack);
+	size_t depth = 0;
+	for (size_t off = 0; off < program_size; ++off)
+	{
+		if (program[off] == '[')
+			stack[depth++] = off;
+		else if (program[off] == ']')
+		{
+			if (depth == 0)
+				source_error(source, off, "unmatched ']'");
+			match[off] = stack[--depth];
+			match[match[off]] = off;
+		}
+	}
+	if (depth)
+		source_error(source, stack[depth - 1], "unmatched '['");
+	free(stack);
+	return match;
+}
+
+/* A multiply loop such as [->+++>++<<] only moves the head and
+ * changes cells, returns the head to where it started, and adds -1
+ * or +1 to that cell. Every target cell it touches gains factor times
+ * the starting value of the loop cell, which is then left zero. */
+#define MAX_MUL_TARGETS 8
+#define MAX_MUL_OFFSET 127
+
+typedef struct
+{
+	int offset;
+	uint8_t factor;
+} mul_target_t;
+
+/* Parses the loop whose '[' is at loop. Returns the number of target
+ * cells, in ascending order of offset, and sets length to the length
+ * of the loop including both brackets, or returns -1 if it is not a
+ * multiply loop. */
+static int parse_mul_loop(const volatile uint8_t *loop, size_t *length,
+			  mul_target_t *targets)
+{
+	uint8_t delta[2 * MAX_MUL_OFFSET + 1] = {0};
+	int pos = 0;
+	size_t i;
+	for (i = 1; loop[i] != ']'; ++i)
+	{
+		switch (loop[i])
+		{
+		case '+':
+			++delta[pos + MAX_MUL_OFFSET];
+			break;
+		case '-':
+			--delta[pos + MAX_MUL_OFFSET];
+			break;
+		case '>':
+			if (++pos > MAX_MUL_OFFSET)
+				return -1;
+			break;
+		case '<':
+			if (--pos < -MAX_MUL_OFFSET)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	uint8_t step = delta[MAX_MUL_OFFSET];
+	if (pos != 0 || (step != 1 && step != 0xff))
+		return -1;
+
+	// The loop runs value times when it decrements and 256 - value
+	// times when it increments.
+	int count = 0;
+	for (pos = -MAX_MUL_OFFSET; pos <= MAX_MUL_OFFSET; ++pos)
+	{
+		uint8_t d = delta[pos + MAX_MUL_OFFSET];
+		if (pos == 0 || d == 0)
+			continue;
+		if (count == MAX_MUL_TARGETS)
+			return -1;
+		targets[count].offset = pos;
+		targets[count].factor = step == 0xff? d:-d;
+		++count;
+	}
+	*length = i + 1;
+	return count;
+}
+
+/* A block is a stretch of +-<> with no other commands. It adds delta
+ * to the cell at offset from the head where it started, for each of
+ * its cells, and moves the head by move in total. */
+#define MAX_BLOCK_CELLS 16
+#define MAX_BLOCK_OFFSET 0x7fff
+
+typedef struct
+{
+	int offset;
+	uint8_t delta;
+} cell_op_t;
+
+/* Parses the block that starts at block. Returns its length, which
+ * stops short of the end of the stretch if it touches more than
+ * MAX_BLOCK_CELLS cells or moves further than MAX_BLOCK_OFFSET. */
+static size_t parse_block(const volatile uint8_t *block, cell_op_t *ops,
+			  int *count, int *move)
+{
+	int pos = 0;
+	int n = 0;
+	size_t i;
+	for (i = 0; ; ++i)
+	{
+		uint8_t c = block[i];
+		if (c == '>' || c == '<')
+		{
+			int next = pos + (c == '>'? 1:-1);
+			if (next > MAX_BLOCK_OFFSET || next < -MAX_BLOCK_OFFSET)
+				break;
+			pos = next;
+		}
+		else if (c == '+' || c == '-')
+		{
+			int j = 0;
+			while (j < n && ops[j].offset != pos)
+				++j;
+			if (j == n)
+			{
+				if (n == MAX_BLOCK_CELLS)
+					break;
+				ops[n].offset = pos;
+				ops[n].delta = 0;
+				++n;
+			}
+			ops[j].delta += c == '+'? 1:-1;
+		}
+		else
+			break;
+	}
+	*count = n;
+	*move = pos;
+	return i;
 }
 
 typedef volatile struct control_block *cb_t;
@@ -64,38 +278,160 @@ typedef struct
 	vuint32_t rcond;
 	vuint32_t input;
 	vuint32_t output;
+	vuint32_t add_n;
+	vuint32_t add_at;
+	vuint32_t right_n;
+	vuint32_t left_n;
+	vuint32_t clear;
+	vuint32_t scan_right;
+	vuint32_t scan_left;
+	vuint32_t load;
+	vuint32_t mul;
 } insn_table_t;
 
+/* Opcodes the loader writes over a block of +-<>, as an ADD_N or
+ * ADD_AT for each cell it changes and RIGHT_N or LEFT_N for its net
+ * move, and over the '[' of a clear ([-], [+]) or scan ([>], [<])
+ * loop. A multiply loop is rewritten in place to LOAD, a MUL for each
+ * target between the moves to reach it, and CLEAR. The operand, the
+ * offset from the head of ADD_AT and the address of the next
+ * instruction are found through the operand, offset and jump
+ * tables. */
+enum
+{
+	ADD_N_OPCODE = 0x1,
+	RIGHT_N_OPCODE = 0x2,
+	LEFT_N_OPCODE = 0x3,
+	CLEAR_OPCODE = 0x4,
+	SCAN_RIGHT_OPCODE = 0x5,
+	SCAN_LEFT_OPCODE = 0x6,
+	LOAD_OPCODE = 0x7,
+	MUL_OPCODE = 0x8,
+	ADD_AT_OPCODE = 0x9,
+};
+
+/* How many SDRAM accesses a run made to a gadget or table, by the
+ * name it was placed under, and how many bytes it took. Those the
+ * profile marks hot are packed together on the next load. */
+struct profile_entry
+{
+	char *name;
+	uint64_t count;
+	size_t size;
+	int hot;
+};
+
+typedef struct
+{
+	struct profile_entry *entries;
+	size_t count;
+} profile_t;
+
+/* The room for the hot gadgets and tables: two rows of the SDRAM,
+ * which the emulator takes to be 2 KB, so they stay open while the
+ * big tables and the tape come and go in the other banks. */
+#define HOT_SIZE 0x1000
+
+/* The control blocks the gadgets may take, which is under 200 now.
+ * The pool holds these and the ones clearing the tape, which a large
+ * tape needs many of on a lite channel. */
+#define GADGET_CBS 254
+
+/* An image of what load() builds for the interpreter, laid out as in
+ * the image cache. */
+typedef struct
+{
+	uint8_t *bytes;
+	size_t size;
+} image_t;
+
 typedef struct
 {
-	cb_t next_cb;
+	// The control blocks of the gadgets, and the hot gadgets and
+	// tables if there is a profile
+	arena_t cbs;
+	arena_t hot;
+	const profile_t *profile;
+
+	// The directory of the image cache, if one is used, and the image
+	// of the last build, if the loads after it may copy it
+	const char *cache;
+	image_t *image;
+
+	// A cached copy of the memory, which everything is built in and
+	// which transfer() then copies over in bulk, as the CPU's stores
+	// through the uncached mapping go a word at a time
+	struct dma_memory stage;
+	// The words of the stage that hold addresses in it, and those
+	// that hold addresses of the tx and rx channels' registers
+	reloc_t relocs;
+	reloc_t tx_relocs;
+	reloc_t rx_relocs;
 
 	// Tables
 	vuint8_t *dispatch_table;
 	vuint8_t *inc_table;
 	vuint8_t *dec_table;
 	vuint8_t *boolean_inc_table;
-        vuint8_t *boolean_dec_table;
+	vuint8_t *boolean_dec_table;
 	insn_table_t *insn_table;
 	vuint32_t *conditional_table;
-	vuint8_t *bracket_table;
-	vuint32_t *scanleft_table;
-	vuint32_t *scanright_table;
-	vuint8_t *boolean_read_table;
-	vuint8_t *boolean_write_table;
+	vuint8_t *jump_table;
+	vuint8_t *operand_table;
+	vuint8_t *offset_table;
+	vuint8_t *add_table;
+	vuint8_t *carry_table;
+	vuint8_t *mul_table;
+	vuint8_t *succ_lo_table;
+	vuint8_t *succ_hi_table;
+	vuint8_t *pred_lo_table;
+	vuint8_t *pred_hi_table;
+	vuint8_t *wrap_inc_table;
+	vuint8_t *wrap_dec_table;
+	vuint8_t *page_inc_table;
+	vuint8_t *page_dec_table;
+	vuint8_t *boolean_active_table;
+	vuint8_t *branch_zero_table;
+	vuint8_t *branch_flush_table;
+	vuint8_t *out_slot_table;
+	vuint8_t *out_last_table;
+	vuint8_t *out_pending_table;
+	vuint8_t *out_full_base_table;
+	vuint8_t *out_part_base_table;
+	vuint8_t *out_part_len_table;
+	vuint8_t *out_part_next_table;
+	vuint8_t *rx_slot_table;
+	vuint8_t *equal_table;
 
 	// Data
+	size_t tape_pages;
+	int quiet;		// say nothing about loading the program
+	int channel;		// the DMA channel it is loaded for
+	source_t *source;	// if set, load() leaves the program's source here
+	vuint8_t *program;
+	vuint8_t *tape;
 	vuint32_t *pc;
-	vuint32_t *lc;
 	vuint32_t *head;
+	vuint8_t *acc;
+	vuint32_t *out_ring;
+	vuint8_t *out_idx;
+	vuint32_t *rx_ring;
+	vuint8_t *rx_stage;
+	vuint8_t *rx_cons;
+	vuint8_t *rx_prod;
 	
 	// Helper gadgets
 	cb_t dispatch;
 	cb_t tramp;
 	cb_t tramp2;
-	cb_t inc_4;
-	cb_t dec_4;
+	cb_t inc_head;
+	cb_t dec_head;
 	cb_t next_insn;
+	cb_t jump;
+	cb_t flush_full;
+	cb_t flush;
+	cb_t receive;
+	cb_t stop;
 
 	// Instruction gadgets +-><[],.
 	cb_t inc;
@@ -107,31 +443,403 @@ typedef struct
 	cb_t input;
 	cb_t output;
 
+	// Folded run gadgets
+	cb_t add_n;
+	cb_t add_at;
+	cb_t right_n;
+	cb_t left_n;
+
+	// Idiom gadgets
+	cb_t clear;
+	cb_t scan_right;
+	cb_t scan_left;
+	cb_t load;
+	cb_t mul;
+
 } bf_t;
 
 /* Offsets into the conditional table. */
 enum
 {
-	INC_4_INDEX = 0x0,
-	// INC_4_INDEX_1 = 0x1,
-	// INC_4_INDEX_2 = 0x2,
-	DEC_4_INDEX = 0x3,
-	// DEC_4_INDEX_1 = 0x4,
-	// DEC_4_INDEX_2 = 0x5,
+	PC_INC_INDEX = 0x0,
+	HEAD_INC_INDEX = 0x1,
+	HEAD_DEC_INDEX = 0x2,
+	HEAD_CARRY_INDEX = 0x3,
+	HEAD_BORROW_INDEX = 0x4,
 	LCOND_INDEX = 0x6,
-	LCOND_LC_INDEX_0 = 0x7,
-	LCOND_LC_INDEX_1 = 0x8,
-	LCOND_LC_INDEX_2 = 0x9,
-	LCOND_LC_INDEX_3 = 0xa,
-	RCOND_INDEX = 0xb,
-	RCOND_LC_INDEX_0 = 0xc,
-	RCOND_LC_INDEX_1 = 0xd,
-	RCOND_LC_INDEX_2 = 0xe,
-	RCOND_LC_INDEX_3 = 0xf,
-	INPUT_INDEX = 0x10,
-	OUTPUT_INDEX = 0x11,
+	RCOND_INDEX = 0x7,
+	INPUT_INDEX = 0x8,
+	OUTPUT_INDEX = 0x9,
+	RIGHT_N_INDEX = 0xa,
+	LEFT_N_INDEX = 0xb,
+	SCAN_RIGHT_INDEX = 0xc,
+	SCAN_LEFT_INDEX = 0xd,
+	SCAN_INC_INDEX = 0xe,
+	SCAN_DEC_INDEX = 0xf,
+	FLUSH_WAIT_INDEX = 0x10,
+	FLUSH_INDEX = 0x11,
+	FLUSH_PART_WAIT_INDEX = 0x12,
+	INPUT_FLUSH_INDEX = 0x13,
+	INPUT_FLUSH_WAIT_INDEX = 0x14,
+	RX_INDEX = 0x15,
 };
 
+/* Stores the bus address of target, or 0 for NULL, in the word at
+ * field, and records the word as a relocation of bf's image. */
+static void set_address(bf_t *bf, volatile uint32_t *field, volatile void *target)
+{
+	*field = target? virtual_to_bus(target):0;
+	if (target && reloc_add(&bf->relocs, virtual_to_bus(field)))
+	{
+		perror("reloc_add");
+		exit(1);
+	}
+}
+
+/* Stores the bus address of the register at offset in the tx or rx
+ * channel's, whose registers are at registers, in the word at field,
+ * and records the word for a copy of bf's image to be moved to other
+ * channels. */
+static void set_register(bf_t *bf, volatile uint32_t *field, uint32_t registers,
+			 size_t offset)
+{
+	assert(registers == tx_dma_registers || registers == rx_dma_registers);
+	*field = registers + offset;
+	reloc_t *relocs = registers == tx_dma_registers? &bf->tx_relocs:&bf->rx_relocs;
+	if (reloc_add(relocs, virtual_to_bus(field)))
+	{
+		perror("reloc_add");
+		exit(1);
+	}
+}
+
+static void setup_cb(bf_t *bf, volatile struct control_block *cb,
+		     volatile void *dest, volatile void *src, size_t size,
+		     volatile struct control_block *next)
+{
+	cb->ti = TI_SRC_INC | TI_DEST_INC;
+	set_address(bf, &cb->source_ad, src);
+	set_address(bf, &cb->dest_ad, dest);
+	cb->txfr_len = size;
+	cb->stride = 0;
+	set_address(bf, &cb->nextconbk, next);
+}
+
+/* Starts bf's stage, standing in for the whole of memory. */
+static void stage(bf_t *bf, const arena_t *memory)
+{
+	bf->stage.size = memory->end - memory->base;
+	bf->stage.bus = memory->base;
+	bf->stage.handle = 0;
+	bf->stage.virt = aligned_alloc(PAGE_SIZE, bf->stage.size);
+	if (!bf->stage.virt)
+	{
+		perror("aligned_alloc");
+		exit(1);
+	}
+	dma_track(&bf->stage);
+	reloc_init(&bf->relocs, bf->stage.bus, bf->stage.size);
+	reloc_init(&bf->tx_relocs, bf->stage.bus, bf->stage.size);
+	reloc_init(&bf->rx_relocs, bf->stage.bus, bf->stage.size);
+}
+
+static void unstage(bf_t *bf)
+{
+	if (!bf->stage.virt)
+		return;
+	dma_untrack(&bf->stage);
+	free(bf->stage.virt);
+	bf->stage.virt = NULL;
+	reloc_free(&bf->relocs);
+	reloc_free(&bf->tx_relocs);
+	reloc_free(&bf->rx_relocs);
+}
+
+/* Where the bytes at p in the stage go in the memory. */
+static void *in_memory(volatile void *p)
+{
+	return bus_to_virtual(virtual_to_bus(p));
+}
+
+static double wall_time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Copies the size bytes at p in a stage over to the memory, or back
+ * from it if back, with the CPU. The DMA does not move them itself, as
+ * dma_memcpy_user() could: user space can only clean the caches of the
+ * stage as far as the point of unification, so the DMA may read what
+ * the CPU wrote before it reaches the SDRAM, or leave stale lines
+ * behind when it writes. */
+static void transfer(volatile void *p, size_t size, int back)
+{
+	uint8_t *staged = (uint8_t *)p;
+	volatile uint8_t *memory = in_memory(p);
+	if (back)
+		memcpy(staged, (void *)memory, size);
+	else
+		memcpy((void *)memory, staged, size);
+}
+
+static size_t tape_size(const bf_t *bf)
+{
+	return bf->tape_pages? bf->tape_pages << 16:0x200000;
+}
+
+/* Brings the tape back from the memory into the stage for the CPU to
+ * read. Returns the seconds it took. */
+static double read_back(bf_t *bf)
+{
+	double start = wall_time();
+	transfer(bf->tape, tape_size(bf), 1);
+	return wall_time() - start;
+}
+
+/* Places size bytes named name in arena, or exits if there is no
+ * room. Returns a pointer to them in bf's stage. */
+static void *place(bf_t *bf, arena_t *arena, const char *name, size_t size,
+		   size_t align, arena_fit_t *fit)
+{
+	uintptr_t addr = arena_alloc(arena, name, size, align, fit);
+	if (!addr)
+	{
+		fprintf(stderr, "The %s does not fit in %s\n", name, arena->name);
+		exit(1);
+	}
+	return dma_memory_to_virtual(&bf->stage, addr);
+}
+
+static int ends_64k(uintptr_t addr, size_t size)
+{
+	return ((addr + size) & 0xffff) == 0;
+}
+
+static int is_hot(const bf_t *bf, const char *name)
+{
+	if (!bf->profile)
+		return 0;
+	for (size_t i = 0; i < bf->profile->count; ++i)
+	{
+		if (!strcmp(bf->profile->entries[i].name, name))
+			return bf->profile->entries[i].hot;
+	}
+	return 0;
+}
+
+/* Places size bytes named name in the hot pool if the profile marks
+ * them hot and they fit, otherwise in arena as place() does. */
+static void *place_hot(bf_t *bf, arena_t *arena, const char *name, size_t size,
+		       size_t align, arena_fit_t *fit)
+{
+	if (is_hot(bf, name))
+	{
+		uintptr_t addr = arena_alloc(&bf->hot, name, size, align, fit);
+		if (addr)
+			return dma_memory_to_virtual(&bf->stage, addr);
+	}
+	return place(bf, arena, name, size, align, fit);
+}
+
+/* Returns count control blocks for a gadget from the pool. */
+static cb_t take_cbs(bf_t *bf, const char *name, size_t count)
+{
+	return place_hot(bf, &bf->cbs, name, count * sizeof(struct control_block),
+			 sizeof(struct control_block), NULL);
+}
+
+static int by_density(const void *a, const void *b)
+{
+	const struct profile_entry *x = *(struct profile_entry *const *)a;
+	const struct profile_entry *y = *(struct profile_entry *const *)b;
+	// Compare count / size without dividing.
+	double dx = (double)x->count * y->size, dy = (double)y->count * x->size;
+	return dx < dy? 1 : dx > dy? -1 : 0;
+}
+
+/* Reads a profile written by write_profile() and marks hot the
+ * entries with the most accesses per byte that together fit in
+ * HOT_SIZE. */
+static void read_profile(profile_t *profile, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		perror(path);
+		exit(1);
+	}
+	size_t capacity = 0;
+	unsigned long long count;
+	size_t size;
+	char name[256];
+	int line = 0;
+	int got;
+	profile->entries = NULL;
+	profile->count = 0;
+	while ((got = fscanf(fp, "%llu %zu %255[^\n]", &count, &size, name)) != EOF)
+	{
+		++line;
+		if (got != 3)
+		{
+			fprintf(stderr, "%s:%d: expected a count, a size and a name\n",
+				path, line);
+			exit(1);
+		}
+		if (profile->count == capacity)
+		{
+			capacity = capacity? capacity * 2:64;
+			profile->entries = realloc(profile->entries,
+						   capacity * sizeof *profile->entries);
+		}
+		struct profile_entry *entry = &profile->entries[profile->count++];
+		entry->name = strdup(name);
+		entry->count = count;
+		entry->size = size;
+		entry->hot = 0;
+	}
+	fclose(fp);
+
+	struct profile_entry **order = malloc(profile->count * sizeof *order);
+	for (size_t i = 0; i < profile->count; ++i)
+		order[i] = &profile->entries[i];
+	qsort(order, profile->count, sizeof *order, by_density);
+	size_t left = HOT_SIZE;
+	for (size_t i = 0; i < profile->count; ++i)
+	{
+		if (order[i]->count && order[i]->size <= left)
+		{
+			order[i]->hot = 1;
+			left -= order[i]->size;
+		}
+	}
+	free(order);
+}
+
+static void free_profile(profile_t *profile)
+{
+	for (size_t i = 0; i < profile->count; ++i)
+		free(profile->entries[i].name);
+	free(profile->entries);
+}
+
+/* Adds the accesses to each block of arena to the profile, merging
+ * blocks of the same name. The blocks that are pools of bf are left
+ * out, as what is in them is counted on its own. */
+static void add_profile(profile_t *profile, size_t *capacity, const bf_t *bf,
+			const arena_t *arena)
+{
+	for (size_t i = 0; i < arena->count; ++i)
+	{
+		const struct arena_block *block = &arena->blocks[i];
+		if ((block->addr == bf->cbs.base && block->addr + block->size == bf->cbs.end) ||
+		    (block->addr == bf->hot.base && block->addr + block->size == bf->hot.end))
+			continue;
+		uint64_t count = dma_profile_count(block->addr, block->size);
+		size_t j = 0;
+		while (j < profile->count && strcmp(profile->entries[j].name, block->name))
+			++j;
+		if (j == profile->count)
+		{
+			if (profile->count == *capacity)
+			{
+				*capacity = *capacity? *capacity * 2:64;
+				profile->entries = realloc(profile->entries,
+							   *capacity * sizeof *profile->entries);
+			}
+			profile->entries[j] = (struct profile_entry){ strdup(block->name), 0, 0, 0 };
+			++profile->count;
+		}
+		profile->entries[j].count += count;
+		profile->entries[j].size += block->size;
+	}
+}
+
+static int by_count(const void *a, const void *b)
+{
+	const struct profile_entry *x = a, *y = b;
+	return x->count < y->count? 1 : x->count > y->count? -1 : 0;
+}
+
+/* Writes the accesses counted during the run to each gadget and
+ * table of bf, placed in memory, to path, the most accessed first. */
+static void write_profile(const char *path, const bf_t *bf, const arena_t *memory)
+{
+	profile_t profile = { NULL, 0 };
+	size_t capacity = 0;
+	add_profile(&profile, &capacity, bf, &bf->hot);
+	add_profile(&profile, &capacity, bf, &bf->cbs);
+	add_profile(&profile, &capacity, bf, memory);
+	qsort(profile.entries, profile.count, sizeof *profile.entries, by_count);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+	{
+		perror(path);
+		exit(1);
+	}
+	for (size_t i = 0; i < profile.count; ++i)
+		fprintf(fp, "%llu %zu %s\n", (unsigned long long)profile.entries[i].count,
+			profile.entries[i].size, profile.entries[i].name);
+	if (fclose(fp))
+	{
+		perror(path);
+		exit(1);
+	}
+	free_profile(&profile);
+}
+
+/* Records taken between two writes of the trace, 20 MiB of them. */
+#define TRACE_RECORDS 0x100000
+
+/* Names the blocks of arena in trace, leaving out the pools of bf as
+ * add_profile() does, so that every address has one name. */
+static void add_symbols(dma_trace_t *trace, const bf_t *bf, const arena_t *arena)
+{
+	for (size_t i = 0; i < arena->count; ++i)
+	{
+		const struct arena_block *block = &arena->blocks[i];
+		if ((block->addr == bf->cbs.base && block->addr + block->size == bf->cbs.end) ||
+		    (block->addr == bf->hot.base && block->addr + block->size == bf->hot.end))
+			continue;
+		if (dma_trace_symbol(trace, block->name, block->addr, block->size))
+		{
+			perror("dma_trace_symbol");
+			cleanup();
+			exit(1);
+		}
+	}
+}
+
+/* Gives the place in its file of each byte of bf's program, which
+ * the interpreter reads as it runs. */
+static void add_source(dma_trace_t *trace, const bf_t *bf, const source_t *source)
+{
+	struct dma_trace_position *positions = malloc(source->count * sizeof *positions);
+	if (!positions)
+	{
+		perror("malloc");
+		cleanup();
+		exit(1);
+	}
+	size_t line = 1, column = 1, pos = 0;
+	for (size_t off = 0; off < source->count; ++off)
+	{
+		walk_source(source, pos, source->positions[off], &line, &column);
+		pos = source->positions[off];
+		positions[off] = (struct dma_trace_position){ line, column };
+	}
+	if (dma_trace_source(trace, source->path, virtual_to_bus(bf->program),
+			     source->count, positions))
+	{
+		perror("dma_trace_source");
+		cleanup();
+		exit(1);
+	}
+	free(positions);
+}
+
 static void build_dispatch(bf_t *bf)
 {
 	// Build the dispatch table.
@@ -145,8 +853,17 @@ static void build_dispatch(bf_t *bf)
 	bf->dispatch_table[']'] = offsetof(insn_table_t, rcond);
 	bf->dispatch_table[','] = offsetof(insn_table_t, input);
 	bf->dispatch_table['.'] = offsetof(insn_table_t, output);
-
-	cb_t cb = bf->next_cb;
+	bf->dispatch_table[ADD_N_OPCODE] = offsetof(insn_table_t, add_n);
+	bf->dispatch_table[ADD_AT_OPCODE] = offsetof(insn_table_t, add_at);
+	bf->dispatch_table[RIGHT_N_OPCODE] = offsetof(insn_table_t, right_n);
+	bf->dispatch_table[LEFT_N_OPCODE] = offsetof(insn_table_t, left_n);
+	bf->dispatch_table[CLEAR_OPCODE] = offsetof(insn_table_t, clear);
+	bf->dispatch_table[SCAN_RIGHT_OPCODE] = offsetof(insn_table_t, scan_right);
+	bf->dispatch_table[SCAN_LEFT_OPCODE] = offsetof(insn_table_t, scan_left);
+	bf->dispatch_table[LOAD_OPCODE] = offsetof(insn_table_t, load);
+	bf->dispatch_table[MUL_OPCODE] = offsetof(insn_table_t, mul);
+
+	cb_t cb = take_cbs(bf, "dispatch", 6);
 	// To dispatch an instruction:
 	// 0. Load the pc into the source of cb[1]
 	// 1. Load the byte at the pc to use as an offset into the
@@ -156,493 +873,875 @@ static void build_dispatch(bf_t *bf)
 	// 3. Load 4 bytes from the insn_table to write into the next
 	//	control block of tramp
 	// 4. Do nothing in tramp.
-	setup_cb(cb + 0, &cb[1].source_ad, bf->pc, 4, cb + 1);
-	setup_cb(cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
-	setup_cb(cb + 2, &cb[3].source_ad, bf->dispatch_table, 1, cb + 3);
-	setup_cb(cb + 3, &cb[4].nextconbk, bf->insn_table, 4, cb + 4);
-	setup_cb(cb + 4, cb + 4, cb + 4, 1, NULL);
-	setup_cb(cb + 5, cb + 5, cb + 5, 1, NULL);
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->pc, 4, cb + 1);
+	setup_cb(bf, cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
+	setup_cb(bf, cb + 2, &cb[3].source_ad, bf->dispatch_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, &cb[4].nextconbk, bf->insn_table, 4, cb + 4);
+	setup_cb(bf, cb + 4, cb + 4, cb + 4, 1, NULL);
+	setup_cb(bf, cb + 5, cb + 5, cb + 5, 1, NULL);
 
 	bf->dispatch = cb;
 	bf->tramp = cb + 4;
 	bf->tramp2 = cb + 5;
-	bf->next_cb = cb + 6;
 }
 
-/* This is a generic 4-byte increment gadget. The source address of
- * the first control block contains the address of the 4-byte aligned
- * uint32_t to increment. After the gadget is finished, it executes
- * the trampoline gadget tramp. */
-static void build_inc_4(bf_t *bf)
+/* The compiled program has no dispatch loop, it only needs the
+ * trampolines used by the counter gadgets. */
+static void build_tramp(bf_t *bf)
+{
+	cb_t cb = take_cbs(bf, "trampolines", 2);
+	setup_cb(bf, cb + 0, cb + 0, cb + 0, 1, NULL);
+	setup_cb(bf, cb + 1, cb + 1, cb + 1, 1, NULL);
+
+	bf->tramp = cb + 0;
+	bf->tramp2 = cb + 1;
+}
+
+/* Sets up cb as a 2D transfer that copies the size bytes at src into
+ * the low bytes of the source addresses of the count control blocks
+ * that follow it. */
+static void setup_fanout(bf_t *bf, cb_t cb, volatile void *src, int size, int count)
+{
+	setup_cb(bf, cb, &cb[1].source_ad, src, ((count - 1) << 16) | size, cb + 1);
+	cb->ti |= TI_TDMODE;
+	cb->stride = (uint16_t)(sizeof(struct control_block) - size) << 16 |
+		(uint16_t)-size;
+}
+
+/* Sets up cb as a 2D transfer that gathers a 16-bit value into dest
+ * from two 256-byte planes, its low byte from table[i] and its high
+ * byte from table[0x100 + i], where i is written into the LSB of the
+ * source by an earlier control block. */
+static void setup_gather(bf_t *bf, cb_t cb, volatile void *dest, vuint8_t *table, cb_t next)
+{
+	setup_cb(bf, cb, dest, table, 1 << 16 | 1, next);
+	cb->ti |= TI_TDMODE;
+	cb->stride = 0xff;
+}
+
+/* This is a constant-time counter gadget. It increments (decrements)
+ * the 16-bit value at lo by looking it up in the 64 K-entry
+ * successor (predecessor) tables and then executes next. Only when
+ * the low half wraps does it carry into (borrow from) upper: the 2
+ * bytes at upper through the same tables, or if upper_table is given
+ * the byte at upper through it. Without upper the low half simply
+ * wraps. index is the gadget's entry in the conditional table, and
+ * name names its control blocks. */
+static cb_t build_counter(bf_t *bf, const char *name, vuint8_t *lo, vuint8_t *upper,
+			  vuint8_t *upper_table, int dec, size_t index, cb_t next)
 {
 	assert(bf->tramp);
-	assert(bf->tramp2);
-	cb_t cb = bf->next_cb;
-
-	/* The basic algorithm is
-	 *	 if (++*input)
-	 *		 goto tramp;
-	 *	 ++input;
-	 *	 if (++*input)
-	 *		 goto tramp;
-	 *	 ++input;
-	 *	 if (++*input)
-	 *		 goto tramp;
-	 *	 ++*input;
-	 * tramp:
-	 */
-	
-	bf->inc_4 = cb;
-	for (int i = 0; ; ++i)
-	{	
-		// 0. Copy 1 byte of the input into cb[2]'s source. This
-		//	LSB is used as an offset into the inc_table.
-		// 1. Copy the input into cb[2]'s destination.
-		// 2. Load from the inc_table into the destination. 
-		vuint32_t *input = &cb[0].source_ad;
-		setup_cb(cb + 0, &cb[2].source_ad, NULL, 1, cb + 1);
-		setup_cb(cb + 1, &cb[2].dest_ad, input, 4, cb + 2);
-		if (i == 3)
-		{
-			// Once we perform the increment, we're done
-			// so goto tramp.
-			setup_cb(cb + 2, NULL, bf->inc_table, 1, bf->tramp);
-			cb = cb + 3;
-			break;
-		}
-		// Perform the increment and continue.
-		setup_cb(cb + 2, NULL, bf->inc_table, 1, cb + 3);
-
-		// 3. Copy the input address into cb[3]'s source.
-		// 4. Load the LSB (which we just wrote) and use as an index
-		//	into the boolean_inc_table.
-		// 5. Load from the boolean_inc_table and use as the 2nd LSB into
-		//	the conditional_table.
-		// 6. Load the offset from the conditional_table into tramp2
-		//	and execute tramp2.
-		setup_cb(cb + 3, &cb[4].source_ad, input, 4, cb + 4);
-		setup_cb(cb + 4, &cb[5].source_ad, NULL, 1, cb + 5);
-		setup_cb(cb + 5, (vuint8_t *)&cb[6].source_ad + 1, bf->boolean_inc_table, 1, cb + 6);
-		setup_cb(cb + 6, &bf->tramp2->nextconbk, bf->conditional_table + INC_4_INDEX + i, 4, bf->tramp2);
-
-		// If the value is 0, then we need to increment the next byte;
-		// otherwise, goto tramp.
-		bf->conditional_table[INC_4_INDEX + i] = virtual_to_bus(cb + 7);
-		bf->conditional_table[INC_4_INDEX + i + 0x40] = virtual_to_bus(bf->tramp);
-
-		// Now we need to repeat the above, but we need to increment
-		// the input address so that we operate on the next byte of
-		// the word.
-		
-		// 7. Copy the input address into cb[7]'s source.
-		// 8. Load the LSB of the address and use as an offset into
-		//	inc_table.
-		// 9. Load the incremented address and store it in
-		//	cb[10]'s LSB.
-		setup_cb(cb + 7, &cb[10].source_ad, input, 4, cb + 8);
-		setup_cb(cb + 8, &cb[9].source_ad, input, 1, cb + 9);
-		setup_cb(cb + 9, &cb[10].source_ad, bf->inc_table, 1, cb + 10);
-		
-		// At this point, we can simply repeat
-		cb = cb + 10;
-	}
-
-	bf->next_cb = cb;
-}
-
-/* This is a generic 4-byte decrement gadget. The source address of
- * the first control block contains the address of the 4-byte aligned
- * uint32_t to decrement. After the gadget is finished, it executes
- * the trampoline gadget tramp. */
-static void build_dec_4(bf_t *bf)
+	vuint8_t *lo_table = dec? bf->pred_lo_table:bf->succ_lo_table;
+	vuint8_t *hi_table = dec? bf->pred_hi_table:bf->succ_hi_table;
+	cb_t cb = take_cbs(bf, name, !upper? 3:upper_table? 7:8);
+
+	if (!upper)
+	{
+		setup_fanout(bf, cb + 0, lo, 2, 2);
+		setup_cb(bf, cb + 1, lo, lo_table, 1, cb + 2);
+		setup_cb(bf, cb + 2, lo + 1, hi_table, 1, next);
+		return cb;
+	}
+
+	// 0. Copy the low half into the low halves of the sources of
+	//	cb[1], cb[2] and cb[3].
+	// 1/2. Store the low and high bytes of the successor.
+	// 3. Load from the wrap table and use as the 2nd LSB into the
+	//	conditional_table.
+	// 4. Load the offset from the conditional_table into tramp and
+	//	execute tramp.
+	setup_fanout(bf, cb + 0, lo, 2, 3);
+	setup_cb(bf, cb + 1, lo, lo_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, lo + 1, hi_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, (vuint8_t *)&cb[4].source_ad + 1,
+		 dec? bf->wrap_dec_table:bf->wrap_inc_table, 1, cb + 4);
+	setup_cb(bf, cb + 4, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+
+	// If the low half wrapped, update the upper bytes; otherwise
+	// goto next.
+	set_address(bf, &bf->conditional_table[index], next);
+	set_address(bf, &bf->conditional_table[index + 0x40], cb + 5);
+	if (!upper_table)
+	{
+		setup_fanout(bf, cb + 5, upper, 2, 2);
+		setup_cb(bf, cb + 6, upper, lo_table, 1, cb + 7);
+		setup_cb(bf, cb + 7, upper + 1, hi_table, 1, next);
+	}
+	else
+	{
+		setup_cb(bf, cb + 5, &cb[6].source_ad, upper, 1, cb + 6);
+		setup_cb(bf, cb + 6, upper, upper_table, 1, next);
+	}
+	return cb;
+}
+
+/* The byte-sized version of build_counter for the carry out of the
+ * LSB of the head: it increments (decrements) the byte at lo through
+ * the inc_table (dec_table) and, when that wraps and upper is given,
+ * the byte at upper through upper_table. */
+static cb_t build_byte_counter(bf_t *bf, const char *name, vuint8_t *lo, vuint8_t *upper,
+			       vuint8_t *upper_table, int dec, size_t index, cb_t next)
 {
 	assert(bf->tramp);
-	assert(bf->tramp2);
-	cb_t cb = bf->next_cb;
-
-	/* The basic algorithm is
-	 *	 if (--*input)
-	 *		 goto tramp;
-	 *	 ++input;
-	 *	 if (--*input)
-	 *		 goto tramp;
-	 *	 ++input;
-	 *	 if (--*input)
-	 *		 goto tramp;
-	 *	 --*input;
-	 *
-	 * tramp:
-	 */
-	
-	bf->dec_4 = cb;
-	for (int i = 0; ; ++i)
-	{
-		// 0. Copy 1 byte of the input into cb[2]'s source. This
-		//      LSB is used as an offset into the inc_table.
-		// 1. Copy the input into cb[2]'s destination.
-		// 2. Load from the dec_table into the destination. 
-		vuint32_t *input = &cb[0].source_ad;
-		setup_cb(cb + 0, &cb[2].source_ad, NULL, 1, cb + 1);
-		setup_cb(cb + 1, &cb[2].dest_ad, input, 4, cb + 2);
-		if (i == 3)
-		{
-			// Once we perform the decrement, we're done
-			// so goto tramp.
-			setup_cb(cb + 2, NULL, bf->dec_table, 1, bf->tramp);
-			cb = cb + 3;
-			break;
-		}
-		// Perform the decrement and continue.
-		setup_cb(cb + 2, NULL, bf->dec_table, 1, cb + 3);
-
-		// 4. Copy the input address into cb[3]'s source
-		// 5. Load the LSB (which we just wrote) and use as an index
-		//	into the boolean_dec_table.
-		// 6. Load from the boolean_dec_table and use as the 2nd LSB
-		//	into the conditional_table.
-		// 7. Load the offset from the conditional_table into tramp2
-		//	and execute tramp2.
-		setup_cb(cb + 3, &cb[4].source_ad, input, 4, cb + 4);
-		setup_cb(cb + 4, &cb[5].source_ad, NULL, 1, cb + 5);
-		setup_cb(cb + 5, (vuint8_t *)&cb[6].source_ad + 1, bf->boolean_dec_table, 1, cb + 6);
-		setup_cb(cb + 6, &bf->tramp2->nextconbk, bf->conditional_table + DEC_4_INDEX + i, 4, bf->tramp2);
-
-		// If the value is 255, then we need to decrement the next byte;
-		// otherwise, goto tramp.
-		bf->conditional_table[DEC_4_INDEX + i] = virtual_to_bus(cb + 7);
-		bf->conditional_table[DEC_4_INDEX + i + 0x40] = virtual_to_bus(bf->tramp);
-
-		// Now we need to repeat the above, but we need to increment
-		// the input address so that we operate on the next byte of
-		// the word.
-		
-		// 8. Copy the input address into cb[7]'s source.
-		// 9. Load the LSB of the address and use as an offset into
-		//	inc_table.
-		// 10. Load the incremented address and store it in
-		//	 cb[11]'s LSB.
-		setup_cb(cb + 7, &cb[10].source_ad, input, 4, cb + 8);
-		setup_cb(cb + 8, &cb[9].source_ad, input, 1, cb + 9);
-		setup_cb(cb + 9, &cb[10].source_ad, bf->inc_table, 1, cb + 10);
-		
-		// At this point, we can simply repeat
-		cb = cb + 10;
-	}	
-
-	bf->next_cb = cb;
+	cb_t cb = take_cbs(bf, name, upper? 7:2);
+
+	// 0/1. Store the successor of the byte.
+	// 2/4. If it wrapped to 0 (0xff) goto 5, else goto next.
+	// 5/6. Store the successor of the upper byte.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, lo, 1, cb + 1);
+	setup_cb(bf, cb + 1, lo, dec? bf->dec_table:bf->inc_table, 1, upper? cb + 2:next);
+	if (!upper)
+		return cb;
+	setup_cb(bf, cb + 2, &cb[3].source_ad, lo, 1, cb + 3);
+	setup_cb(bf, cb + 3, (vuint8_t *)&cb[4].source_ad + 1,
+		 dec? bf->boolean_dec_table:bf->boolean_inc_table, 1, cb + 4);
+	setup_cb(bf, cb + 4, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[index], cb + 5);
+	set_address(bf, &bf->conditional_table[index + 0x40], next);
+	setup_cb(bf, cb + 5, &cb[6].source_ad, upper, 1, cb + 6);
+	setup_cb(bf, cb + 6, upper, upper_table, 1, next);
+	return cb;
+}
+
+/* Builds a gadget that moves the head one cell right (left) and then
+ * executes next. On a flat tape the whole head is a counter; on a
+ * single-page tape only its low half changes and wraps; on a paged
+ * tape the low half carries into the page byte, which wraps from the
+ * last page to the first. */
+static cb_t build_head_step(bf_t *bf, const char *name, int dec, size_t index, cb_t next)
+{
+	vuint8_t *head = (vuint8_t *)bf->head;
+	if (!bf->tape_pages)
+		return build_counter(bf, name, head, head + 2, NULL, dec, index, next);
+	if (bf->tape_pages == 1)
+		return build_counter(bf, name, head, NULL, NULL, dec, index, next);
+	return build_counter(bf, name, head, head + 2,
+			     dec? bf->page_dec_table:bf->page_inc_table, dec, index, next);
 }
 
 static void build_next_insn(bf_t *bf)
 {
 	assert(bf->dispatch);
-	assert(bf->inc_4);
-	assert(bf->tramp);
 
-	cb_t cb = bf->next_cb;
 	// To execute the next instruction, increment the pc by 1 and
-	// then goto dispatch by using the trampoline 
-	setup_cb(cb + 0, &bf->inc_4->source_ad, &cb[0].stride, 4, cb + 1);	
-	cb[0].stride = virtual_to_bus(bf->pc);
-	setup_cb(cb + 1, &bf->tramp->nextconbk, &cb[1].stride, 4, bf->inc_4);
-	cb[1].stride = virtual_to_bus(bf->dispatch);
-
-	bf->next_insn = cb;
-	bf->next_cb = cb + 2;
+	// then goto dispatch.
+	vuint8_t *pc = (vuint8_t *)bf->pc;
+	bf->next_insn = build_counter(bf, "next_insn", pc, pc + 2, NULL, 0, PC_INC_INDEX, bf->dispatch);
 }
 
 static void build_incdec(bf_t *bf)
 {
 	assert(bf->next_insn);
 
-	// Build the inc/dec tables.
-	for (int i = 0; i < 256; ++i)
-	{
-		bf->inc_table[i] = i + 1;
-		bf->dec_table[i] = i - 1;
-	}
-
-	cb_t cb = bf->next_cb;
+	cb_t cb = take_cbs(bf, "inc and dec", 8);
 	// Set up the control blocks for inc.
 	bf->inc = cb;
 	// 0. Copy from the head into cb[2]'s source
-	setup_cb(cb + 0, &cb[2].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 0, &cb[2].source_ad, bf->head, 4, cb + 1);
 	// 1. Copy from the head into cb[3]'s destination
-	setup_cb(cb + 1, &cb[3].dest_ad, bf->head, 4, cb + 2);
+	setup_cb(bf, cb + 1, &cb[3].dest_ad, bf->head, 4, cb + 2);
 	// 2. Copy from the tape into the LSB of cb[3]'s source
-	setup_cb(cb + 2, &cb[3].source_ad, NULL, 1, cb + 3);
+	setup_cb(bf, cb + 2, &cb[3].source_ad, NULL, 1, cb + 3);
 	// 3. Copy from the increment table into the tape
-	setup_cb(cb + 3, NULL, bf->inc_table, 1, bf->next_insn);
+	setup_cb(bf, cb + 3, NULL, bf->inc_table, 1, bf->next_insn);
 	cb += 4;
 
 	// Set up the control blocks for dec which is identical to inc
 	// except for the table.
 	bf->dec = cb;
 	// 0. Copy from the head into cb[2]'s source
-	setup_cb(cb + 0, &cb[2].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 0, &cb[2].source_ad, bf->head, 4, cb + 1);
 	// 1. Copy from the head into cb[3]'s destination
-	setup_cb(cb + 1, &cb[3].dest_ad, bf->head, 4, cb + 2);
+	setup_cb(bf, cb + 1, &cb[3].dest_ad, bf->head, 4, cb + 2);
 	// 2. Copy from the tape into the LSB of cb[3]'s source
-	setup_cb(cb + 2, &cb[3].source_ad, NULL, 1, cb + 3);
+	setup_cb(bf, cb + 2, &cb[3].source_ad, NULL, 1, cb + 3);
 	// 3. Copy from the decrement table into the tape
-	setup_cb(cb + 3, NULL, bf->dec_table, 1, bf->next_insn);
-	cb += 4;
-
-	bf->next_cb = cb;
+	setup_cb(bf, cb + 3, NULL, bf->dec_table, 1, bf->next_insn);
 }
 
 static void build_rightleft(bf_t *bf)
 {
 	assert(bf->next_insn);
-	assert(bf->inc_4);
-	assert(bf->dec_4);
-
-	cb_t cb = bf->next_cb;
-	// To move right, increment the head by 1 and then goto
-	// next_insn via the trampoline.
-	setup_cb(cb + 0, &bf->inc_4->source_ad, &cb[0].stride, 4, cb + 1);
-	cb[0].stride = virtual_to_bus(bf->head);
-	setup_cb(cb + 1, &bf->tramp->nextconbk, &cb[1].stride, 4, bf->inc_4);
-	cb[1].stride = virtual_to_bus(bf->next_insn);
-	bf->right = cb;
-	cb += 2;
 
-	// To move left, decrement the head by 1 and then goto
-	// next_insn via the trampoline.
-	setup_cb(cb + 0, &bf->dec_4->source_ad, &cb[0].stride, 4, cb + 1);
-	cb[0].stride = virtual_to_bus(bf->head);
-	setup_cb(cb + 1, &bf->tramp->nextconbk, &cb[1].stride, 4, bf->dec_4);
-	cb[1].stride = virtual_to_bus(bf->next_insn);
-	bf->left = cb;
-	bf->next_cb = cb + 2;
+	// To move right (left), increment (decrement) the head by 1
+	// and then goto next_insn.
+	bf->right = build_head_step(bf, "right", 0, HEAD_INC_INDEX, bf->next_insn);
+	bf->left = build_head_step(bf, "left", 1, HEAD_DEC_INDEX, bf->next_insn);
 }
 
-static void build_cond(bf_t *bf)
-{
-	assert(bf->next_insn);
-	assert(bf->inc_4);
-	assert(bf->dec_4);
+/* The jump table holds the target of every bracket, indexed by its
+ * offset in the program. Byte i of the target of the bracket at
+ * offset off lives at jump_table + i * JUMP_PLANE_SIZE + off so a
+ * single 2D transfer with a source stride of JUMP_PLANE_SIZE - 1 can
+ * copy it into the pc. The program and the jump table are 64 KB
+ * aligned so the low half of the pc is the offset. */
+#define JUMP_PLANE_SIZE 0x8000
 
-	// Build bracket table with offsets into scan(right||left)_table.
-	memset((void *)bf->bracket_table, 0, 0x100);
-	bf->bracket_table['['] = 0x4;
-	bf->bracket_table[']'] = 0x8;
-	bf->bracket_table[0] = 0xc;  
+static void set_jump(bf_t *bf, size_t off, vuint8_t *target)
+{
+	uint32_t addr = virtual_to_bus(target);
+	for (int i = 0; i < 4; ++i)
+		bf->jump_table[i * JUMP_PLANE_SIZE + off] = addr >> (8 * i);
+}
 
-	cb_t cb = bf->next_cb;
-	// Set up the control blocks for lcond.
-	bf->lcond = cb;
+/* The offset table holds (offset - 1) of each ADD_AT as a 16-bit
+ * stride, split into two planes like the jump table. */
+static void set_offset(bf_t *bf, size_t off, int offset)
+{
+	uint16_t stride = offset - 1;
+	bf->offset_table[off] = stride;
+	bf->offset_table[JUMP_PLANE_SIZE + off] = stride >> 8;
+}
 
-	//
-	// LCOND: 
-	//
-	// 0/3. If !*head goto next_insn, else increment lc and scan right.
-	setup_cb(cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
-	setup_cb(cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
-	setup_cb(cb + 2, (vuint8_t *)&cb[3].source_ad + 1, bf->boolean_inc_table, 1, cb + 3);
-	setup_cb(cb + 3, &bf->tramp->nextconbk, bf->conditional_table + LCOND_INDEX, 4, bf->tramp);
-	bf->conditional_table[LCOND_INDEX] = virtual_to_bus(cb + 4); // Increment lc, scan right. 
-	bf->conditional_table[LCOND_INDEX + 0x40] = virtual_to_bus(bf->next_insn); // Goto next_insn. 
-
-	// 4/5. Increment the loop counter (lc).
-	setup_cb(cb + 4, &bf->inc_4->source_ad, &cb[4].stride, 4, cb + 5);	
-	cb[4].stride = virtual_to_bus(bf->lc);
-	setup_cb(cb + 5, &bf->tramp->nextconbk, &cb[5].stride, 4, bf->inc_4);
-	cb[5].stride = virtual_to_bus(cb + 6);
-
-	// SCAN RIGHT:
-	// 6/7. Increment the program counter (pc).
-	setup_cb(cb + 6, &bf->inc_4->source_ad, &cb[6].stride, 4, cb + 7);	
-	cb[6].stride = virtual_to_bus(bf->pc);
-	setup_cb(cb + 7, &bf->tramp->nextconbk, &cb[7].stride, 4, bf->inc_4);
-	cb[7].stride = virtual_to_bus(cb + 8);
-
-	// 8. Copy the pc into cb[9]'s source. 
-	setup_cb(cb + 8, &cb[9].source_ad, bf->pc, 4, cb + 9);
-	// 9. Load the LSB and use as index into the bracket_table.
-	setup_cb(cb + 9, &cb[10].source_ad, NULL, 1, cb + 10);
-	// 10. Load from the bracket_table and use as index into scanright table.
-	setup_cb(cb + 10, &cb[11].source_ad, bf->bracket_table, 1, cb + 11);
-	// 11. Load the offset from scanright_table into tramp and execute tramp.
-	setup_cb(cb + 11, &bf->tramp->nextconbk, bf->scanright_table, 4, bf->tramp);
-
-	// Build scanright table after we setup the control blocks.
-	memset((void *)bf->scanright_table, 0, 0xc);
-	bf->scanright_table[0] = virtual_to_bus(cb + 6); // Scan right.
-	bf->scanright_table[1] = virtual_to_bus(cb + 4); // If *pc = '['; ++lc.
-	bf->scanright_table[2] = virtual_to_bus(cb + 12); // If *pc = ']'; --lc.
-	bf->scanright_table[3] = 0; // No matching ']' quit.
-
-	// 12/13. Decrement the loop counter (lc). 
-	setup_cb(cb + 12, &bf->dec_4->source_ad, &cb[12].stride, 4, cb + 13);	
-	cb[12].stride = virtual_to_bus(bf->lc);
-	setup_cb(cb + 13, &bf->tramp->nextconbk, &cb[13].stride, 4, bf->dec_4);
-	cb[13].stride = virtual_to_bus(cb + 14);
-
-	// 14/16. If the LSB of lc is 0 then check next byte, else scan right. 
-	setup_cb(cb + 14, &cb[15].source_ad, bf->lc, 1, cb + 15);
-	setup_cb(cb + 15, (vuint8_t *)&cb[16].source_ad + 1, bf->boolean_inc_table, 1, cb + 16);
-	setup_cb(cb + 16, &bf->tramp->nextconbk, bf->conditional_table + LCOND_LC_INDEX_0, 4, bf->tramp);
-	bf->conditional_table[LCOND_LC_INDEX_0] = virtual_to_bus(cb + 17); // Check next byte.
-	bf->conditional_table[LCOND_LC_INDEX_0 + 0x40] = virtual_to_bus(cb + 6); // Scan right.
-
-	// 17/19. 2nd LSB.
-	setup_cb(cb + 17, &cb[18].source_ad, (vuint8_t *)bf->lc + 1, 1, cb + 18);
-	setup_cb(cb + 18, (vuint8_t *)&cb[19].source_ad + 1, bf->boolean_inc_table, 1, cb + 19);
-	setup_cb(cb + 19, &bf->tramp->nextconbk, bf->conditional_table + LCOND_LC_INDEX_1, 4, bf->tramp);
-	bf->conditional_table[LCOND_LC_INDEX_1] = virtual_to_bus(cb + 20); // Check next byte.
-	bf->conditional_table[LCOND_LC_INDEX_1 + 0x40] = virtual_to_bus(cb + 6); // Scan right.   
-
-	// 20/22. 3rd LSB.
-	setup_cb(cb + 20, &cb[21].source_ad, (vuint8_t *)bf->lc + 2, 1, cb + 21);
-	setup_cb(cb + 21, (vuint8_t *)&cb[22].source_ad + 1, bf->boolean_inc_table, 1, cb + 22);
-	setup_cb(cb + 22, &bf->tramp->nextconbk, bf->conditional_table + LCOND_LC_INDEX_2, 4, bf->tramp);
-	bf->conditional_table[LCOND_LC_INDEX_2] = virtual_to_bus(cb + 23); // Check next byte.
-	bf->conditional_table[LCOND_LC_INDEX_2 + 0x40] = virtual_to_bus(cb + 6); // Scan right.   
-
-	// 23/25. 4th LSB. 
-	setup_cb(cb + 23, &cb[24].source_ad, (vuint8_t *)bf->lc + 3, 1, cb + 24);
-	setup_cb(cb + 24, (vuint8_t *)&cb[25].source_ad + 1, bf->boolean_inc_table, 1, cb + 25);
-	setup_cb(cb + 25, &bf->tramp->nextconbk, bf->conditional_table + LCOND_LC_INDEX_3, 4, bf->tramp); 
-	bf->conditional_table[LCOND_LC_INDEX_3] = virtual_to_bus(bf->next_insn); // Goto next_insn.
-	bf->conditional_table[LCOND_LC_INDEX_3 + 0x40] = virtual_to_bus(cb + 6); // Scan right.		   
-
-	cb += 26;
-	// Set up the control blocks for rcond.
-	bf->rcond = cb;
+static void build_jump_table(bf_t *bf, vuint8_t *program, size_t program_size,
+			     const size_t *match)
+{
+	// Both brackets jump to the instruction after their match.
+	for (size_t off = 0; off < program_size; ++off)
+	{
+		if (program[off] == '[' || program[off] == ']')
+			set_jump(bf, off, program + match[off] + 1);
+	}
+}
+
+static void build_cond(bf_t *bf)
+{
+	assert(bf->next_insn);
+	assert(bf->dispatch);
+
+	cb_t cb = take_cbs(bf, "jump and conditionals", 10);
+	bf->jump = cb;
 
 	//
-	// RCOND: 
+	// JUMP:
 	//
-	// 0/3. If !*head goto next_insn, else increment lc and scan left.
-	setup_cb(cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
-	setup_cb(cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
-	setup_cb(cb + 2, (vuint8_t *)&cb[3].source_ad + 1, bf->boolean_inc_table, 1, cb + 3);
-	setup_cb(cb + 3, &bf->tramp->nextconbk, bf->conditional_table + RCOND_INDEX, 4, bf->tramp);
-	bf->conditional_table[RCOND_INDEX] = virtual_to_bus(bf->next_insn); // Goto next_insn. 
-	bf->conditional_table[RCOND_INDEX + 0x40] = virtual_to_bus(cb + 4); // Increment lc, scan left.
-
-	// 4/5. Increment the loop counter (lc).
-	setup_cb(cb + 4, &bf->inc_4->source_ad, &cb[4].stride, 4, cb + 5);	
-	cb[4].stride = virtual_to_bus(bf->lc);
-	setup_cb(cb + 5, &bf->tramp->nextconbk, &cb[5].stride, 4, bf->inc_4);
-	cb[5].stride = virtual_to_bus(cb + 6);
-
-	// SCAN LEFT: 
-	// 6/7. Decrement the program counter (pc).
-	setup_cb(cb + 6, &bf->dec_4->source_ad, &cb[6].stride, 4, cb + 7);	
-	cb[6].stride = virtual_to_bus(bf->pc);
-	setup_cb(cb + 7, &bf->tramp->nextconbk, &cb[7].stride, 4, bf->dec_4);
-	cb[7].stride = virtual_to_bus(cb + 8);
-
-	// 8. Copy the pc into cb[9]'s source. 
-	setup_cb(cb + 8, &cb[9].source_ad, bf->pc, 4, cb + 9);
-	// 9. Load the LSB and use as index into the bracket_table.
-	setup_cb(cb + 9, &cb[10].source_ad, NULL, 1, cb + 10);
-	// 10. Load from the bracket_table and use as index into scanleft table.
-	setup_cb(cb + 10, &cb[11].source_ad, bf->bracket_table, 1, cb + 11);
-	// 11. Load the offset from scanleft_table into tramp2 and execute tramp.
-	setup_cb(cb + 11, &bf->tramp->nextconbk, bf->scanleft_table, 4, bf->tramp);
-
-	// 12/13. Decrement the loop counter (lc). 
-	setup_cb(cb + 12, &bf->dec_4->source_ad, &cb[12].stride, 4, cb + 13);	
-	cb[12].stride = virtual_to_bus(bf->lc);
-	setup_cb(cb + 13, &bf->tramp->nextconbk, &cb[13].stride, 4, bf->dec_4);
-	cb[13].stride = virtual_to_bus(cb + 14);
-
-	// Build scanleft table after we setup the control blocks.
-	memset((void *)bf->scanleft_table, 0, 0xc);
-	bf->scanleft_table[0] = virtual_to_bus(cb + 6); // Scan left.
-	bf->scanleft_table[1] = virtual_to_bus(cb + 12); // If *pc = '['.
-	bf->scanleft_table[2] = virtual_to_bus(cb + 4); // If *pc = ']'.
-	bf->scanleft_table[3] = 0; // No matching ']' quit.
-
-	// 15/19. If !*lc goto dispatch, else goto scan left.
-	setup_cb(cb + 14, &cb[15].source_ad, bf->lc, 1, cb + 15);
-	setup_cb(cb + 15, (vuint8_t *)&cb[16].source_ad + 1, bf->boolean_inc_table, 1, cb + 16);
-	setup_cb(cb + 16, &bf->tramp->nextconbk, bf->conditional_table + RCOND_LC_INDEX_0, 4, bf->tramp);
-	bf->conditional_table[RCOND_LC_INDEX_0] = virtual_to_bus(cb + 17); // Check next byte.
-	bf->conditional_table[RCOND_LC_INDEX_0 + 0x40] = virtual_to_bus(cb + 6); // Scan left.
-
-	// 2nd LSB.
-	setup_cb(cb + 17, &cb[18].source_ad, (vuint8_t *)bf->lc + 1, 1, cb + 18);
-	setup_cb(cb + 18, (vuint8_t *)&cb[19].source_ad + 1, bf->boolean_inc_table, 1, cb + 19);
-	setup_cb(cb + 19, &bf->tramp->nextconbk, bf->conditional_table + RCOND_LC_INDEX_1, 4, bf->tramp);
-	bf->conditional_table[RCOND_LC_INDEX_1] = virtual_to_bus(cb + 20); // Check next byte.
-	bf->conditional_table[RCOND_LC_INDEX_1 + 0x40] = virtual_to_bus(cb + 6); // Scan left.   
-
-	// 3rd LSB.
-	setup_cb(cb + 20, &cb[21].source_ad, (vuint8_t *)bf->lc + 2, 1, cb + 21);
-	setup_cb(cb + 21, (vuint8_t *)&cb[22].source_ad + 1, bf->boolean_inc_table, 1, cb + 22);
-	setup_cb(cb + 22, &bf->tramp->nextconbk, bf->conditional_table + RCOND_LC_INDEX_2, 4, bf->tramp);
-	bf->conditional_table[RCOND_LC_INDEX_2] = virtual_to_bus(cb + 23); // Check next byte.
-	bf->conditional_table[RCOND_LC_INDEX_2 + 0x40] = virtual_to_bus(cb + 6); // Scan left.   
-
-	// 4th LSB. 
-	setup_cb(cb + 23, &cb[24].source_ad, (vuint8_t *)bf->lc + 3, 1, cb + 24);
-	setup_cb(cb + 24, (vuint8_t *)&cb[25].source_ad + 1, bf->boolean_inc_table, 1, cb + 25);
-	setup_cb(cb + 25, &bf->tramp->nextconbk, bf->conditional_table + RCOND_LC_INDEX_3, 4, bf->tramp); 
-	bf->conditional_table[RCOND_LC_INDEX_3] = virtual_to_bus(bf->next_insn); // Goto next_insn.
-	bf->conditional_table[RCOND_LC_INDEX_3 + 0x40] = virtual_to_bus(cb + 6); // Scan left.	  
-
-	cb += 26;
-	bf->next_cb = cb;
+	// 0. Copy the low half of the pc (the offset of the bracket)
+	//	into the low half of cb[1]'s source.
+	// 1. Copy the 4 bytes of the target from the jump table into
+	//	the pc and dispatch it.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->pc, 2, cb + 1);
+	setup_cb(bf, cb + 1, bf->pc, bf->jump_table, (3 << 16) | 1, bf->dispatch);
+	cb[1].ti |= TI_TDMODE;
+	cb[1].stride = JUMP_PLANE_SIZE - 1;
+	cb += 2;
+
+	//
+	// LCOND:
+	//
+	// 0/3. If !*head goto jump, else goto next_insn.
+	bf->lcond = cb;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
+	setup_cb(bf, cb + 2, (vuint8_t *)&cb[3].source_ad + 1, bf->boolean_inc_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, &bf->tramp->nextconbk, bf->conditional_table + LCOND_INDEX, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[LCOND_INDEX], bf->jump);
+	set_address(bf, &bf->conditional_table[LCOND_INDEX + 0x40], bf->next_insn);
+	cb += 4;
+
+	//
+	// RCOND:
+	//
+	// 0/3. If !*head goto next_insn, else goto jump.
+	bf->rcond = cb;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
+	setup_cb(bf, cb + 2, (vuint8_t *)&cb[3].source_ad + 1, bf->boolean_inc_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, &bf->tramp->nextconbk, bf->conditional_table + RCOND_INDEX, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[RCOND_INDEX], bf->next_insn);
+	set_address(bf, &bf->conditional_table[RCOND_INDEX + 0x40], bf->jump);
 }
 
 
-static void build_io(bf_t *bf)
+/* Rewrites the multiply loop at off, length bytes long, into LOAD,
+ * then RIGHT_N or LEFT_N and MUL for each target, then the move back
+ * and CLEAR. The loop always has room for these: it holds at least
+ * one + or - per target and two moves per cell of its extent. */
+static void lower_mul_loop(bf_t *bf, vuint8_t *program, size_t off, size_t length,
+			   const mul_target_t *targets, int count)
+{
+	size_t end = off + length;
+	size_t insn = off;
+	int pos = 0;
+
+	// The head ends up at offset 0 after the last target.
+	program[insn++] = LOAD_OPCODE;
+	for (int i = 0; i <= count; ++i)
+	{
+		int move = (i < count? targets[i].offset:0) - pos;
+		if (move)
+		{
+			program[insn] = move > 0? RIGHT_N_OPCODE:LEFT_N_OPCODE;
+			bf->operand_table[insn] = move;
+			set_jump(bf, insn, program + insn + 1);
+			++insn;
+		}
+		if (i == count)
+			break;
+		program[insn] = MUL_OPCODE;
+		bf->operand_table[insn] = targets[i].factor;
+		set_jump(bf, insn, program + insn + 1);
+		++insn;
+		pos = targets[i].offset;
+	}
+	assert(insn < end);
+	program[insn] = CLEAR_OPCODE;
+	set_jump(bf, insn, program + end);
+}
+
+/* Rewrites the block at off, which ends at end, into an ADD_N (for
+ * the cell at the head) or ADD_AT (for any other cell) for each cell
+ * it changes, followed by RIGHT_N or LEFT_N instructions that move
+ * the head by its net move up to 255 cells at a time. The cell the
+ * head ends up on, if changed, is done last with the cheaper ADD_N.
+ * The block always has room for these: every cell it changes takes
+ * at least one + or - and every 255 cells of net move at least one
+ * > or <. */
+static size_t lower_move(bf_t *bf, vuint8_t *program, size_t insn, int move)
+{
+	while (move)
+	{
+		int step = move > 0xff? 0xff:move < -0xff? -0xff:move;
+		program[insn] = step > 0? RIGHT_N_OPCODE:LEFT_N_OPCODE;
+		bf->operand_table[insn] = step;
+		set_jump(bf, insn, program + insn + 1);
+		++insn;
+		move -= step;
+	}
+	return insn;
+}
+
+static void lower_block(bf_t *bf, vuint8_t *program, size_t off, size_t end,
+			const cell_op_t *ops, int count, int move)
+{
+	size_t insn = off;
+	uint8_t last = 0;
+	int pos = 0;
+
+	// On a wrapping tape head + offset could run past its end, so
+	// walk the head to each cell in the order the block first
+	// touched them instead. The block has room for these moves too:
+	// it passed over each distance between them.
+	for (int i = 0; bf->tape_pages && i < count; ++i)
+	{
+		if (!ops[i].delta)
+			continue;
+		insn = lower_move(bf, program, insn, ops[i].offset - pos);
+		pos = ops[i].offset;
+		program[insn] = ADD_N_OPCODE;
+		bf->operand_table[insn] = ops[i].delta;
+		set_jump(bf, insn, program + insn + 1);
+		++insn;
+	}
+	for (int i = 0; !bf->tape_pages && i < count; ++i)
+	{
+		if (ops[i].offset == move)
+			last = ops[i].delta;
+		if (!ops[i].delta || ops[i].offset == move)
+			continue;
+		program[insn] = ops[i].offset? ADD_AT_OPCODE:ADD_N_OPCODE;
+		bf->operand_table[insn] = ops[i].delta;
+		if (ops[i].offset)
+			set_offset(bf, insn, ops[i].offset);
+		set_jump(bf, insn, program + insn + 1);
+		++insn;
+	}
+	insn = lower_move(bf, program, insn, move - pos);
+	// A block such as +- or >< does nothing and still needs one
+	// instruction.
+	if (last || insn == off)
+	{
+		program[insn] = ADD_N_OPCODE;
+		bf->operand_table[insn] = last;
+		++insn;
+	}
+	assert(insn <= end);
+	set_jump(bf, insn - 1, program + end);
+}
+
+/* Lowers every block of +-<> with lower_block. Clear and scan loops
+ * become a single CLEAR, SCAN_RIGHT or SCAN_LEFT instruction; the
+ * jump table entry of their '[' already points past the loop.
+ * Multiply loops are lowered by lower_mul_loop. */
+static void fold_runs(bf_t *bf, vuint8_t *program, size_t program_size,
+		      const size_t *match)
+{
+	for (size_t off = 0; off < program_size;)
+	{
+		uint8_t c = program[off];
+		size_t end, length;
+		mul_target_t targets[MAX_MUL_TARGETS];
+		cell_op_t ops[MAX_BLOCK_CELLS];
+		int count;
+		int move;
+		if (c == '[' && match[off] != off + 2 &&
+		    (count = parse_mul_loop(program + off, &length, targets)) >= 0)
+		{
+			lower_mul_loop(bf, program, off, length, targets, count);
+			off += length;
+			continue;
+		}
+		else if (c == '[' && match[off] == off + 2)
+		{
+			switch (program[off + 1])
+			{
+			case '+':
+			case '-':
+				program[off] = CLEAR_OPCODE;
+				break;
+			case '>':
+				program[off] = SCAN_RIGHT_OPCODE;
+				break;
+			case '<':
+				program[off] = SCAN_LEFT_OPCODE;
+				break;
+			default:
+				++off;
+				continue;
+			}
+			off += 3;
+			continue;
+		}
+		else if (c == '+' || c == '-' || c == '>' || c == '<')
+		{
+			end = off + parse_block(program + off, ops, &count, &move);
+			lower_block(bf, program, off, end, ops, count, move);
+			off = end;
+		}
+		else
+			++off;
+	}
+}
+
+/* Sets up cb[0] to cb[3] to add the add_table row selected by the 2nd
+ * LSB of cb[2]'s source to the cell at head + offset and then goto
+ * next. Both the load and the store are 2-row 2D transfers whose
+ * stride of offset - 1 reaches from the head to the cell; the first
+ * row reads the cell at the head and the store writes it back
+ * unchanged through stage. */
+static void setup_add_at(bf_t *bf, cb_t cb, int offset, cb_t next)
+{
+	vuint8_t *stage = (vuint8_t *)&cb[3].reserved[0];
+
+	// 0. Copy the head into cb[1]'s source and cb[3]'s destination.
+	// 1. Load the cell at the head into stage[0] and the cell at
+	//	head + offset into the LSB of cb[2]'s source.
+	// 2. Store cell + operand into stage[1].
+	// 3. Store stage[0] into the head and stage[1] into head + offset.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, (1 << 16) | 4, cb + 1);
+	cb[0].ti |= TI_TDMODE;
+	cb[0].stride = (uint32_t)(uint16_t)((vuint8_t *)&cb[3].dest_ad -
+					    (vuint8_t *)&cb[1].source_ad - 4) << 16 | (uint16_t)-4;
+	setup_cb(bf, cb + 1, stage, NULL, (1 << 16) | 1, cb + 2);
+	cb[1].ti |= TI_TDMODE;
+	cb[1].stride = (uint32_t)(uint16_t)((vuint8_t *)&cb[2].source_ad - stage - 1) << 16 |
+		(uint16_t)(offset - 1);
+	setup_cb(bf, cb + 2, stage + 1, bf->add_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, NULL, stage, (1 << 16) | 1, next);
+	cb[3].ti |= TI_TDMODE;
+	cb[3].stride = (uint32_t)(uint16_t)(offset - 1) << 16;
+}
+
+/* RIGHT_N and LEFT_N add the operand to the LSB of the head. LEFT_N's
+ * operand is the negated count so a carry out of the LSB is expected
+ * and its absence means a borrow. Compiled code enters at cb[2] after
+ * storing the operand itself. */
+static cb_t build_move_n(bf_t *bf, int left, cb_t next)
 {
-	assert(bf->next_insn);
 	assert(bf->tramp);
 
-        cb_t cb = bf->next_cb;
-        // Set up the control blocks for input.
-        bf->input = cb;
+	cb_t cb = take_cbs(bf, left? "left_n":"right_n", 8);
+	size_t index = left? LEFT_N_INDEX:RIGHT_N_INDEX;
+	vuint8_t *head = (vuint8_t *)bf->head;
+
+	// 0. Copy the low half of the pc into the low half of cb[1]'s
+	//	source.
+	// 1. Load the operand into the 2nd LSB of cb[4]'s source,
+	//	selecting a row of the carry_table.
+	// 2. Copy it to the 2nd LSB of cb[6]'s source, selecting a row
+	//	of the add_table.
+	// 3. Load the LSB of the head into the LSB of cb[4]'s source.
+	// 4. Load from the carry_table and use as the 2nd LSB into the
+	//	conditional_table.
+	// 5. Load the LSB of the head into the LSB of cb[6]'s source.
+	// 6. Store LSB + operand into the LSB of the head.
+	// 7. Load the offset from the conditional_table into tramp and
+	//	execute tramp.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->pc, 2, cb + 1);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[4].source_ad + 1, bf->operand_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, (vuint8_t *)&cb[6].source_ad + 1, (vuint8_t *)&cb[4].source_ad + 1, 1, cb + 3);
+	setup_cb(bf, cb + 3, &cb[4].source_ad, bf->head, 1, cb + 4);
+	setup_cb(bf, cb + 4, (vuint8_t *)&cb[7].source_ad + 1, bf->carry_table, 1, cb + 5);
+	setup_cb(bf, cb + 5, &cb[6].source_ad, bf->head, 1, cb + 6);
+	setup_cb(bf, cb + 6, bf->head, bf->add_table, 1, cb + 7);
+	setup_cb(bf, cb + 7, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+
+	// On a carry (borrow), increment (decrement) the upper 3 bytes
+	// of the head, or just the 2nd LSB and page byte of a wrapping
+	// tape, and then goto next.
+	size_t carry_index = left? HEAD_BORROW_INDEX:HEAD_CARRY_INDEX;
+	const char *name = left? "left_n carry":"right_n carry";
+	cb_t carry;
+	if (!bf->tape_pages)
+		carry = build_counter(bf, name, head + 1, head + 3,
+				      left? bf->dec_table:bf->inc_table, left, carry_index, next);
+	else if (bf->tape_pages == 1)
+		carry = build_byte_counter(bf, name, head + 1, NULL, NULL, left, carry_index, next);
+	else
+		carry = build_byte_counter(bf, name, head + 1, head + 2,
+					   left? bf->page_dec_table:bf->page_inc_table,
+					   left, carry_index, next);
+	set_address(bf, &bf->conditional_table[index], left? carry:next);
+	set_address(bf, &bf->conditional_table[index + 0x40], left? next:carry);
+	return cb;
+}
+
+static void build_runs(bf_t *bf)
+{
+	assert(bf->jump);
+	assert(bf->tramp);
+
+	cb_t cb = take_cbs(bf, "add_n and add_at", 14);
 
 	//
-	// INPUT:
+	// ADD_N:
 	//
-	// Loop.
-        setup_cb(cb + 0, &cb[1].source_ad, NULL, 1, cb + 1);
-        cb[0].source_ad = UART0_FR;
-        setup_cb(cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->boolean_read_table, 1, cb + 2);
-        setup_cb(cb + 2, &bf->tramp->nextconbk, bf->conditional_table + INPUT_INDEX, 4, bf->tramp);
-
-	// If the uart0 flag register has RXFE, bit 4, set we take input. 
-	// Otherwise, we loop.
-	bf->conditional_table[INPUT_INDEX] = virtual_to_bus(cb + 3);
-	bf->conditional_table[INPUT_INDEX + 0x40] = virtual_to_bus(cb + 0);
-
-	// Set head to input. 
-	setup_cb(cb + 3, &cb[4].dest_ad, bf->head, 4, cb + 4);
-	setup_cb(cb + 4, NULL, NULL, 1, bf->next_insn);
-	cb[4].source_ad = UART0_DR;
-
-	cb += 5;
-	// Set up the control blocks for output.
-	bf->output = cb;
+	// 0. Copy the low half of the pc into the low half of cb[1]'s
+	//	source.
+	// 1. Load the operand into the 2nd LSB of cb[5]'s source,
+	//	selecting a row of the add_table.
+	// 2/3. Copy the head into cb[4]'s source and cb[5]'s destination.
+	// 4. Load the cell into the LSB of cb[5]'s source.
+	// 5. Store cell + operand into the cell and jump past the run.
+	bf->add_n = cb;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->pc, 2, cb + 1);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[5].source_ad + 1, bf->operand_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, &cb[4].source_ad, bf->head, 4, cb + 3);
+	setup_cb(bf, cb + 3, &cb[5].dest_ad, bf->head, 4, cb + 4);
+	setup_cb(bf, cb + 4, &cb[5].source_ad, NULL, 1, cb + 5);
+	setup_cb(bf, cb + 5, NULL, bf->add_table, 1, bf->jump);
+	cb += 6;
+
+	//
+	// ADD_AT:
+	//
+	// 0. Copy the low half of the pc into the low halves of the
+	//	sources of cb[1], cb[2] and cb[3].
+	// 1. Load the operand into the 2nd LSB of cb[6]'s source,
+	//	selecting a row of the add_table.
+	// 2/3. Copy the stride for the offset from the offset table
+	//	into the source stride of cb[5] and the destination
+	//	stride of cb[7].
+	// 4/7. Add the operand to the cell at head + offset and jump
+	//	to the next instruction.
+	bf->add_at = cb;
+	setup_fanout(bf, cb + 0, bf->pc, 2, 3);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[6].source_ad + 1, bf->operand_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, &cb[5].stride, bf->offset_table, (1 << 16) | 1, cb + 3);
+	cb[2].ti |= TI_TDMODE;
+	cb[2].stride = JUMP_PLANE_SIZE - 1;
+	setup_cb(bf, cb + 3, (vuint8_t *)&cb[7].stride + 2, bf->offset_table, (1 << 16) | 1, cb + 4);
+	cb[3].ti |= TI_TDMODE;
+	cb[3].stride = JUMP_PLANE_SIZE - 1;
+	setup_add_at(bf, cb + 4, 0, bf->jump);
+
+	bf->right_n = build_move_n(bf, 0, bf->jump);
+	bf->left_n = build_move_n(bf, 1, bf->jump);
+}
+
+static void build_idioms(bf_t *bf)
+{
+	assert(bf->jump);
+	assert(bf->tramp);
+
+	cb_t cb = take_cbs(bf, "clear", 2);
+
+	//
+	// CLEAR:
+	//
+	// 0. Copy the head into cb[1]'s destination.
+	// 1. Store a zero into the cell without reading a source and
+	//	jump past the loop.
+	bf->clear = cb;
+	setup_cb(bf, cb + 0, &cb[1].dest_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, NULL, NULL, 1, bf->jump);
+	cb[1].ti |= TI_SRC_IGNORE;
+
+	// SCAN_RIGHT and SCAN_LEFT test the cell and step the head
+	// until it lands on a zero without going back through
+	// dispatch.
+	for (int left = 0; left < 2; ++left)
+	{
+		size_t index = left? SCAN_LEFT_INDEX:SCAN_RIGHT_INDEX;
+		cb = take_cbs(bf, left? "scan_left":"scan_right", 4);
+
+		// 0/3. If !*head jump past the loop, else step the head
+		//	and goto 0.
+		setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+		setup_cb(bf, cb + 1, &cb[2].source_ad, NULL, 1, cb + 2);
+		setup_cb(bf, cb + 2, (vuint8_t *)&cb[3].source_ad + 1, bf->boolean_inc_table, 1, cb + 3);
+		setup_cb(bf, cb + 3, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+
+		if (left)
+			bf->scan_left = cb;
+		else
+			bf->scan_right = cb;
+
+		cb_t step = build_head_step(bf, left? "scan_left step":"scan_right step", left, left? SCAN_DEC_INDEX:SCAN_INC_INDEX, cb);
+		set_address(bf, &bf->conditional_table[index], bf->jump);
+		set_address(bf, &bf->conditional_table[index + 0x40], step);
+	}
+
+	//
+	// MUL:
+	//
+	// 0. Copy the low half of the pc into the low half of cb[1]'s
+	//	source.
+	// 1. Load the factor into the 2nd LSB of cb[2]'s source,
+	//	selecting a row of the mul_table. LOAD has already put
+	//	the loop cell into its LSB.
+	// 2. Load the product into the 2nd LSB of cb[6]'s source,
+	//	selecting a row of the add_table.
+	// 3/4. Copy the head into cb[5]'s source and cb[6]'s destination.
+	// 5. Load the cell into the LSB of cb[6]'s source.
+	// 6. Store cell + product into the cell and goto the next
+	//	instruction.
+	cb = take_cbs(bf, "mul", 7);
+	bf->mul = cb;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->pc, 2, cb + 1);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->operand_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, (vuint8_t *)&cb[6].source_ad + 1, bf->mul_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, &cb[5].source_ad, bf->head, 4, cb + 4);
+	setup_cb(bf, cb + 4, &cb[6].dest_ad, bf->head, 4, cb + 5);
+	setup_cb(bf, cb + 5, &cb[6].source_ad, NULL, 1, cb + 6);
+	setup_cb(bf, cb + 6, NULL, bf->add_table, 1, bf->jump);
+
+	//
+	// LOAD:
+	//
+	// 0. Copy the head into cb[1]'s source.
+	// 1. Load the loop cell into the LSB of the source of MUL's
+	//	cb[2] and goto next_insn.
+	cb = take_cbs(bf, "load", 2);
+	bf->load = cb;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, &bf->mul[2].source_ad, NULL, 1, bf->next_insn);
+}
+
+/* Output goes through a ring of 256 words in SDRAM, one character in
+ * the low byte of each since the UART takes a character per 32-bit
+ * write to DR. The ring is split into two halves of OUT_HALF. '.'
+ * stores the cell into the slot at out_idx; when that fills a half,
+ * flush_full hands the half to the tx DMA channel, which drains it
+ * into DR paced by the UART's transmit DREQ, and the program carries
+ * on in the other half. Before that half is reused the previous drain
+ * has long finished, so the channel is polled once per OUT_HALF
+ * characters instead of UART0_FR once per character. A partly filled
+ * half is flushed by flush before input and at the end of the
+ * program. */
+#define OUT_RING_SIZE 0x100
+#define OUT_HALF 0x80
+
+/* Waits for the tx channel to go idle, then goes on to cb + 3. */
+static void setup_tx_wait(bf_t *bf, cb_t cb, size_t index)
+{
+	setup_cb(bf, cb + 0, &cb[1].source_ad, NULL, 1, cb + 1);
+	set_register(bf, &cb[0].source_ad, tx_dma_registers,
+		     offsetof(struct dma_registers, cs));
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->boolean_active_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[index], cb + 3);
+	set_address(bf, &bf->conditional_table[index + 0x40], cb + 0);
+}
+
+/* Starts the channel whose registers are at the bus address
+ * registers on chain, then goes on to next. */
+static void setup_channel_start(bf_t *bf, cb_t cb, uint32_t registers, cb_t chain, cb_t next)
+{
+	setup_cb(bf, cb + 0, NULL, &cb[0].stride, 4, cb + 1);
+	set_register(bf, &cb[0].dest_ad, registers, offsetof(struct dma_registers, conblk_ad));
+	set_address(bf, &cb[0].stride, chain);
+	setup_cb(bf, cb + 1, NULL, &cb[1].stride, 4, next);
+	set_register(bf, &cb[1].dest_ad, registers, offsetof(struct dma_registers, cs));
+	cb[1].stride = DMA_CS_PANIC_PRIORITY(7) | DMA_CS_PRIORITY(7) | CS_DISDEBUG |
+		CS_END | CS_ACTIVE;
+}
+
+/* Starts the tx channel on drain, then goes on to next. drain copies
+ * the ring to DR a word per DREQ and ends the channel's chain. */
+static void setup_tx_start(bf_t *bf, cb_t cb, cb_t drain, cb_t next)
+{
+	setup_channel_start(bf, cb, tx_dma_registers, drain, next);
+	setup_cb(bf, drain, NULL, NULL, 0, NULL);
+	drain->ti = TI_SRC_INC | TI_DEST_DREQ | DMA_TI_PERMAP(DREQ_UART_TX) | TI_WAIT_RESP;
+	drain->dest_ad = UART0_DR;
+}
+
+/* Drains the half of the ring that out_idx has just left. */
+static cb_t build_flush_full(bf_t *bf, cb_t next)
+{
+	cb_t cb = take_cbs(bf, "flush_full", 8);
+	cb_t drain = cb + 7;
+	// 0-2. Wait for the drain of the other half.
+	// 3. Load out_idx into the LSB of the source of cb[4].
+	// 4. Gather the address of the full half into the drain.
+	// 5-6. Start the drain.
+	setup_tx_wait(bf, cb, FLUSH_WAIT_INDEX);
+	setup_cb(bf, cb + 3, &cb[4].source_ad, bf->out_idx, 1, cb + 4);
+	setup_gather(bf, cb + 4, &drain->source_ad, bf->out_full_base_table, cb + 5);
+	setup_tx_start(bf, cb + 5, drain, next);
+	set_address(bf, &drain->source_ad, bf->out_ring);
+	drain->txfr_len = OUT_HALF * sizeof *bf->out_ring;
+	return cb;
+}
+
+/* Drains the characters in the current half of the ring, if any, and
+ * moves out_idx to the start of the other half. index and wait_index
+ * are the gadget's entries in the conditional table, and name names
+ * its control blocks. */
+static cb_t build_flush_partial(bf_t *bf, const char *name, size_t index,
+				size_t wait_index, cb_t next)
+{
+	cb_t cb = take_cbs(bf, name, 13);
+	cb_t drain = cb + 12;
+	// 0. Load out_idx into the LSB of the source of cb[1].
+	// 1. Look up whether the half holds anything.
+	// 2. Go to next if it is empty.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->out_idx, 1, cb + 1);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->out_pending_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, &bf->tramp->nextconbk, bf->conditional_table + index, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[index], next);
+	set_address(bf, &bf->conditional_table[index + 0x40], cb + 3);
+
+	// 3-5. Wait for the drain of the other half.
+	// 6. Fan out out_idx into the next 3 control blocks.
+	// 7-8. Gather the address and length of the half's contents into
+	//	the drain.
+	// 9. Move out_idx to the other half.
+	// 10-11. Start the drain.
+	setup_tx_wait(bf, cb + 3, wait_index);
+	setup_fanout(bf, cb + 6, bf->out_idx, 1, 3);
+	setup_gather(bf, cb + 7, &drain->source_ad, bf->out_part_base_table, cb + 8);
+	setup_gather(bf, cb + 8, &drain->txfr_len, bf->out_part_len_table, cb + 9);
+	setup_cb(bf, cb + 9, bf->out_idx, bf->out_part_next_table, 1, cb + 10);
+	setup_tx_start(bf, cb + 10, drain, next);
+	set_address(bf, &drain->source_ad, bf->out_ring);
+	return cb;
+}
+
+/* Input comes in through a ring of 256 words in SDRAM, filled by a
+ * chain that loops forever on the rx DMA channel. Each turn it reads
+ * DR once the UART's receive DREQ says a character is waiting, stores
+ * it in the slot at rx_prod and then advances rx_prod, unless that
+ * would make it catch up with rx_cons: then it holds off and the
+ * characters wait in the UART's FIFO instead of overwriting ones
+ * still to be read. ',' only reads the slot at rx_cons and advances
+ * it, waiting while it equals rx_prod. rx_stage, rx_cons and rx_prod
+ * are consecutive bytes so a 2-byte copy of either pair indexes the
+ * equal table. */
+#define RX_RING_SIZE 0x100
+
+/* Builds the receive chain. */
+static void build_receive(bf_t *bf)
+{
+	cb_t cb = take_cbs(bf, "receive", 9);
+	// 0. Fan out rx_prod into the next 2 control blocks.
+	// 1. Gather the address of its slot into the destination of cb[7].
+	// 2. Increment rx_prod into rx_stage.
+	// 3. Load rx_stage and rx_cons into the source of cb[4].
+	// 4. Look up whether they are equal.
+	// 5-6. Loop back to 0 if the ring is full, using cb[6] as the
+	//	trampoline.
+	// 7. Read a character into the slot once DREQ is asserted.
+	// 8. Store rx_stage into rx_prod and loop.
+	setup_fanout(bf, cb + 0, bf->rx_prod, 1, 2);
+	setup_gather(bf, cb + 1, &cb[7].dest_ad, bf->rx_slot_table, cb + 2);
+	setup_cb(bf, cb + 2, bf->rx_stage, bf->inc_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, &cb[4].source_ad, bf->rx_stage, 2, cb + 4);
+	setup_cb(bf, cb + 4, (vuint8_t *)&cb[5].source_ad + 1, bf->equal_table, 1, cb + 5);
+	setup_cb(bf, cb + 5, &cb[6].nextconbk, bf->conditional_table + RX_INDEX, 4, cb + 6);
+	setup_cb(bf, cb + 6, cb + 6, cb + 6, 1, NULL);
+	set_address(bf, &bf->conditional_table[RX_INDEX], cb + 7);
+	set_address(bf, &bf->conditional_table[RX_INDEX + 0x40], cb + 0);
+	setup_cb(bf, cb + 7, bf->rx_ring, NULL, 4, cb + 8);
+	cb[7].ti = TI_SRC_DREQ | DMA_TI_PERMAP(DREQ_UART_RX) | TI_DEST_INC | TI_WAIT_RESP;
+	cb[7].source_ad = UART0_DR;
+	setup_cb(bf, cb + 8, bf->rx_prod, bf->rx_stage, 1, cb + 0);
+
+	bf->receive = cb;
+}
+
+/* Reads the character at rx_cons into the cell, then goes on to
+ * next. */
+static cb_t build_input(bf_t *bf, cb_t next)
+{
+	cb_t cb = take_cbs(bf, "input", 8);
+	// 0. Load rx_cons and rx_prod into the source of cb[1].
+	// 1. Look up whether they are equal.
+	// 2. Loop back to 0 while the ring is empty.
+	// 3. Fan out rx_cons into the next 2 control blocks.
+	// 4. Gather the address of its slot into the source of cb[7].
+	// 5. Increment rx_cons.
+	// 6. Load the head into the destination of cb[7].
+	// 7. Store the character into the cell.
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->rx_cons, 2, cb + 1);
+	setup_cb(bf, cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->equal_table, 1, cb + 2);
+	setup_cb(bf, cb + 2, &bf->tramp->nextconbk, bf->conditional_table + INPUT_INDEX, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[INPUT_INDEX], cb + 3);
+	set_address(bf, &bf->conditional_table[INPUT_INDEX + 0x40], cb + 0);
+	setup_fanout(bf, cb + 3, bf->rx_cons, 1, 2);
+	setup_gather(bf, cb + 4, &cb[7].source_ad, bf->rx_slot_table, cb + 5);
+	setup_cb(bf, cb + 5, bf->rx_cons, bf->inc_table, 1, cb + 6);
+	setup_cb(bf, cb + 6, &cb[7].dest_ad, bf->head, 4, cb + 7);
+	setup_cb(bf, cb + 7, NULL, bf->rx_ring, 1, next);
+	return cb;
+}
+
+/* Starts the receive chain on the rx channel, then goes on to
+ * next. */
+static cb_t build_start(bf_t *bf, cb_t next)
+{
+	assert(bf->receive);
+	cb_t cb = take_cbs(bf, "start", 2);
+	setup_channel_start(bf, cb, rx_dma_registers, bf->receive, next);
+	return cb;
+}
+
+static void build_io(bf_t *bf)
+{
+	assert(bf->next_insn);
+	assert(bf->tramp);
+
+	// Flush the output before input, the program may be waiting on
+	// a prompt being seen.
+	cb_t input = build_input(bf, bf->next_insn);
+	bf->input = build_flush_partial(bf, "input flush", INPUT_FLUSH_INDEX, INPUT_FLUSH_WAIT_INDEX, input);
 
 	//
 	// OUTPUT
 	//
-	// Loop.
-        //setup_cb(cb + 0, &cb[1].source_ad, &cb[0].stride, 4, cb + 1);
-        setup_cb(cb + 0, &cb[1].source_ad, NULL, 1, cb + 1);
-        cb[0].source_ad = UART0_FR;
-        setup_cb(cb + 1, (vuint8_t *)&cb[2].source_ad + 1, bf->boolean_write_table, 1, cb + 2);
-        setup_cb(cb + 2, &bf->tramp->nextconbk, bf->conditional_table + OUTPUT_INDEX, 4, bf->tramp);
-
-        // If the uart0 flag register has TXFF, bit 5, set we take input.
-        // Otherwise, we loop.
-        bf->conditional_table[OUTPUT_INDEX] = virtual_to_bus(cb + 3);
-        bf->conditional_table[OUTPUT_INDEX + 0x40] = virtual_to_bus(cb + 0);
-
-	// Set head to output. 
-	setup_cb(cb + 3, &cb[4].source_ad, bf->head, 4, cb + 4);
-	setup_cb(cb + 4, NULL, NULL, 4, bf->next_insn);
-	cb[4].dest_ad = UART0_DR;
- 
-	cb += 5;
-	bf->next_cb = cb;
+	// 0. Fan out out_idx into the next 3 control blocks.
+	// 1. Gather the address of its slot into the destination of cb[5].
+	// 2. Increment out_idx.
+	// 3. Look up whether the slot is the last of its half.
+	// 4. Load the head into the source of cb[5].
+	// 5. Store the cell into the slot.
+	// 6. Flush the half if it is full.
+	bf->flush_full = build_flush_full(bf, bf->next_insn);
+	// Quitting flushes the output and then ends the chain at stop.
+	bf->stop = take_cbs(bf, "stop", 1);
+	setup_cb(bf, bf->stop, bf->stop, bf->stop, 1, NULL);
+	bf->flush = build_flush_partial(bf, "flush", FLUSH_INDEX, FLUSH_PART_WAIT_INDEX, bf->stop);
+	cb_t cb = take_cbs(bf, "output", 7);
+	bf->output = cb;
+	setup_fanout(bf, cb + 0, bf->out_idx, 1, 3);
+	setup_gather(bf, cb + 1, &cb[5].dest_ad, bf->out_slot_table, cb + 2);
+	setup_cb(bf, cb + 2, bf->out_idx, bf->inc_table, 1, cb + 3);
+	setup_cb(bf, cb + 3, (vuint8_t *)&cb[6].source_ad + 1, bf->out_last_table, 1, cb + 4);
+	setup_cb(bf, cb + 4, &cb[5].source_ad, bf->head, 4, cb + 5);
+	setup_cb(bf, cb + 5, bf->out_ring, NULL, 1, cb + 6);
+	setup_cb(bf, cb + 6, &bf->tramp->nextconbk, bf->conditional_table + OUTPUT_INDEX, 4, bf->tramp);
+	set_address(bf, &bf->conditional_table[OUTPUT_INDEX], bf->next_insn);
+	set_address(bf, &bf->conditional_table[OUTPUT_INDEX + 0x40], bf->flush_full);
 }
 
 static void build_insn_table(bf_t *bf)
@@ -656,152 +1755,1425 @@ static void build_insn_table(bf_t *bf)
 	assert(bf->rcond);
 	assert(bf->input);
 	assert(bf->output);
+	assert(bf->flush);
 	assert(bf->dispatch);
+	assert(bf->add_n);
+	assert(bf->add_at);
+	assert(bf->right_n);
+	assert(bf->left_n);
+	assert(bf->clear);
+	assert(bf->scan_right);
+	assert(bf->scan_left);
+	assert(bf->load);
+	assert(bf->mul);
+
+	set_address(bf, &bf->insn_table->quit, bf->flush);
+	set_address(bf, &bf->insn_table->nop, bf->next_insn);
+	set_address(bf, &bf->insn_table->inc, bf->inc);
+	set_address(bf, &bf->insn_table->dec, bf->dec);
+	set_address(bf, &bf->insn_table->right, bf->right);
+	set_address(bf, &bf->insn_table->left, bf->left);
+	set_address(bf, &bf->insn_table->lcond, bf->lcond);
+	set_address(bf, &bf->insn_table->rcond, bf->rcond);
+	set_address(bf, &bf->insn_table->input, bf->input);
+	set_address(bf, &bf->insn_table->output, bf->output);
+	set_address(bf, &bf->insn_table->add_n, bf->add_n);
+	set_address(bf, &bf->insn_table->add_at, bf->add_at);
+	set_address(bf, &bf->insn_table->right_n, bf->right_n);
+	set_address(bf, &bf->insn_table->left_n, bf->left_n);
+	set_address(bf, &bf->insn_table->clear, bf->clear);
+	set_address(bf, &bf->insn_table->scan_right, bf->scan_right);
+	set_address(bf, &bf->insn_table->scan_left, bf->scan_left);
+	set_address(bf, &bf->insn_table->load, bf->load);
+	set_address(bf, &bf->insn_table->mul, bf->mul);
+}
 
-	bf->insn_table->quit = 0;
-	bf->insn_table->nop = virtual_to_bus(bf->next_insn);
-	bf->insn_table->inc = virtual_to_bus(bf->inc); 
-	bf->insn_table->dec = virtual_to_bus(bf->dec);
-	bf->insn_table->right = virtual_to_bus(bf->right);
-	bf->insn_table->left = virtual_to_bus(bf->left);
-	bf->insn_table->lcond = virtual_to_bus(bf->lcond);
-	bf->insn_table->rcond = virtual_to_bus(bf->rcond);
-	bf->insn_table->input = virtual_to_bus(bf->input);
-	bf->insn_table->output = virtual_to_bus(bf->output);
+/* A compiled conditional branch is three control blocks. The first
+ * loads the byte to test, whose address is in its source, into the
+ * LSB of the second's source. The second looks the byte up in a
+ * branch table and writes the result into the LSB of the third's
+ * source, which then loads either reserved[0] (false) or reserved[1]
+ * (true) of itself into tramp. There is one 256-byte branch table for
+ * each of the 8 possible 32-byte slots of the third block in a 256
+ * byte page. */
+static void build_branch_table(vuint8_t *table, int (*test)(int))
+{
+	for (int slot = 0; slot < 8; ++slot)
+	{
+		for (int i = 0; i < 0x100; ++i)
+		{
+			size_t index = test(i)? 1:0;
+			table[slot * 0x100 + i] = slot * sizeof(struct control_block) +
+				offsetof(struct control_block, reserved[index]);
+		}
+	}
 }
 
-int main(int argc, char *argv[])
+static int test_nonzero(int byte)
 {
-	if (argc != 2)
+	return byte != 0;
+}
+
+static int test_half_full(int byte)
+{
+	return !(byte & (OUT_HALF - 1));
+}
+
+static void compile_branch(bf_t *bf, cb_t cb, vuint8_t *table)
+{
+	uint8_t slot = virtual_to_bus(cb + 2) >> 5 & 7;
+	setup_cb(bf, cb + 0, &cb[1].source_ad, NULL, 1, cb + 1);
+	setup_cb(bf, cb + 1, &cb[2].source_ad, table + slot * 0x100, 1, cb + 2);
+	setup_cb(bf, cb + 2, &bf->tramp->nextconbk, &cb[2].reserved[0], 4, bf->tramp);
+}
+
+static void set_branch(bf_t *bf, cb_t cb, cb_t if_false, cb_t if_true)
+{
+	set_address(bf, &cb[2].reserved[0], if_false);
+	set_address(bf, &cb[2].reserved[1], if_true);
+}
+
+/* Compiles a clear loop: store a zero into the cell. */
+static cb_t compile_clear(bf_t *bf, cb_t cb)
+{
+	setup_cb(bf, cb + 0, &cb[1].dest_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, NULL, NULL, 1, cb + 2);
+	cb[1].ti |= TI_SRC_IGNORE;
+	return cb + 2;
+}
+
+/* Compiles a move of the head with RIGHT_N or LEFT_N, returning via
+ * tramp2. */
+static cb_t compile_move(bf_t *bf, cb_t cb, int move)
+{
+	while (move)
 	{
-		fprintf(stderr, "Usage: %s program.bf\n", argv[0]);
-		exit(1);
+		int step = move > 0xff? 0xff:move < -0xff? -0xff:move;
+		cb_t move_n = step > 0? bf->right_n:bf->left_n;
+		setup_cb(bf, cb + 0, (vuint8_t *)&move_n[4].source_ad + 1, &cb[0].stride, 1, cb + 1);
+		cb[0].stride = (uint8_t)step;
+		setup_cb(bf, cb + 1, &bf->tramp2->nextconbk, &cb[1].stride, 4, move_n + 2);
+		set_address(bf, &cb[1].stride, cb + 2);
+		cb += 2;
+		move -= step;
 	}
-	setup();
+	return cb;
+}
 
-	/* The memory is arranged as
-	 * 1. DMA control blocks
-	 * 2. Tables
-	 * 3. Program counter
-	 * 4. Loop counter
-	 * 5. Tape head
-	 * 6. Brainfuck program
-	 * 7. Tape
-	 */
+/* Compiles a block: add each delta to the cell at head + offset in
+ * place, then move the head by its net move. On a wrapping tape the
+ * head walks to each cell instead, as in lower_block. */
+static cb_t compile_block(bf_t *bf, cb_t cb, const cell_op_t *ops, int count, int move)
+{
+	int pos = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (!ops[i].delta)
+			continue;
+		int offset = ops[i].offset;
+		if (bf->tape_pages)
+		{
+			cb = compile_move(bf, cb, offset - pos);
+			pos = offset;
+			offset = 0;
+		}
+		setup_add_at(bf, cb, offset, cb + 4);
+		cb[2].source_ad += ops[i].delta * 0x100;
+		cb += 4;
+	}
+	return compile_move(bf, cb, move - pos);
+}
 
-	bf_t bf;
-	memset(&bf, 0, sizeof bf);
+/* Compiles a multiply loop: save the loop cell in acc, add factor *
+ * acc to each target through the mul_table and add_table, then clear
+ * the loop cell. */
+static cb_t compile_mul_loop(bf_t *bf, cb_t cb, const mul_target_t *targets, int count)
+{
+	setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+	setup_cb(bf, cb + 1, bf->acc, NULL, 1, cb + 2);
+	cb += 2;
 
-	// Control blocks
-	const cb_t cb_base = bus_to_virtual(BUS_ADDRESS);
-	bf.next_cb = cb_base;
+	int pos = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		// The same steps as MUL with the factor built in and the
+		// target addressed from the head, or walked to on a
+		// wrapping tape.
+		int offset = targets[i].offset;
+		if (bf->tape_pages)
+		{
+			cb = compile_move(bf, cb, offset - pos);
+			pos = offset;
+			offset = 0;
+		}
+		setup_cb(bf, cb + 0, &cb[1].source_ad, bf->acc, 1, cb + 1);
+		setup_cb(bf, cb + 1, (vuint8_t *)&cb[4].source_ad + 1,
+			 bf->mul_table + targets[i].factor * 0x100, 1, cb + 2);
+		setup_add_at(bf, cb + 2, offset, cb + 6);
+		cb += 6;
+	}
+	cb = compile_move(bf, cb, -pos);
+	return compile_clear(bf, cb);
+}
 
-	// Tables
-#define TABLE_ADDRESS (BUS_ADDRESS + 0x2000)
-	bf.dispatch_table = bus_to_virtual(TABLE_ADDRESS);
-	bf.inc_table = bus_to_virtual(TABLE_ADDRESS + 0x100);
-	bf.dec_table = bus_to_virtual(TABLE_ADDRESS + 0x200);
-	bf.insn_table = bus_to_virtual(TABLE_ADDRESS + 0x300);
-	bf.boolean_inc_table = bus_to_virtual(TABLE_ADDRESS + 0x400);
-	bf.boolean_dec_table = bus_to_virtual(TABLE_ADDRESS + 0x500);
-	bf.bracket_table = bus_to_virtual(TABLE_ADDRESS + 0x600);
-	bf.scanright_table = bus_to_virtual(TABLE_ADDRESS + 0x700);
-	bf.scanleft_table = bus_to_virtual(TABLE_ADDRESS + 0x800);
-	bf.boolean_read_table = bus_to_virtual(TABLE_ADDRESS + 0x900);
-	bf.boolean_write_table = bus_to_virtual(TABLE_ADDRESS + 0xa00);
-	bf.conditional_table = bus_to_virtual(TABLE_ADDRESS + 0xb00);
-	
-	// Data
-	bf.pc = bus_to_virtual(BUS_ADDRESS + 0x3000);
-	bf.lc = bf.pc + 1;
-	bf.head = bf.lc + 1;
+/* Compiles the program into a straight-line chain of control blocks
+ * starting at code. Each instruction gets its own copy of the gadget
+ * that implements it with nextconbk pointing directly at the
+ * following instruction, and brackets branch directly to the
+ * instruction after their match. Returns the number of instructions
+ * compiled. */
+static size_t compile_program(bf_t *bf, cb_t code, cb_t code_end,
+			      const vuint8_t *program)
+{
+	assert(bf->tramp2);
+	assert(bf->inc_head);
+	assert(bf->dec_head);
+	assert(bf->right_n);
+	assert(bf->left_n);
+	assert(bf->flush_full);
+	assert(bf->flush);
+	assert(bf->input);
+	assert(bf->acc);
+
+	// Each entry is the branch of a '[' waiting for its ']'.
+	size_t depth = 0;
+	size_t max_depth = 16;
+	cb_t *open = malloc(max_depth * sizeof *open);
+	size_t count = 0;
+	cb_t cb = code;
+	mul_target_t target[MAX_MUL_TARGETS];
+	cell_op_t ops[MAX_BLOCK_CELLS];
+	size_t length;
+	int targets, cells, move;
+
+	for (const vuint8_t *p = program; *p; ++p)
+	{
+		if (code_end - cb < 11)
+		{
+			fputs("Compiled program does not fit in memory\n", stderr);
+			exit(1);
+		}
+		switch (*p)
+		{
+		case '+':
+		case '-':
+		case '>':
+		case '<':
+			length = parse_block(p, ops, &cells, &move);
+			if ((size_t)(code_end - cb) < 4 * MAX_BLOCK_CELLS + 2 * length)
+			{
+				fputs("Compiled program does not fit in memory\n", stderr);
+				exit(1);
+			}
+			cb = compile_block(bf, cb, ops, cells, move);
+			p += length - 1;
+			break;
+		case '[':
+			if ((p[1] == '+' || p[1] == '-') && p[2] == ']')
+			{
+				cb = compile_clear(bf, cb);
+				p += 2;
+				break;
+			}
+			if ((p[1] == '>' || p[1] == '<') && p[2] == ']')
+			{
+				// A scan loop tests the cell and steps the
+				// head with inc_head or dec_head, returning
+				// via tramp2, until the cell is zero.
+				setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+				compile_branch(bf, cb + 1, bf->branch_zero_table);
+				set_branch(bf, cb + 1, cb + 5, cb + 4);
+				setup_cb(bf, cb + 4, &bf->tramp2->nextconbk, &cb[4].stride, 4,
+					 p[1] == '>'? bf->inc_head:bf->dec_head);
+				set_address(bf, &cb[4].stride, cb + 0);
+				cb += 5;
+				p += 2;
+				break;
+			}
+			if ((targets = parse_mul_loop(p, &length, target)) >= 0)
+			{
+				if ((size_t)(code_end - cb) < 4 + 6 * targets + 2 * length)
+				{
+					fputs("Compiled program does not fit in memory\n", stderr);
+					exit(1);
+				}
+				cb = compile_mul_loop(bf, cb, target, targets);
+				p += length - 1;
+				break;
+			}
+			// Copy the head into the branch and test the cell.
+			// The false target is patched by the matching ']'.
+			setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+			compile_branch(bf, cb + 1, bf->branch_zero_table);
+			if (depth == max_depth)
+			{
+				max_depth *= 2;
+				open = realloc(open, max_depth * sizeof *open);
+			}
+			open[depth++] = cb + 1;
+			cb += 4;
+			break;
+		case ']':
+			setup_cb(bf, cb + 0, &cb[1].source_ad, bf->head, 4, cb + 1);
+			compile_branch(bf, cb + 1, bf->branch_zero_table);
+			{
+				cb_t lbranch = open[--depth];
+				// Loop back to the body of the '[' while the
+				// cell is nonzero; both exit after the ']'.
+				set_branch(bf, cb + 1, cb + 4, lbranch + 3);
+				set_branch(bf, lbranch, cb + 4, lbranch + 3);
+			}
+			cb += 4;
+			break;
+		case ',':
+			// Flush the output, then read from the input
+			// ring, both via tramp2.
+			setup_cb(bf, cb + 0, &bf->tramp2->nextconbk, &cb[0].stride, 4, bf->flush);
+			set_address(bf, &cb[0].stride, cb + 1);
+			setup_cb(bf, cb + 1, &bf->tramp2->nextconbk, &cb[1].stride, 4, bf->input);
+			set_address(bf, &cb[1].stride, cb + 2);
+			cb += 2;
+			break;
+		case '.':
+			// Store the cell into the output ring as the
+			// interpreter does, then if that filled a half
+			// drain it via tramp2.
+			setup_fanout(bf, cb + 0, bf->out_idx, 1, 2);
+			setup_gather(bf, cb + 1, &cb[4].dest_ad, bf->out_slot_table, cb + 2);
+			setup_cb(bf, cb + 2, bf->out_idx, bf->inc_table, 1, cb + 3);
+			setup_cb(bf, cb + 3, &cb[4].source_ad, bf->head, 4, cb + 4);
+			setup_cb(bf, cb + 4, bf->out_ring, NULL, 1, cb + 5);
+			compile_branch(bf, cb + 5, bf->branch_flush_table);
+			set_address(bf, &cb[5].source_ad, bf->out_idx);
+			set_branch(bf, cb + 5, cb + 9, cb + 8);
+			setup_cb(bf, cb + 8, &bf->tramp2->nextconbk, &cb[8].stride, 4, bf->flush_full);
+			set_address(bf, &cb[8].stride, cb + 9);
+			cb += 9;
+			break;
+		default:
+			continue;
+		}
+		++count;
+	}
+	free(open);
+
+	// Flush the output and stop the DMA after the last instruction.
+	setup_cb(bf, cb + 0, &bf->tramp2->nextconbk, &cb[0].stride, 4, bf->flush);
+	set_address(bf, &cb[0].stride, cb + 1);
+	setup_cb(bf, cb + 1, cb + 1, cb + 1, 1, NULL);
+	bf->stop = cb + 1;
+	return count;
+}
 
-	// Program
-	vuint8_t *program = (vuint8_t *)(bf.head + 1);
-	size_t program_size = copy_program(program, argv[1]);
+/* The image cache keeps what load() builds for the interpreter, all
+ * of the memory before the program but the program's own tables, for
+ * later runs with the same layout to copy instead. Each image is in a
+ * file named by a hash of its key, which it also starts with so that
+ * a collision is only a miss. The key holds the identity of the
+ * executable, so that rebuilding the builders invalidates the cache,
+ * and the options the layout depends on. The image holds the bus
+ * addresses of where it was built, and a relocation for each of them,
+ * so that a copy of it runs in memory anywhere else a whole number of
+ * 64 KB blocks away: a later run that gets its memory elsewhere, or
+ * another partition of a batch. The addresses of the tx and rx
+ * channels' registers, which the gadgets start and poll, are
+ * relocated in the same way to the channels the run has.
+ *
+ * The DMA runs the control blocks of an image as they are, able to
+ * read and write any memory, so a bf that is setuid root for another
+ * user takes images only from a directory of root's that no one else
+ * may write to, and only files of root's in it, and writes none:
+ * root fills the cache by running bf itself. */
+#define CACHE_MAGIC "bfimage"
+#define CACHE_VERSION 4
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t gadget_count;
+	uint64_t exe_dev;
+	uint64_t exe_ino;
+	uint64_t exe_size;
+	uint64_t exe_mtime;	// in ns
+	uint64_t profile;	// hash of the hot names, 0 without a profile
+	uint32_t program;	// offset of the program, which the image ends at
+	uint32_t tape_pages;
+	uint32_t io;
+	uint32_t lite;		// whether the channel is a lite one
+} cache_key_t;
+
+/* What the image holds besides the memory, as bus addresses of where
+ * it was built, at base, with the tx and rx channels at tx_registers
+ * and rx_registers. It is followed by the gadgets, the offsets of the
+ * reloc_count relocations, of the tx_reloc_count and rx_reloc_count
+ * words holding addresses of the channels' registers and the
+ * memory. */
+typedef struct
+{
+	uint32_t base;
+	uint32_t start;
+	uint32_t clear;
+	uint32_t cbs_next;
+	uint32_t hot_next;
+	uint32_t reloc_count;
+	uint32_t tx_registers;
+	uint32_t rx_registers;
+	uint32_t tx_reloc_count;
+	uint32_t rx_reloc_count;
+} cache_state_t;
+
+/* bf_t ends with the gadgets, from dispatch on, all of them cb_t. */
+#define GADGET_COUNT ((sizeof(bf_t) - offsetof(bf_t, dispatch)) / sizeof(cb_t))
+
+#define IMAGE_HEADER_SIZE (sizeof(cache_key_t) + sizeof(cache_state_t) + \
+			   GADGET_COUNT * 4)
+
+static uint64_t fnv1a(uint64_t hash, const void *p, size_t size)
+{
+	const uint8_t *bytes = p;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
+/* The executable, looked up while still root, as a setuid process may
+ * not look at itself in /proc after. */
+static struct stat exe;
 
-	// Tape
-	vuint8_t *tape = program + program_size;
+/* Whether bf runs setuid root for another user, who must not be able
+ * to hand it images. */
+static int setuid_run;
 
-	// 1. Set the pc, lc, and head. Clear the tape.
-	*bf.pc = virtual_to_bus(program);
-	*bf.lc = 0;
-	*bf.head = virtual_to_bus(tape);
-	memset((void *)tape, 0, 0x200000); // 2MB.
+/* Whether st is of a file of root's that no one else may write to. */
+static int roots_own(const struct stat *st)
+{
+	return st->st_uid == 0 && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
 
-	// 2. Build the boolean tables.
+/* Fills in key for loading the program at program. */
+static void cache_key(const bf_t *bf, vuint8_t *program, int io, cache_key_t *key)
+{
+	memset(key, 0, sizeof *key);
+	memcpy(key->magic, CACHE_MAGIC, sizeof key->magic);
+	key->version = CACHE_VERSION;
+	key->gadget_count = GADGET_COUNT;
+	key->exe_dev = exe.st_dev;
+	key->exe_ino = exe.st_ino;
+	key->exe_size = exe.st_size;
+	key->exe_mtime = exe.st_mtim.tv_sec * 1000000000ull + exe.st_mtim.tv_nsec;
+	if (bf->profile)
 	{
-		uint8_t second_LSB = virtual_to_bus(bf.conditional_table) >> 8;
+		key->profile = FNV_OFFSET;
+		for (size_t i = 0; i < bf->profile->count; ++i)
+		{
+			const char *name = bf->profile->entries[i].name;
+			if (bf->profile->entries[i].hot)
+				key->profile = fnv1a(key->profile, name, strlen(name) + 1);
+		}
+	}
+	key->program = virtual_to_bus(program) - bf->stage.bus;
+	key->tape_pages = bf->tape_pages;
+	key->io = io;
+	key->lite = dma_lite(bf->channel);
+}
+
+static void cache_path(const bf_t *bf, const cache_key_t *key, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.img", bf->cache,
+		 (unsigned long long)fnv1a(FNV_OFFSET, key, sizeof *key));
+}
+
+static uint32_t bus_or_0(volatile void *p)
+{
+	return p? virtual_to_bus(p):0;
+}
+
+static void *staged_or_null(const bf_t *bf, uint32_t addr, uint32_t delta)
+{
+	return addr? dma_memory_to_virtual(&bf->stage, addr + delta):NULL;
+}
+
+/* Appends the offsets of relocs to offsets, which are of an image up
+ * to program, and returns where they end. */
+static uint32_t *pack_relocs(uint32_t *offsets, const reloc_t *relocs, uint32_t program)
+{
+	for (size_t i = 0; i < relocs->count; ++i)
+	{
+		// Only the interpreter's gadgets and tables are built yet.
+		assert(relocs->offsets[i] <= program - 4);
+		*offsets++ = relocs->offsets[i];
+	}
+	return offsets;
+}
+
+/* Makes image the image for key of bf's stage up to the program. */
+static void pack_image(bf_t *bf, const cache_key_t *key, cb_t start, cb_t clear,
+		       image_t *image)
+{
+	size_t count = bf->relocs.count + bf->tx_relocs.count + bf->rx_relocs.count;
+	size_t size = IMAGE_HEADER_SIZE + count * 4 + key->program;
+	uint8_t *p = realloc(image->bytes, size);
+	if (!p)
+	{
+		perror("realloc");
+		exit(1);
+	}
+	image->bytes = p;
+	image->size = size;
+
+	cache_state_t state =
+	{
+		bf->stage.bus, bus_or_0(start), bus_or_0(clear), bf->cbs.next,
+		bf->hot.next, bf->relocs.count, tx_dma_registers, rx_dma_registers,
+		bf->tx_relocs.count, bf->rx_relocs.count,
+	};
+	memcpy(p, key, sizeof *key);
+	memcpy(p + sizeof *key, &state, sizeof state);
+	uint32_t *gadgets = (uint32_t *)(p + sizeof *key + sizeof state);
+	cb_t *gadget = &bf->dispatch;
+	for (size_t i = 0; i < GADGET_COUNT; ++i)
+		gadgets[i] = bus_or_0(gadget[i]);
+	uint32_t *offsets = gadgets + GADGET_COUNT;
+	offsets = pack_relocs(offsets, &bf->relocs, key->program);
+	offsets = pack_relocs(offsets, &bf->tx_relocs, key->program);
+	offsets = pack_relocs(offsets, &bf->rx_relocs, key->program);
+	memcpy(offsets, bf->stage.virt, key->program);
+}
+
+/* Copies image into bf's stage if it is the one for key, patches it
+ * for where the stage is and for the tx and rx channels, and restores
+ * the gadgets, the start and the blocks that clear the tape. Returns
+ * 0 if image is not for key, or cannot be moved to the stage. */
+static int unpack_image(bf_t *bf, const cache_key_t *key, const image_t *image,
+			cb_t *start, cb_t *clear)
+{
+	const uint8_t *p = image->bytes;
+	if (image->size < IMAGE_HEADER_SIZE || memcmp(p, key, sizeof *key))
+		return 0;
+	const cache_state_t *state = (const cache_state_t *)(p + sizeof *key);
+	const uint32_t *gadgets = (const uint32_t *)(state + 1);
+	const uint32_t *offsets = gadgets + GADGET_COUNT;
+	const uint32_t *tx_offsets = offsets + state->reloc_count;
+	const uint32_t *rx_offsets = tx_offsets + state->tx_reloc_count;
+	size_t count = (size_t)state->reloc_count + state->tx_reloc_count +
+		state->rx_reloc_count;
+	uint32_t delta = bf->stage.bus - state->base;
+	if (image->size != IMAGE_HEADER_SIZE + count * 4 + key->program ||
+	    delta % RELOC_ALIGN)
+		return 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (offsets[i] > key->program - 4)
+			return 0;
+	}
+
+	memcpy(bf->stage.virt, offsets + count, key->program);
+	reloc_apply(bf->stage.virt, offsets, state->reloc_count, delta);
+	reloc_shift(bf->stage.virt, tx_offsets, state->tx_reloc_count,
+		    tx_dma_registers - state->tx_registers);
+	reloc_shift(bf->stage.virt, rx_offsets, state->rx_reloc_count,
+		    rx_dma_registers - state->rx_registers);
+	cb_t *gadget = &bf->dispatch;
+	for (size_t i = 0; i < GADGET_COUNT; ++i)
+		gadget[i] = staged_or_null(bf, gadgets[i], delta);
+	*start = staged_or_null(bf, state->start, delta);
+	*clear = staged_or_null(bf, state->clear, delta);
+	bf->cbs.next = state->cbs_next + delta;
+	if (state->hot_next)
+		bf->hot.next = state->hot_next + delta;
+	return 1;
+}
+
+/* Reads the image for key from the cache into image. Returns 0 if
+ * there is no such image. */
+static int read_cache(const bf_t *bf, const cache_key_t *key, image_t *image)
+{
+	char path[PATH_MAX];
+	cache_path(bf, key, path, sizeof path);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	struct stat st;
+	uint8_t *p = MAP_FAILED;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    st.st_size >= (off_t)IMAGE_HEADER_SIZE && (!setuid_run || roots_own(&st)))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	int found = !memcmp(p, key, sizeof *key);
+	if (found)
+	{
+		uint8_t *bytes = realloc(image->bytes, st.st_size);
+		if (!bytes)
+		{
+			perror("realloc");
+			exit(1);
+		}
+		memcpy(bytes, p, st.st_size);
+		image->bytes = bytes;
+		image->size = st.st_size;
+	}
+	munmap(p, st.st_size);
+	return found;
+}
+
+/* Writes image as the image for key, through a temporary file so that
+ * a reader never sees half of it. A failure only costs the next run
+ * the time to build. */
+static void write_cache(const bf_t *bf, const cache_key_t *key, const image_t *image)
+{
+	if (setuid_run)
+		return;
+	char path[PATH_MAX], temporary[PATH_MAX + 32];
+	cache_path(bf, key, path, sizeof path);
+	snprintf(temporary, sizeof temporary, "%s.%d", path, (int)getpid());
+	FILE *fp = fopen(temporary, "wb");
+	if (!fp)
+	{
+		perror(temporary);
+		return;
+	}
+	int ok = fwrite(image->bytes, image->size, 1, fp) == 1;
+	if (fclose(fp) || !ok || rename(temporary, path))
+	{
+		perror(path);
+		unlink(temporary);
+	}
+}
+
+/* Clears the rings and builds the tables, steps 1 and 2 of load(),
+ * but for the page tables. Returns the control blocks to clear the
+ * tape with. */
+static cb_t build_tables(bf_t *bf, size_t tape_bytes)
+{
+	// 1. Clear the rings. The tape is cleared in the memory once the
+	// rest is there.
+	cb_t clear = take_cbs(bf, "tape clear", dma_bulk_cbs(bf->channel, tape_bytes));
+	*bf->out_idx = 0;
+	memset((void *)bf->out_ring, 0, OUT_RING_SIZE * sizeof *bf->out_ring);
+	*bf->rx_cons = *bf->rx_prod = 0;
+
+	// 2. Build the inc/dec, add, multiply, output, and boolean
+	// tables.
+	for (int i = 0; i < 256; ++i)
+	{
+		bf->inc_table[i] = i + 1;
+		bf->dec_table[i] = i - 1;
+	}
+	for (int n = 0; n < 256; ++n)
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			bf->add_table[n * 0x100 + i] = n + i;
+			bf->mul_table[n * 0x100 + i] = n * i;
+		}
+	}
+	for (int i = 0; i < OUT_RING_SIZE; ++i)
+	{
+		// The output tables hold the low halves of ring addresses
+		// and byte counts, split into two planes.
+		uint16_t slot = virtual_to_bus(bf->out_ring + i);
+		uint16_t full_base = virtual_to_bus(bf->out_ring + ((i & OUT_HALF) ^ OUT_HALF));
+		uint16_t part_base = virtual_to_bus(bf->out_ring + (i & OUT_HALF));
+		uint16_t part_len = (i & (OUT_HALF - 1)) * sizeof *bf->out_ring;
+		bf->out_slot_table[i] = slot;
+		bf->out_slot_table[0x100 + i] = slot >> 8;
+		bf->out_full_base_table[i] = full_base;
+		bf->out_full_base_table[0x100 + i] = full_base >> 8;
+		bf->out_part_base_table[i] = part_base;
+		bf->out_part_base_table[0x100 + i] = part_base >> 8;
+		bf->out_part_len_table[i] = part_len;
+		bf->out_part_len_table[0x100 + i] = part_len >> 8;
+		bf->out_part_next_table[i] = (i & OUT_HALF) ^ OUT_HALF;
+	}
+	for (int i = 0; i < RX_RING_SIZE; ++i)
+	{
+		uint16_t slot = virtual_to_bus(bf->rx_ring + i);
+		bf->rx_slot_table[i] = slot;
+		bf->rx_slot_table[0x100 + i] = slot >> 8;
+	}
+	for (int i = 0; i < 0x10000; ++i)
+	{
+		bf->succ_lo_table[i] = (i + 1) & 0xff;
+		bf->succ_hi_table[i] = (i + 1) >> 8;
+		bf->pred_lo_table[i] = (i - 1) & 0xff;
+		bf->pred_hi_table[i] = (i - 1) >> 8;
+	}
+	{
+		uint8_t second_LSB = virtual_to_bus(bf->conditional_table) >> 8;
 		assert(second_LSB != 0xff);
 
-		memset((void *)bf.boolean_inc_table, second_LSB + 1, 0x100);
-		bf.boolean_inc_table[0] = second_LSB;
+		for (int n = 0; n < 256; ++n)
+		{
+			for (int i = 0; i < 256; ++i)
+				bf->carry_table[n * 0x100 + i] = second_LSB + (n + i > 0xff);
+		}
 
-		memset((void *)bf.boolean_dec_table, second_LSB + 1, 0x100);
-		bf.boolean_dec_table[255] = second_LSB;
+		memset((void *)bf->boolean_inc_table, second_LSB + 1, 0x100);
+		bf->boolean_inc_table[0] = second_LSB;
+		memset((void *)bf->boolean_dec_table, second_LSB + 1, 0x100);
+		bf->boolean_dec_table[0xff] = second_LSB;
 
-		memset((void *)bf.boolean_read_table, second_LSB, 0x100);
-		for(int i=0; i < 256; i++) 
+		for (int i = 0; i < 0x10000; ++i)
 		{
-			// RXFE bit 4.
-			if(i & (1 << 4))
-				bf.boolean_read_table[i] = second_LSB + 1;	
+			bf->wrap_inc_table[i] = second_LSB + (i == 0xffff);
+			bf->wrap_dec_table[i] = second_LSB + (i == 0);
 		}
 
-		memset((void *)bf.boolean_write_table, second_LSB, 0x100);
-		for(int i=0; i < 256; i++)
+		for (int i = 0; i < 0x10000; ++i)
+			bf->equal_table[i] = second_LSB + ((i & 0xff) == i >> 8);
+
+		for (int i = 0; i < 0x100; ++i)
 		{
-			// TXFF bit 5.
-			if(i & (1 << 5))
-				bf.boolean_write_table[i] = second_LSB + 1;
+			bf->boolean_active_table[i] = second_LSB + (i & CS_ACTIVE);
+			bf->out_last_table[i] = second_LSB +
+				((i & (OUT_HALF - 1)) == OUT_HALF - 1);
+			bf->out_pending_table[i] = second_LSB +
+				((i & (OUT_HALF - 1)) != 0);
 		}
 	}
+	return clear;
+}
 
-	// 3. Build the interpreter.
-	build_dispatch(&bf);
-	build_inc_4(&bf);
-	build_dec_4(&bf);
-	build_next_insn(&bf);
-	build_rightleft(&bf);	
-	build_incdec(&bf);
-	build_cond(&bf);
-	build_io(&bf);
-	build_insn_table(&bf);
+/* Sets the pc and head, and builds the page tables, which map the
+ * third byte of the head from each page of the tape to the next and
+ * the one before, wrapping around. Unlike the rest these depend on
+ * where the program and the tape are, not just on where the memory
+ * is, so they are set up again for each program. */
+static void set_registers(bf_t *bf, vuint8_t *program, vuint8_t *tape)
+{
+	set_address(bf, bf->pc, program);
+	set_address(bf, bf->head, tape);
+	memset((void *)bf->page_inc_table, 0, 0x100);
+	memset((void *)bf->page_dec_table, 0, 0x100);
+	uint8_t first = virtual_to_bus(tape) >> 16;
+	for (size_t i = 0; i < bf->tape_pages; ++i)
+	{
+		bf->page_inc_table[first + i] = first + (i + 1) % bf->tape_pages;
+		bf->page_dec_table[first + i] = first + (i + bf->tape_pages - 1) % bf->tape_pages;
+	}
+}
+
+/* Lays the program at path out in memory, builds its tables, and
+ * builds the interpreter for it or compiles it. bf must be zeroed but
+ * for tape_pages, quiet, channel, which the tape is cleared on, and
+ * profile, which if set says which gadgets and tables to pack
+ * together. Returns the control block to start at.
+ * With io unset the program may not use ',' or '.' and the receive
+ * chain is not started, as the UART is only for a program run
+ * alone. */
+static cb_t load(bf_t *bf, const char *path, arena_t *memory, int compile,
+		 int io)
+{
+	double start_time = wall_time();
+	stage(bf, memory);
+
+	/* The memory is arranged as
+	 * 1. DMA control blocks
+	 * 2. Tables
+	 * 3. Program counter, tape head, and the rest of the registers
+	 * 4. Output and input rings and their tables
+	 * 5. Jump and operand tables
+	 * 6. Add, carry, counter, multiply, offset, and equal tables
+	 * 7. Brainfuck program
+	 * 8. Tape
+	 * in the order they are placed. Tables indexed by writing the
+	 * low byte of their address are 256 byte aligned, and those
+	 * indexed by writing the low half are 64 KB aligned.
+	 */
+
+	// The hot gadgets and tables, then the control blocks of the
+	// rest. The hot pool ends a 64 KB block, away from the rows at
+	// the start of one that the 64 KB aligned tables, the program and
+	// the tape use most.
+	if (bf->profile)
+		arena_init(&bf->hot, "hot blocks", virtual_to_bus(place(bf, memory, "hot blocks",
+			   HOT_SIZE, HOT_SIZE, ends_64k)), HOT_SIZE);
+	size_t pool = GADGET_CBS + dma_bulk_cbs(bf->channel, tape_size(bf));
+	if (arena_sub(memory, &bf->cbs, "control blocks", pool * sizeof(struct control_block),
+		      sizeof(struct control_block)) < 0)
+	{
+		fputs("Control blocks do not fit in memory\n", stderr);
+		exit(1);
+	}
+
+	// Tables. The boolean tables index the conditional table by
+	// writing the second byte of its address, so it must not cross
+	// 64 KB. Any but the 64 KB ones may go in the hot pool.
+	bf->dispatch_table = place_hot(bf, memory, "dispatch table", 0x100, 0x100, NULL);
+	bf->inc_table = place_hot(bf, memory, "inc table", 0x100, 0x100, NULL);
+	bf->dec_table = place_hot(bf, memory, "dec table", 0x100, 0x100, NULL);
+	bf->insn_table = place_hot(bf, memory, "instruction table",
+				   sizeof *bf->insn_table, 0x100, NULL);
+	bf->boolean_inc_table = place_hot(bf, memory, "boolean inc table", 0x100,
+					  0x100, NULL);
+	bf->boolean_dec_table = place_hot(bf, memory, "boolean dec table", 0x100,
+					  0x100, NULL);
+	bf->page_inc_table = place_hot(bf, memory, "page inc table", 0x100, 0x100, NULL);
+	bf->page_dec_table = place_hot(bf, memory, "page dec table", 0x100, 0x100, NULL);
+	bf->boolean_active_table = place_hot(bf, memory, "boolean active table", 0x100,
+					     0x100, NULL);
+	bf->conditional_table = place_hot(bf, memory, "conditional table", 0x200,
+					  0x100, arena_within_64k);
+	
+	// Data. rx_stage, rx_cons and rx_prod must be consecutive.
+	bf->pc = place_hot(bf, memory, "registers", 16, 16, NULL);
+	bf->head = bf->pc + 1;
+	bf->acc = (vuint8_t *)(bf->head + 1);
+	bf->out_idx = bf->acc + 1;
+	bf->rx_stage = bf->acc + 2;
+	bf->rx_cons = bf->acc + 3;
+	bf->rx_prod = bf->acc + 4;
+	// Only the low halves of ring addresses are looked up, so the
+	// rings are aligned to their size to keep them within 64 KB.
+	bf->out_ring = place_hot(bf, memory, "output ring",
+				 OUT_RING_SIZE * sizeof *bf->out_ring,
+				 OUT_RING_SIZE * sizeof *bf->out_ring, NULL);
+	bf->out_slot_table = place_hot(bf, memory, "output slot table", 0x200,
+				       0x100, NULL);
+	bf->out_full_base_table = place_hot(bf, memory, "output full base table",
+					    0x200, 0x100, NULL);
+	bf->out_part_base_table = place_hot(bf, memory, "output part base table",
+					    0x200, 0x100, NULL);
+	bf->out_part_len_table = place_hot(bf, memory, "output part length table",
+					   0x200, 0x100, NULL);
+	bf->out_part_next_table = place_hot(bf, memory, "output part next table",
+					    0x100, 0x100, NULL);
+	bf->out_last_table = place_hot(bf, memory, "output last table", 0x100,
+				       0x100, NULL);
+	bf->out_pending_table = place_hot(bf, memory, "output pending table", 0x100,
+					  0x100, NULL);
+	bf->rx_ring = place_hot(bf, memory, "input ring",
+				RX_RING_SIZE * sizeof *bf->rx_ring,
+				RX_RING_SIZE * sizeof *bf->rx_ring, NULL);
+	bf->rx_slot_table = place_hot(bf, memory, "input slot table", 0x200, 0x100,
+				      NULL);
+	bf->jump_table = place(bf, memory, "jump table", 4 * JUMP_PLANE_SIZE, 0x10000, NULL);
+	bf->operand_table = place(bf, memory, "operand table", 0x10000, 0x10000, NULL);
+	bf->add_table = place(bf, memory, "add table", 0x10000, 0x10000, NULL);
+	bf->carry_table = place(bf, memory, "carry table", 0x10000, 0x10000, NULL);
+	bf->succ_lo_table = place(bf, memory, "succ lo table", 0x10000, 0x10000, NULL);
+	bf->succ_hi_table = place(bf, memory, "succ hi table", 0x10000, 0x10000, NULL);
+	bf->pred_lo_table = place(bf, memory, "pred lo table", 0x10000, 0x10000, NULL);
+	bf->pred_hi_table = place(bf, memory, "pred hi table", 0x10000, 0x10000, NULL);
+	bf->wrap_inc_table = place(bf, memory, "wrap inc table", 0x10000, 0x10000, NULL);
+	bf->wrap_dec_table = place(bf, memory, "wrap dec table", 0x10000, 0x10000, NULL);
+	bf->mul_table = place(bf, memory, "mul table", 0x10000, 0x10000, NULL);
+	bf->offset_table = place(bf, memory, "offset table", 0x10000, 0x10000, NULL);
+	bf->equal_table = place(bf, memory, "equal table", 0x10000, 0x10000, NULL);
+
+	// Program
+	source_t source;
+	read_program(&source, path);
+	vuint8_t *program = place(bf, memory, "program", source.size + 1, 0x10000, NULL);
+	bf->program = program;
+	size_t program_size = compact_program(program, &source);
+	size_t *match = match_brackets(program, program_size, &source);
+	if (!io)
+	{
+		for (size_t off = 0; off < program_size; ++off)
+		{
+			if (program[off] == ',' || program[off] == '.')
+				source_error(&source, off, "',' and '.' need the UART, "
+					     "which only a program run alone may use");
+		}
+	}
+	if (!bf->quiet)
+		fprintf(stderr, "Compacted %zu bytes to %zu (%.1f%%)\n", source.size + 1,
+			program_size, 100.0 * program_size / (source.size + 1));
+	// The jump table's planes are a 2D stride apart, which is a
+	// signed 16-bit field, so the interpreter takes programs of one
+	// plane at most and compiles the rest. That changes the run's
+	// cycles and image, so it is said.
+	if (!compile && program_size > JUMP_PLANE_SIZE)
+	{
+		if (!bf->quiet)
+			fprintf(stderr, "%s: compiling instead of interpreting, as %zu bytes "
+				"exceed the %d of the jump table\n", path, program_size,
+				JUMP_PLANE_SIZE);
+		compile = 1;
+	}
+
+	// Tape. A wrapping tape is 64 KB aligned so only the low half of
+	// the head changes within a page, and a paged one must not cross
+	// a 16 MB boundary so only the third byte changes between pages.
+	size_t tape_bytes = tape_size(bf);
+	vuint8_t *tape = place(bf, memory, "tape", tape_bytes, 0x10000, arena_within_16m);
+	uintptr_t tape_address = virtual_to_bus(tape);
+	bf->tape = tape;
+
+	// 1 and 2, or copy what they and the interpreter's gadgets build
+	// from the image of the last build, or else from the image cache.
+	cb_t start, clear;
+	cache_key_t key;
+	const char *from = NULL;
+	if (!compile && bf->image)
+	{
+		cache_key(bf, program, io, &key);
+		if (unpack_image(bf, &key, bf->image, &start, &clear))
+			from = " from the last image";
+		else if (bf->cache && read_cache(bf, &key, bf->image) &&
+			 unpack_image(bf, &key, bf->image, &start, &clear))
+			from = " from the image cache";
+	}
+	if (!from)
+		clear = build_tables(bf, tape_bytes);
+
+	// 3. Build the interpreter or compile the program. The branch
+	// tables and the compiled program go after the tape, the program
+	// taking the rest of the memory. The interpreter's gadgets go in
+	// the image, and the jump, operand and offset tables, the
+	// registers and the page tables, which are the program's own,
+	// are filled in after.
+	if (compile)
+	{
+		bf->branch_zero_table = place_hot(bf, memory, "branch zero table", 0x800,
+						  0x100, NULL);
+		bf->branch_flush_table = place_hot(bf, memory, "branch flush table", 0x800,
+						   0x100, NULL);
+		build_branch_table(bf->branch_zero_table, test_nonzero);
+		build_branch_table(bf->branch_flush_table, test_half_full);
+		build_tramp(bf);
+		bf->inc_head = build_head_step(bf, "inc_head", 0, HEAD_INC_INDEX, bf->tramp2);
+		bf->dec_head = build_head_step(bf, "dec_head", 1, HEAD_DEC_INDEX, bf->tramp2);
+		bf->right_n = build_move_n(bf, 0, bf->tramp2);
+		bf->left_n = build_move_n(bf, 1, bf->tramp2);
+		bf->flush_full = build_flush_full(bf, bf->tramp2);
+		bf->flush = build_flush_partial(bf, "flush", FLUSH_INDEX, FLUSH_PART_WAIT_INDEX, bf->tramp2);
+		bf->input = build_input(bf, bf->tramp2);
+
+		size_t code_size = arena_left(memory, sizeof(struct control_block));
+		cb_t code = place(bf, memory, "compiled program", code_size,
+				  sizeof(struct control_block), NULL);
+		start = code;
+		if (io)
+		{
+			build_receive(bf);
+			start = build_start(bf, start);
+		}
+		size_t count = compile_program(bf, code, code + code_size / sizeof *code,
+					       program);
+		if (!bf->quiet)
+			fprintf(stderr, "Compiled %zu instructions into %zu control blocks\n",
+				count, (size_t)(bf->stop + 1 - code));
+	}
+	else
+	{
+		if (!from)
+		{
+			build_dispatch(bf);
+			build_next_insn(bf);
+			build_rightleft(bf);	
+			build_incdec(bf);
+			build_cond(bf);
+			build_runs(bf);
+			build_idioms(bf);
+			build_io(bf);
+			build_insn_table(bf);
+			start = bf->dispatch;
+			if (io)
+			{
+				build_receive(bf);
+				start = build_start(bf, start);
+			}
+			if (bf->image)
+			{
+				pack_image(bf, &key, start, clear, bf->image);
+				if (bf->cache)
+					write_cache(bf, &key, bf->image);
+			}
+		}
+		build_jump_table(bf, program, program_size, match);
+		fold_runs(bf, program, program_size, match);
+	}
+	set_registers(bf, program, tape);
+
+	// 4. Copy everything but the tape over to the memory, then
+	// clear the tape with the DMA. Only the compiled program follows
+	// the tape, if anything.
+	double built = wall_time();
+	uintptr_t end = compile? virtual_to_bus(bf->stop + 1):memory->next;
+	transfer(bf->stage.virt, tape_address - bf->stage.bus, 0);
+	transfer(tape + tape_bytes, end - (tape_address + tape_bytes), 0);
+	if (dma_memset(bf->channel, in_memory(clear), in_memory(tape), 0, tape_bytes, NULL))
+	{
+		perror("Clearing the tape");
+		exit(1);
+	}
+	if (!bf->quiet)
+		fprintf(stderr, "Built in %.3f s%s, copied %zu KiB to the DMA memory in %.3f s\n",
+			built - start_time, from? from:"",
+			(size_t)(end - bf->stage.bus - tape_bytes) >> 10, wall_time() - built);
 
 #if 0
-	for (cb_t cb = cb_base; cb < bf.next_cb; ++cb)
+	arena_dump(memory, stdout);
+	arena_dump(&bf->cbs, stdout);
+	for (uintptr_t addr = bf->cbs.base; addr < bf->cbs.next; addr += sizeof(struct control_block))
 	{
-		printf("cb %08lx\n", (unsigned long int)virtual_to_bus(cb));
-		print_control_block(cb);
+		printf("cb %08lx\n", (unsigned long int)addr);
+		print_control_block(bus_to_virtual(addr));
 		puts("");
 	}
 #endif
 
 #if 0 
-	printf("dispatch:\t%08x\n", (unsigned)virtual_to_bus(bf.dispatch));
-	printf("tramp:\t%08x\n", (unsigned)virtual_to_bus(bf.tramp));
-	printf("tramp2:\t%08x\n", (unsigned)virtual_to_bus(bf.tramp2));
-	printf("inc_4:\t%08x\n", (unsigned)virtual_to_bus(bf.inc_4));
-	printf("dec_4:\t%08x\n", (unsigned)virtual_to_bus(bf.dec_4));
-	printf("next_insn:\t%08x\n", (unsigned)virtual_to_bus(bf.next_insn));
-	printf("inc:\t%08x\n", (unsigned)virtual_to_bus(bf.inc));
-	printf("dec:\t%08x\n", (unsigned)virtual_to_bus(bf.dec));
-	printf("right:\t%08x\n", (unsigned)virtual_to_bus(bf.right));
-	printf("left:\t%08x\n", (unsigned)virtual_to_bus(bf.left));
-	printf("lcond:\t%08x\n", (unsigned)virtual_to_bus(bf.lcond));
-	printf("rcond:\t%08x\n", (unsigned)virtual_to_bus(bf.rcond));
-	printf("input:\t%08x\n", (unsigned)virtual_to_bus(bf.input));
-	printf("output:\t%08x\n", (unsigned)virtual_to_bus(bf.output));
-	printf("pc:\t%08x\n", (unsigned)virtual_to_bus(bf.pc));
-	printf("lc:\t%08x\n", (unsigned)virtual_to_bus(bf.lc));
-	printf("head:\t%08x\n", (unsigned)virtual_to_bus(bf.head));		
-
-	trace_dma(bf.dispatch);
-#else
-	run_dma(bf.dispatch);
+	printf("dispatch:\t%08x\n", (unsigned)virtual_to_bus(bf->dispatch));
+	printf("tramp:\t%08x\n", (unsigned)virtual_to_bus(bf->tramp));
+	printf("tramp2:\t%08x\n", (unsigned)virtual_to_bus(bf->tramp2));
+	printf("next_insn:\t%08x\n", (unsigned)virtual_to_bus(bf->next_insn));
+	printf("jump:\t%08x\n", (unsigned)virtual_to_bus(bf->jump));
+	printf("inc:\t%08x\n", (unsigned)virtual_to_bus(bf->inc));
+	printf("dec:\t%08x\n", (unsigned)virtual_to_bus(bf->dec));
+	printf("right:\t%08x\n", (unsigned)virtual_to_bus(bf->right));
+	printf("left:\t%08x\n", (unsigned)virtual_to_bus(bf->left));
+	printf("lcond:\t%08x\n", (unsigned)virtual_to_bus(bf->lcond));
+	printf("rcond:\t%08x\n", (unsigned)virtual_to_bus(bf->rcond));
+	printf("input:\t%08x\n", (unsigned)virtual_to_bus(bf->input));
+	printf("output:\t%08x\n", (unsigned)virtual_to_bus(bf->output));
+	printf("pc:\t%08x\n", (unsigned)virtual_to_bus(bf->pc));
+	printf("head:\t%08x\n", (unsigned)virtual_to_bus(bf->head));		
 #endif
-	printf("Output: %s\n", (char *)tape);
 
+	free(match);
+	if (bf->source)
+		*bf->source = source;
+	else
+	{
+		free(source.positions);
+		free(source.text);
+	}
+	return start;
+}
+
+/* Runs the programs at paths on up to channels DMA channels at once.
+ * Each channel has a partition of the memory, into which the next
+ * program is loaded when the one before finishes. Prints the results
+ * unless quiet. Returns the seconds the batch took, on the clock jobs
+ * are timed by, and adds up in busy the seconds the programs ran. */
+static double run_batch(char *paths[], int count, int channels, int compile,
+			size_t tape_pages, const profile_t *profile, const char *cache,
+			int quiet, double *busy)
+{
+	arena_t memory;
+	arena_init(&memory, "memory", dma_memory.bus, dma_memory.size);
+	arena_t *partitions = calloc(channels, sizeof *partitions);
+	size_t partition = (dma_memory.size / channels) & ~0xfffff;
+	for (int i = 0; i < channels; ++i)
+	{
+		if (arena_sub(&memory, &partitions[i], "a partition", partition,
+			      0x100000) < 0)
+		{
+			fputs("Partitions do not fit in memory\n", stderr);
+			exit(1);
+		}
+	}
+	bf_t *bfs = calloc(channels, sizeof *bfs);
+	dma_job_t **jobs = calloc(channels, sizeof *jobs);
+	int *running = calloc(channels, sizeof *running);
+	// The interpreter is built for the first program and copied for
+	// the rest, whichever partition they are loaded into.
+	image_t image = { NULL, 0 };
+	int next = 0;
+	int active = 0;
+	*busy = 0;
+
+	double start = dma_time();
+	for (;;)
+	{
+		// Load the next programs into the idle channels.
+		for (int i = 0; i < channels && next < count; ++i)
+		{
+			if (jobs[i])
+				continue;
+			unstage(&bfs[i]);
+			arena_free(&bfs[i].cbs);
+			arena_free(&bfs[i].hot);
+			arena_reset(&partitions[i]);
+			memset(&bfs[i], 0, sizeof bfs[i]);
+			bfs[i].tape_pages = tape_pages;
+			bfs[i].quiet = quiet;
+			bfs[i].channel = i;
+			bfs[i].profile = profile;
+			bfs[i].cache = cache;
+			bfs[i].image = &image;
+			cb_t cb = load(&bfs[i], paths[next], &partitions[i], compile, 0);
+			jobs[i] = dma_submit_on(i, cb);
+			if (!jobs[i])
+			{
+				perror("dma_submit_on");
+				exit(1);
+			}
+			running[i] = next++;
+			++active;
+		}
+		if (!active)
+			break;
+
+		// Collect the ones that have finished.
+		int finished = 0;
+		for (int i = 0; i < channels; ++i)
+		{
+			struct dma_job_status status;
+			if (!jobs[i])
+				continue;
+			if (!dma_poll(jobs[i], &status))
+			{
+				if (!dma_wait_options.timeout_ms ||
+				    status.seconds * 1000 < dma_wait_options.timeout_ms)
+					continue;
+				dma_cancel(jobs[i]);
+				dma_poll(jobs[i], &status);
+			}
+			const char *path = paths[running[i]];
+			*busy += status.seconds;
+			if (status.state == DMA_JOB_DONE && !quiet)
+			{
+				fprintf(stderr, "%s: %.3f s on channel %d, read back in %.3f s\n",
+					path, status.seconds, i, read_back(&bfs[i]));
+				printf("%s: Output: %s\n", path, (char *)bfs[i].tape);
+			}
+			else if (status.state == DMA_JOB_FAILED)
+				fprintf(stderr, "%s: the DMA failed (CS %08x, DEBUG %08x)\n",
+					path, (unsigned)status.cs, (unsigned)status.debug);
+			else if (status.state == DMA_JOB_CANCELLED)
+				fprintf(stderr, "%s: the DMA did not finish within %lu ms\n",
+					path, dma_wait_options.timeout_ms);
+			dma_release(jobs[i]);
+			jobs[i] = NULL;
+			--active;
+			++finished;
+		}
+		if (!finished)
+		{
+			struct timespec pause = { 0, 1000000 };
+			nanosleep(&pause, NULL);
+		}
+	}
+	double seconds = dma_time() - start;
+
+	for (int i = 0; i < channels; ++i)
+	{
+		unstage(&bfs[i]);
+		arena_free(&bfs[i].cbs);
+		arena_free(&bfs[i].hot);
+		arena_free(&partitions[i]);
+	}
+	arena_free(&memory);
+	free(image.bytes);
+	free(running);
+	free(jobs);
+	free(bfs);
+	free(partitions);
+	return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+	int compile = 0;
+	size_t tape_pages = 0;
+	int channels = 0;
+	int sweep = 0;
+	const char *profile_in = NULL;
+	const char *profile_out = NULL;
+	const char *cache = NULL;
+	const char *trace_out = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "ct:m:w:T:j:Sp:P:C:x:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			compile = 1;
+			break;
+		case 't':
+		{
+			char *end;
+			unsigned long kb = strtoul(optarg, &end, 0);
+			if (*end || kb == 0 || kb % 64 || kb > 0x4000)
+			{
+				fputs("Tape size must be a multiple of 64 KiB up to 16 MiB\n", stderr);
+				exit(1);
+			}
+			tape_pages = kb / 64;
+			break;
+		}
+		case 'm':
+		{
+			char *end;
+			unsigned long mb = strtoul(optarg, &end, 0);
+			if (*end || mb < 4 || mb > 0x400)
+			{
+				fputs("Memory size must be from 4 MiB up to 1 GiB\n", stderr);
+				exit(1);
+			}
+			dma_memory_size = mb << 20;
+			break;
+		}
+		case 'w':
+			if (!strcmp(optarg, "spin"))
+				dma_wait_options.mode = DMA_WAIT_SPIN;
+			else if (!strcmp(optarg, "backoff"))
+				dma_wait_options.mode = DMA_WAIT_BACKOFF;
+			else if (!strncmp(optarg, "irq", 3) && (!optarg[3] || optarg[3] == '='))
+			{
+				dma_wait_options.mode = DMA_WAIT_INTERRUPT;
+				if (optarg[3])
+					dma_wait_options.uio_device = optarg + 4;
+			}
+			else
+				goto usage;
+			break;
+		case 'T':
+		{
+			char *end;
+			dma_wait_options.timeout_ms = strtoul(optarg, &end, 0);
+			if (*end)
+				goto usage;
+			break;
+		}
+		case 'j':
+		{
+			char *end;
+			channels = strtol(optarg, &end, 0);
+			if (*end || channels < 1)
+				goto usage;
+			break;
+		}
+		case 'S':
+			sweep = 1;
+			break;
+		case 'p':
+			profile_in = optarg;
+			break;
+		case 'P':
+			profile_out = optarg;
+			break;
+		case 'C':
+			cache = optarg;
+			break;
+		case 'x':
+			trace_out = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (channels? optind == argc || profile_out || trace_out :
+	    optind != argc - 1 || sweep)
+	{
+	usage:
+		fprintf(stderr, "Usage: %s [-c] [-t KiB] [-m MiB] [-w spin|backoff|irq[=UIO]] [-T ms]\n"
+			"          [-p profile] [-P profile] [-C dir] [-x trace] program.bf\n"
+			"       %s -j channels [-S] [-c] [-t KiB] [-m MiB] [-T ms] [-p profile]\n"
+			"          [-C dir] program.bf...\n"
+			"  -c  compile the program to control blocks instead of interpreting it,\n"
+			"      as is done anyway for one over 32 KiB compacted\n"
+			"  -t  use a wrap-around tape of KiB (a multiple of 64) instead of\n"
+			"      the flat 2 MiB tape\n"
+			"  -m  get MiB of memory for the DMA from the firmware instead of\n"
+			"      64 MiB, falling back on 64 MiB hidden from Linux at boot\n"
+			"  -w  wait for the DMA by polling back to back, by polling with\n"
+			"      growing sleeps in between (the default), or by blocking on its\n"
+			"      interrupt through a UIO device (default /dev/uio0)\n"
+			"  -T  give up on the DMA after ms milliseconds\n"
+			"  -j  run the programs, which may not use ',' or '.', side by side\n"
+			"      on up to this many full DMA channels and print their tapes\n"
+			"  -S  run them on 1, 2, ... channels in turn and compare throughput\n"
+			"  -p  pack the gadgets and tables this profile found hottest into\n"
+			"      as few SDRAM rows as possible\n"
+			"  -P  count the accesses to each gadget and table during the run\n"
+			"      and write them as a profile for -p (emulator only)\n"
+			"  -C  keep the interpreter's built image in dir and copy it from\n"
+			"      there on later runs with the same layout; setuid for a user\n"
+			"      other than root, only read images from a dir of root's that\n"
+			"      no one else may write to\n"
+			"  -x  record the control blocks run into trace, every one on the\n"
+			"      emulator and a sample of them on the board, for bftrace\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	// The profile and the trace name the blocks as they are built, so
+	// they are written without the cache.
+	if (profile_out || trace_out)
+		cache = NULL;
+	if (cache && stat("/proc/self/exe", &exe))
+	{
+		perror("/proc/self/exe");
+		exit(1);
+	}
+	setuid_run = getuid() != 0 && geteuid() != getuid();
+	setup();
+	// The gadgets move data with the 2D mode, which a lite channel
+	// does not have.
+	if (dma_lite(0))
+	{
+		fputs("The DMA channel reserved is a lite one, without the 2D mode "
+		      "bf needs\n", stderr);
+		cleanup();
+		exit(1);
+	}
+	if (cache && setuid_run)
+	{
+		struct stat st;
+		if (stat(cache, &st))
+		{
+			perror(cache);
+			cleanup();
+			exit(1);
+		}
+		if (!S_ISDIR(st.st_mode) || !roots_own(&st))
+		{
+			fprintf(stderr, "%s: bf run setuid takes images only from a "
+				"directory of root's that no one else may write to\n", cache);
+			cleanup();
+			exit(1);
+		}
+	}
+	else if (cache && mkdir(cache, 0777) && errno != EEXIST)
+	{
+		perror(cache);
+		cleanup();
+		exit(1);
+	}
+	profile_t profile;
+	if (profile_in)
+		read_profile(&profile, profile_in);
+
+	if (channels)
+	{
+		// Only full channels can run the gadgets, and the board has
+		// few of them, so no more are used than it has to give.
+		int got = dma_add_channels(channels - 1, channels - 1);
+		int full = 1;
+		while (full < got && !dma_lite(full))
+			++full;
+		got = full;
+		if (got < channels)
+			fprintf(stderr, "Running on the %d free full DMA channels of %d asked for\n",
+				got, channels);
+		char **paths = argv + optind;
+		int count = argc - optind;
+		double one = 0;
+		for (int n = sweep? 1:got; n <= got; ++n)
+		{
+			// The throughput against channel count shows where
+			// the channels begin to hold each other up on the
+			// bus: busy keeps growing while the rate does not.
+			double busy;
+			double seconds = run_batch(paths, count, n, compile, tape_pages,
+						   profile_in? &profile:NULL, cache, n < got, &busy);
+			double rate = seconds > 0? count / seconds : 0;
+			if (n == 1)
+				one = rate;
+			fprintf(stderr, "%d programs on %d channels in %.3f s: "
+				"%.1f programs/s", count, n, seconds, rate);
+			if (one > 0)
+				fprintf(stderr, ", %.2fx one channel", rate / one);
+			fprintf(stderr, ", %.2f channels busy\n", seconds > 0? busy / seconds : 0);
+		}
+		cleanup();
+		return 0;
+	}
+
+	arena_t memory;
+	arena_init(&memory, "memory", dma_memory.bus, dma_memory.size);
+	bf_t bf;
+	memset(&bf, 0, sizeof bf);
+	bf.tape_pages = tape_pages;
+	bf.profile = profile_in? &profile:NULL;
+	bf.cache = cache;
+	image_t image = { NULL, 0 };
+	if (cache)
+		bf.image = &image;
+	source_t source;
+	if (trace_out)
+		bf.source = &source;
+	cb_t start = load(&bf, argv[optind], &memory, compile, 1);
+	if (bf.profile)
+		fprintf(stderr, "Packed the hot gadgets and tables into %zu bytes\n",
+			(size_t)(bf.hot.next - bf.hot.base));
+	if (profile_out && dma_profile(1))
+	{
+		fputs("The DMA cannot count accesses here; profiling needs the emulator\n",
+		      stderr);
+		cleanup();
+		exit(1);
+	}
+
+	if (trace_out)
+	{
+		// 4. Run it, recording the blocks into the trace with the
+		// names of the gadgets and tables they are in.
+		dma_trace_t trace;
+		if (dma_trace_open(&trace, trace_out, TRACE_RECORDS))
+		{
+			perror(trace_out);
+			cleanup();
+			exit(1);
+		}
+		add_symbols(&trace, &bf, &bf.hot);
+		add_symbols(&trace, &bf, &bf.cbs);
+		add_symbols(&trace, &bf, &memory);
+		add_source(&trace, &bf, &source);
+		free(source.positions);
+		free(source.text);
+		int ret = trace_dma(start, &trace);
+		int error = errno;
+		if (dma_trace_close(&trace))
+		{
+			perror(trace_out);
+			cleanup();
+			exit(1);
+		}
+		if (ret)
+		{
+			if (error == ETIMEDOUT)
+				fprintf(stderr, "The DMA did not finish within %lu ms\n",
+					dma_wait_options.timeout_ms);
+			else
+				fprintf(stderr, "trace_dma: %s\n", strerror(error));
+			cleanup();
+			exit(1);
+		}
+		fprintf(stderr, "Traced %llu control blocks%s into %s\n",
+			(unsigned long long)trace.written,
+			trace.sampled? " (sampled)":"", trace_out);
+	}
+	else
+	{
+		// 4. Run it, ending with an interrupt if one is waited for.
+		if (dma_wait_options.mode == DMA_WAIT_INTERRUPT)
+			((cb_t)in_memory(bf.stop))->ti |= TI_INTEN;
+		if (run_dma(start))
+		{
+			if (errno == ETIMEDOUT)
+				fprintf(stderr, "The DMA did not finish within %lu ms\n",
+					dma_wait_options.timeout_ms);
+			else
+				perror("run_dma");
+			cleanup();
+			exit(1);
+		}
+		fprintf(stderr, "Waited %.3f s for the DMA using %.3f s of CPU "
+			"(%lu polls, %lu sleeps, %lu interrupts)\n",
+			dma_wait_stats.seconds, dma_wait_stats.cpu_seconds,
+			dma_wait_stats.polls, dma_wait_stats.sleeps,
+			dma_wait_stats.interrupts);
+	}
+	fprintf(stderr, "Read the tape back in %.3f s\n", read_back(&bf));
+	printf("Output: %s\n", (char *)bf.tape);
+	if (profile_out)
+	{
+		write_profile(profile_out, &bf, &memory);
+		dma_profile(0);
+	}
+
+	unstage(&bf);
+	free(image.bytes);
 	cleanup();
 	return 0;
 }
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* A named range of bus addresses and what the trace spent in it. */
+struct symbol
+{
+	uint32_t addr;
+	uint32_t size;
+	char *name;
+	struct gadget *gadget;
+};
+
+/* The counts for one name, which may cover several ranges. */
+struct gadget
+{
+	const char *name;
+	uint64_t cbs;		// records in any of its ranges
+	uint64_t entries;	// records in it after one outside it
+};
+
+/* The place in its file of each byte of a program the chain reads. */
+struct source
+{
+	uint32_t addr;
+	uint32_t count;
+	char *path;
+	struct dma_trace_position *positions;
+};
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size? size:1);
+	if (!p)
+	{
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void read_all(FILE *fp, void *buf, size_t size, const char *path)
+{
+	if (size && fread(buf, size, 1, fp) != 1)
+	{
+		if (ferror(fp))
+			perror(path);
+		else
+			fprintf(stderr, "%s: truncated trace\n", path);
+		exit(1);
+	}
+}
+
+static int by_addr(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+	return x->addr < y->addr? -1 : x->addr > y->addr? 1 : 0;
+}
+
+static int by_cbs(const void *a, const void *b)
+{
+	const struct gadget *x = a, *y = b;
+	return x->cbs < y->cbs? 1 : x->cbs > y->cbs? -1 : strcmp(x->name, y->name);
+}
+
+/* The symbol, of count sorted by address, that addr is in, or NULL. */
+static struct symbol *lookup(struct symbol *symbols, size_t count, uint32_t addr)
+{
+	size_t lo = 0, hi = count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && addr - symbols[lo - 1].addr < symbols[lo - 1].size)
+		return &symbols[lo - 1];
+	return NULL;
+}
+
+/* Prints where in its file the byte at addr is, if it is in one of
+ * count sources. */
+static void print_position(const struct source *sources, size_t count, uint32_t addr)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint32_t off = addr - sources[i].addr;
+		if (off < sources[i].count)
+		{
+			printf("  %s:%u:%u", sources[i].path,
+			       (unsigned)sources[i].positions[off].line,
+			       (unsigned)sources[i].positions[off].column);
+			return;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int dump = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "d")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dump = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+	{
+	usage:
+		fprintf(stderr, "Usage: %s [-d] trace\n"
+			"  -d  print every record before the counts, with the place\n"
+			"      in the program of the byte it reads if it reads one\n"
+			"Counts the control blocks in a trace written by bf -x for each\n"
+			"gadget and table, and the times the chain entered it.\n",
+			argv[0]);
+		exit(1);
+	}
+	const char *path = argv[optind];
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+	{
+		perror(path);
+		exit(1);
+	}
+
+	// 1. Check the header.
+	struct dma_trace_header header;
+	read_all(fp, &header, sizeof header, path);
+	if (memcmp(header.magic, DMA_TRACE_MAGIC, sizeof header.magic) ||
+	    header.version != DMA_TRACE_VERSION)
+	{
+		fprintf(stderr, "%s: not a version %d trace\n", path, DMA_TRACE_VERSION);
+		exit(1);
+	}
+
+	// 2. Read the symbols and give each name one set of counts.
+	struct symbol *symbols = xmalloc(header.symbol_count * sizeof *symbols);
+	struct gadget *gadgets = xmalloc((header.symbol_count + 1) * sizeof *gadgets);
+	size_t gadget_count = 0;
+	for (uint32_t i = 0; i < header.symbol_count; ++i)
+	{
+		struct dma_trace_symbol symbol;
+		read_all(fp, &symbol, sizeof symbol, path);
+		char *name = xmalloc(symbol.name_len + 1);
+		read_all(fp, name, symbol.name_len, path);
+		name[symbol.name_len] = '\0';
+		size_t j = 0;
+		while (j < gadget_count && strcmp(gadgets[j].name, name))
+			++j;
+		if (j == gadget_count)
+			gadgets[gadget_count++] = (struct gadget){ name, 0, 0 };
+		symbols[i] = (struct symbol){ symbol.addr, symbol.size, name, &gadgets[j] };
+	}
+	qsort(symbols, header.symbol_count, sizeof *symbols, by_addr);
+	struct gadget *unknown = &gadgets[gadget_count++];
+	*unknown = (struct gadget){ "(unknown)", 0, 0 };
+
+	// 3. Read the sources.
+	struct source *sources = xmalloc(header.source_count * sizeof *sources);
+	for (uint32_t i = 0; i < header.source_count; ++i)
+	{
+		struct dma_trace_source source;
+		read_all(fp, &source, sizeof source, path);
+		char *name = xmalloc(source.path_len + 1);
+		read_all(fp, name, source.path_len, path);
+		name[source.path_len] = '\0';
+		struct dma_trace_position *positions =
+			xmalloc((size_t)source.count * sizeof *positions);
+		read_all(fp, positions, (size_t)source.count * sizeof *positions, path);
+		sources[i] = (struct source){ source.addr, source.count, name, positions };
+	}
+
+	// 4. Count the records, reading them a buffer at a time. Runs
+	// through a gadget are long, so the symbol of the last record is
+	// tried before searching.
+	struct dma_trace_record records[4096];
+	const struct symbol *last = NULL;
+	const struct gadget *previous = NULL;
+	uint64_t left = header.record_count;
+	while (left)
+	{
+		size_t n = left < 4096? left:4096;
+		read_all(fp, records, n * sizeof *records, path);
+		left -= n;
+		for (size_t i = 0; i < n; ++i)
+		{
+			const struct dma_trace_record *r = &records[i];
+			if (!last || r->cb - last->addr >= last->size)
+				last = lookup(symbols, header.symbol_count, r->cb);
+			struct gadget *gadget = last? last->gadget : unknown;
+			gadget->cbs += 1;
+			if (gadget != previous)
+				gadget->entries += 1;
+			previous = gadget;
+			if (dump)
+			{
+				if (last)
+					printf("%s+%#x", last->name, (unsigned)(r->cb - last->addr));
+				else
+					printf("%08x", (unsigned)r->cb);
+				printf(": src=%8x  dest=%8x  len=%-5u  %08x",
+				       (unsigned)r->source_ad, (unsigned)r->dest_ad,
+				       (unsigned)r->txfr_len, (unsigned)r->data);
+				print_position(sources, header.source_count, r->source_ad);
+				putchar('\n');
+			}
+		}
+	}
+	fclose(fp);
+
+	// 5. Print the gadgets the chain spent most in first.
+	qsort(gadgets, gadget_count, sizeof *gadgets, by_cbs);
+	uint64_t total = header.record_count;
+	printf("%llu control blocks%s\n", (unsigned long long)total,
+	       header.sampled? ", sampled from a run at full speed":"");
+	printf("%12s %7s %12s  %s\n", header.sampled? "samples":"cbs", "%", "entries", "gadget");
+	for (size_t i = 0; i < gadget_count && gadgets[i].cbs; ++i)
+		printf("%12llu %6.2f%% %12llu  %s\n", (unsigned long long)gadgets[i].cbs,
+		       100.0 * gadgets[i].cbs / total, (unsigned long long)gadgets[i].entries,
+		       gadgets[i].name);
+
+	for (uint32_t i = 0; i < header.symbol_count; ++i)
+		free(symbols[i].name);
+	free(symbols);
+	free(gadgets);
+	for (uint32_t i = 0; i < header.source_count; ++i)
+	{
+		free(sources[i].path);
+		free(sources[i].positions);
+	}
+	free(sources);
+	return 0;
+}
@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <string.h>
+#include "bulk.h"
+#include "common.h"
+#include "dma.h"
+#include "mem.h"
+
+/* The most a control block moves: TXFR_LEN has 30 bits on a full
+ * channel and 16 on a lite one. Both are multiples of 16 so the
+ * blocks after the first stay aligned for wide beats. */
+#define FULL_MAX_LEN 0x3ffffff0
+#define LITE_MAX_LEN 0xfff0
+
+const size_t dma_bulk_class_sizes[DMA_BULK_CLASSES] =
+{
+	0x100, 0x4000, 0x100000, SIZE_MAX,
+};
+
+/* Single narrow beats for the smallest transfers, which are over
+ * before a burst would pay off, and wide bursts of 64 bytes, a line
+ * of the L2 cache, or more above that. */
+struct dma_bulk_settings dma_bulk_settings[DMA_BULK_CLASSES] =
+{
+	{ 0, 0, 0 },
+	{ 1, 3, 0 },
+	{ 1, 7, 0 },
+	{ 1, 15, 0 },
+};
+
+static size_t max_len(int channel)
+{
+	return dma_lite(channel)? LITE_MAX_LEN:FULL_MAX_LEN;
+}
+
+size_t dma_bulk_cbs(int channel, size_t size)
+{
+	// One more holds the pattern of a fill.
+	size_t max = max_len(channel);
+	return (size + max - 1) / max + 1;
+}
+
+static const struct dma_bulk_settings *class_settings(size_t size)
+{
+	int i = 0;
+	while (size > dma_bulk_class_sizes[i])
+		++i;
+	return &dma_bulk_settings[i];
+}
+
+static uint32_t settings_ti(const struct dma_bulk_settings *settings, int wide)
+{
+	uint32_t ti = TI_DEST_INC | TI_WAIT_RESP |
+		((settings->burst << 12) & TI_BURST_LENGTH_MASK) |
+		((settings->waits << 21) & TI_WAITS_MASK);
+	if (wide)
+		ti |= TI_SRC_WIDTH | TI_DEST_WIDTH;
+	return ti;
+}
+
+/* Fills in the blocks at cb to move the size bytes from src to dest,
+ * each at most max, linked on to the block after them. Returns how
+ * many there are. */
+static size_t add_blocks(volatile struct control_block *cb, size_t max,
+			 uint32_t ti, uintptr_t src, uintptr_t dest, size_t size)
+{
+	size_t count = (size + max - 1) / max;
+	for (size_t i = 0; i < count; ++i, ++cb)
+	{
+		size_t off = i * max;
+		cb->ti = ti;
+		cb->source_ad = ti & TI_SRC_INC? src + off:src;
+		cb->dest_ad = dest + off;
+		cb->txfr_len = size - off < max? size - off:max;
+		cb->stride = 0;
+		cb->nextconbk = virtual_to_bus(cb + 1);
+	}
+	return count;
+}
+
+/* Ends the chain of count blocks at cbs, runs it and waits. */
+static int submit(int channel, volatile struct control_block *cbs, size_t count)
+{
+	cbs[count - 1].nextconbk = 0;
+	dma_job_t *job = dma_submit_on(channel, cbs);
+	if (!job)
+		return -1;
+	struct dma_job_status status;
+	int ret = dma_wait(job, dma_wait_options.timeout_ms, &status);
+	int error = errno;
+	dma_release(job);
+	if (!ret && status.state != DMA_JOB_DONE)
+	{
+		error = EIO;
+		ret = -1;
+	}
+	errno = error;
+	return ret;
+}
+
+/* Splits the transfer into blocks of at most the channel's limit, runs
+ * them and waits. */
+static int run(int channel, volatile struct control_block *cbs, uint32_t ti,
+	       uintptr_t src, uintptr_t dest, size_t size)
+{
+	return submit(channel, cbs, add_blocks(cbs, max_len(channel), ti,
+						src, dest, size));
+}
+
+int dma_memcpy(int channel, volatile struct control_block *cbs,
+	       volatile void *dest, const volatile void *src, size_t size,
+	       const struct dma_bulk_settings *settings)
+{
+	if (!size)
+		return 0;
+	if (!settings)
+		settings = class_settings(size);
+	uintptr_t from = virtual_to_bus((volatile void *)src);
+	uintptr_t to = virtual_to_bus(dest);
+	// Wide beats need both ends aligned to them.
+	int wide = settings->wide && !((from | to) & 15);
+	return run(channel, cbs, settings_ti(settings, wide) | TI_SRC_INC,
+		   from, to, size);
+}
+
+int dma_memset(int channel, volatile struct control_block *cbs,
+	       volatile void *dest, uint8_t value, size_t size,
+	       const struct dma_bulk_settings *settings)
+{
+	if (!size)
+		return 0;
+	if (!settings)
+		settings = class_settings(size);
+	uintptr_t to = virtual_to_bus(dest);
+	uint32_t ti = settings_ti(settings, settings->wide && !(to & 15));
+	uintptr_t from = 0;
+	if (value)
+	{
+		// Read the same 16 bytes of the pattern over and over.
+		volatile uint8_t *pattern = (volatile uint8_t *)
+			(cbs + dma_bulk_cbs(channel, size) - 1);
+		memset((void *)pattern, value, 16);
+		from = virtual_to_bus(pattern);
+	}
+	else
+	{
+		// Zeroes need no reads at all.
+		ti |= TI_SRC_IGNORE;
+	}
+	return run(channel, cbs, ti, from, to, size);
+}
+
+size_t dma_user_cbs(int channel, const dma_pinned_t *pinned)
+{
+	// A block for each run of contiguous pages, and one more each
+	// time a run is split at the channel's limit.
+	return pinned->count + pinned->size / max_len(channel);
+}
+
+int dma_memcpy_user(int channel, volatile struct control_block *cbs,
+		    const dma_pinned_t *pinned, size_t off,
+		    volatile void *p, size_t size, int to_user,
+		    const struct dma_bulk_settings *settings)
+{
+	if (off > pinned->size || size > pinned->size - off)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (!size)
+		return 0;
+	if (!settings)
+		settings = class_settings(size);
+
+	// 1. Write what the CPU has cached of the buffer back as far as
+	// user space can.
+	char *user = (char *)pinned->addr + off;
+	__builtin___clear_cache(user, user + size);
+
+	// 2. Wide beats need both ends aligned, which then holds at the
+	// start of every page after the first as well.
+	uintptr_t bus = virtual_to_bus(p);
+	int wide = settings->wide && !(((uintptr_t)user | bus) & 15);
+	uint32_t ti = settings_ti(settings, wide) | TI_SRC_INC;
+
+	// 3. A block for each run of pages that are contiguous on the
+	// bus.
+	size_t max = max_len(channel);
+	size_t first = (uintptr_t)pinned->addr / PAGE_SIZE;
+	size_t count = 0;
+	for (size_t done = 0; done < size;)
+	{
+		uintptr_t at = (uintptr_t)user + done;
+		size_t page = at / PAGE_SIZE - first;
+		uintptr_t start = pinned->pages[page] + at % PAGE_SIZE;
+		size_t len = PAGE_SIZE - at % PAGE_SIZE;
+		while (len < size - done && page + 1 < pinned->count &&
+		       pinned->pages[page + 1] == pinned->pages[page] + PAGE_SIZE)
+		{
+			++page;
+			len += PAGE_SIZE;
+		}
+		if (len > size - done)
+			len = size - done;
+		count += to_user? add_blocks(cbs + count, max, ti, bus + done, start, len):
+			add_blocks(cbs + count, max, ti, start, bus + done, len);
+		done += len;
+	}
+
+	int ret = submit(channel, cbs, count);
+	if (to_user)
+		__builtin___clear_cache(user, user + size);
+	return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+struct control_block;
+
+/* How a bulk transfer moves its data. */
+struct dma_bulk_settings
+{
+	int wide;	// read and write 128 bits a beat where aligned
+	int burst;	// beats per burst less one, 0 to 15
+	int waits;	// wait cycles after each write, 0 to 31
+};
+
+/* Transfers of up to dma_bulk_class_sizes[i] bytes, and above the
+ * one before, use dma_bulk_settings[i] unless told otherwise.
+ * dmabench times every setting for each class and prints the fastest
+ * on a board to be pasted into bulk.c. */
+#define DMA_BULK_CLASSES 4
+extern const size_t dma_bulk_class_sizes[DMA_BULK_CLASSES];
+extern struct dma_bulk_settings dma_bulk_settings[DMA_BULK_CLASSES];
+
+/* How many control blocks a transfer of size bytes on channel needs,
+ * counted as for dma_add_channels(). */
+size_t dma_bulk_cbs(int channel, size_t size);
+
+/* Copy size bytes from src to dest, or fill them with value, on
+ * channel and wait for it, using the blocks at cbs, of which there
+ * must be dma_bulk_cbs(). Both ends are in the DMA memory. With
+ * settings NULL those of the size class are used. Return 0, or -1
+ * with errno set, ETIMEDOUT if the transfer did not finish within
+ * dma_wait_options.timeout_ms and EIO if the channel failed. */
+int dma_memcpy(int channel, volatile struct control_block *cbs,
+	       volatile void *dest, const volatile void *src, size_t size,
+	       const struct dma_bulk_settings *settings);
+int dma_memset(int channel, volatile struct control_block *cbs,
+	       volatile void *dest, uint8_t value, size_t size,
+	       const struct dma_bulk_settings *settings);
+
+/* How many control blocks a transfer to or from pinned on channel
+ * needs at most, whatever part of it is moved. */
+size_t dma_user_cbs(int channel, const dma_pinned_t *pinned);
+
+/* Copy size bytes between the pinned buffer, from off into it, and p
+ * in the DMA memory: into the buffer if to_user, out of it otherwise,
+ * with no copy through the DMA memory in between. Return as
+ * dma_memcpy(), or -1 with errno EINVAL if the bytes run past the end
+ * of the buffer.
+ *
+ * The DMA does not see the CPU's caches and user space can only clean
+ * them as far as the point of unification, not invalidate them. So the
+ * CPU's latest writes to the buffer may not all have reached the SDRAM
+ * yet when the DMA reads it, and it may read stale lines after the DMA
+ * writes it: the buffer suits data the CPU hands over in bulk, that has
+ * long left its caches. */
+int dma_memcpy_user(int channel, volatile struct control_block *cbs,
+		    const dma_pinned_t *pinned, size_t off,
+		    volatile void *p, size_t size, int to_user,
+		    const struct dma_bulk_settings *settings);
+
+#endif
@@ -1,30 +1,104 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include "common.h"
 #include "dma.h"
 #include "uart.h"
+#include "mbox.h"
 #include "mem.h"
 
-#define SDRAM_BASE 0x3b000000
 #define DEBUG 0
 
+#define MAX_LANES 15
+
 static int dma_channel = -1;
+static int tx_dma_channel = -1;
+static int rx_dma_channel = -1;
 struct dma_registers *dma;
+struct dma_registers *tx_dma;
+struct dma_registers *rx_dma;
+uint32_t tx_dma_registers;
+uint32_t rx_dma_registers;
+struct dma_wait_options dma_wait_options = { DMA_WAIT_BACKOFF, 0, "/dev/uio0" };
+struct dma_wait_stats dma_wait_stats;
 struct gpio_registers *gpio;
 struct uart0_registers *uart0;
-void *physical_memory;
+size_t dma_memory_size = MEMORY_SIZE;
+struct dma_memory dma_memory;
+int dma_full_channels = 2;
+static struct dma_memory *allocations;	// of dma_alloc(), dma_memory too
 
-static void cleanup_dma(void)
+/* A channel jobs run on, each with its own queue. The first is the
+ * one setup() reserves, which drives the tx and rx channels; the
+ * others are added by dma_add_channels(). */
+struct lane
 {
-	if (dma_channel != -1)
+	int channel;
+	struct dma_registers *dma;
+	dma_job_t *head;	// the job running, if any
+	dma_job_t *tail;
+};
+
+static struct lane lanes[MAX_LANES];
+static int lane_count;
+
+/* Stops the channels whose registers are still mapped, so nothing is
+ * left running once the process has gone. It only writes registers,
+ * so a signal handler may call it. */
+static void stop_channels(void)
+{
+	for (int i = 0; i < lane_count; ++i)
 	{
-		if (unreserve_dma_channel(dma_channel))
-			perror("failed to unreserve DMA channel");
+		if (lanes[i].dma)
+			lanes[i].dma->cs = CS_RESET;
 	}
+	if (tx_dma)
+		tx_dma->cs = CS_RESET;
+	if (rx_dma)
+		rx_dma->cs = CS_RESET;
+}
+
+/* Gives the firmware back the memory it gave that has not been freed,
+ * once the channels have stopped, which the process exiting would
+ * not. It only makes system calls, so a signal handler may call it. */
+static void release_memory(void)
+{
+	for (struct dma_memory *memory = allocations; memory; memory = memory->next)
+	{
+		if (memory->handle)
+		{
+			mbox_unlock(memory->handle);
+			mbox_release(memory->handle);
+			memory->handle = 0;
+		}
+	}
+}
+
+static void cleanup_dma(void)
+{
+	int channels[2 + MAX_LANES];
+	int count = 0;
+	stop_channels();
+	if (dma_channel != -1)
+		channels[count++] = dma_channel;
+	if (tx_dma_channel != -1)
+		channels[count++] = tx_dma_channel;
+	if (rx_dma_channel != -1)
+		channels[count++] = rx_dma_channel;
+	for (int i = 1; i < lane_count; ++i)
+		channels[count++] = lanes[i].channel;
+	if (count && unreserve_dma_channels(count, channels))
+		perror("failed to unreserve DMA channel");
+	release_memory();
 }
 
 static void handler(int sig)
@@ -32,6 +106,16 @@ static void handler(int sig)
 	exit(1);
 }
 
+/* A crash stops the channels and leaves them reserved, for the next
+ * process to reserve channels to take back. */
+static void crash_handler(int sig)
+{
+	stop_channels();
+	release_memory();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
 void setup(void)
 {
 	if (open_dev_mem())
@@ -58,46 +142,80 @@ void setup(void)
 		exit(1);
 	}    
     
-	dma_channel = reserve_dma_channel();
+	// Reserve the channels in one go, so that processes starting
+	// together each take the lock just once. The tx channel's drain
+	// does without the 2D mode, so only the others need be full.
+	int channels[3];
+	int reserved = reserve_dma_channels(3, dma_full_channels, channels);
 
-	if (dma_channel == -1)
+	if (reserved != 3)
 	{
-		if (errno)
-			perror("reserve dma channel");
+		if (reserved == -1)
+			perror("reserve dma channels");
 		else
+		{
+			unreserve_dma_channels(reserved, channels);
 			fputs("out of DMA channels\n", stderr);
+		}
 		exit(1);
 	}
 
+	dma_channel = channels[0];
+	rx_dma_channel = channels[1];
+	tx_dma_channel = channels[2];
 	atexit(cleanup_dma);
 	signal(SIGINT, handler);
 	signal(SIGQUIT, handler);
+	signal(SIGTERM, handler);
+	signal(SIGHUP, handler);
+	signal(SIGSEGV, crash_handler);
+	signal(SIGBUS, crash_handler);
+	signal(SIGILL, crash_handler);
+	signal(SIGFPE, crash_handler);
+	signal(SIGABRT, crash_handler);
     
 	gpio = get_gpio();
 	uart0 = get_uart0();
 	init_uart(gpio, uart0);
 	dma = get_dma_channel(dma_channel);
-	physical_memory = sdram_map(SDRAM_BASE, MEMORY_SIZE);
+	lanes[0].channel = dma_channel;
+	lanes[0].dma = dma;
+	lane_count = 1;
+	tx_dma = get_dma_channel(tx_dma_channel);
+	tx_dma_registers = get_dma_channel_bus_address(tx_dma_channel);
+	rx_dma = get_dma_channel(rx_dma_channel);
+	rx_dma_registers = get_dma_channel_bus_address(rx_dma_channel);
 
-	if (physical_memory == MAP_FAILED)
+	// The firmware's memory if it can be had, otherwise the
+	// carve-out. /dev/mem and the mailbox stay open for dma_alloc()
+	// and dma_free().
+	open_mbox();
+	if (dma_alloc(&dma_memory, dma_memory_size))
 	{
-		perror("sdram_map");
+		perror("dma_alloc");
 		exit(1);
 	}
 
-	if (close_dev_mem())
+	// The pages of pinned buffers can only be looked up, and more
+	// than a little locked, with root's privileges.
+	if (open_pagemap())
 	{
-		perror("close /dev/mem");
+		perror("open pagemap");
 		exit(1);
 	}
+	struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+	setrlimit(RLIMIT_MEMLOCK, &unlimited);
 	seteuid(getuid());
 }
 
 void cleanup(void)
 {
-	if (sdram_unmap(physical_memory, MEMORY_SIZE))
+	// Nothing may still be writing to the memory once it is given
+	// back.
+	stop_channels();
+	if (dma_free(&dma_memory))
 	{
-		perror("sdram_unmap");
+		perror("dma_free");
 		exit(1);
 	}
 
@@ -119,8 +237,29 @@ void cleanup(void)
 		exit(1);
 	}
 
-	physical_memory = NULL;
+	if (close_pagemap())
+	{
+		perror("close pagemap");
+		exit(1);
+	}
+
+	if (close_mbox())
+	{
+		perror("close mailbox");
+		exit(1);
+	}
+
+	if (close_dev_mem())
+	{
+		perror("close /dev/mem");
+		exit(1);
+	}
+
 	dma = NULL;
+	for (int i = 0; i < lane_count; ++i)
+		lanes[i].dma = NULL;
+	tx_dma = NULL;
+	rx_dma = NULL;
 	gpio = NULL;
 	uart0 = NULL;
 }
@@ -137,119 +276,660 @@ void print_control_block(volatile struct control_block *cb)
 	       cb->stride, cb->nextconbk);
 }
 
-static void reset_dma(void)
+static void add_ns(struct timespec *t, long long ns)
+{
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec = ns % 1000000000;
+}
+
+static double seconds_between(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the CLOCK_MONOTONIC time timeout_ms from now in deadline,
+ * or 0 if there is no timeout. */
+static int get_deadline(struct timespec *deadline, unsigned long timeout_ms)
+{
+	if (!timeout_ms)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	add_ns(deadline, timeout_ms * 1000000LL);
+	return 1;
+}
+
+/* Returns the milliseconds left until deadline, rounded up, or -1 if
+ * there is none. */
+static int remaining_ms(const struct timespec *deadline)
+{
+	if (!deadline)
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double left = seconds_between(&now, deadline);
+	return left <= 0? 0 : (int)(left * 1000) + 1;
+}
+
+static int past(const struct timespec *deadline)
+{
+	return remaining_ms(deadline) == 0;
+}
+
+/* Spins until channel is idle, checking the deadline every so
+ * often. */
+static int wait_spin(struct dma_registers *channel, const struct timespec *deadline)
+{
+	for (unsigned long polls = 1; ; ++polls)
+	{
+		dma_wait_stats.polls += 1;
+		if (!(channel->cs & CS_ACTIVE))
+			return 0;
+		if (polls % 4096 == 0 && past(deadline))
+			return -1;
+	}
+}
+
+/* Polls channel a few times back to back, then yields, then sleeps
+ * for twice as long after each poll up to MAX_BACKOFF_NS. A chain
+ * that runs for hours costs a poll every few milliseconds. */
+#define SPIN_POLLS 64
+#define YIELD_POLLS 16
+#define MIN_BACKOFF_NS 1000
+#define MAX_BACKOFF_NS 4000000
+static int wait_backoff(struct dma_registers *channel, const struct timespec *deadline)
+{
+	long sleep_ns = MIN_BACKOFF_NS;
+	for (unsigned long polls = 1; ; ++polls)
+	{
+		dma_wait_stats.polls += 1;
+		if (!(channel->cs & CS_ACTIVE))
+			return 0;
+		if (past(deadline))
+			return -1;
+		if (polls < SPIN_POLLS)
+			continue;
+		if (polls < SPIN_POLLS + YIELD_POLLS)
+		{
+			sched_yield();
+			continue;
+		}
+		struct timespec pause = { 0, sleep_ns };
+		nanosleep(&pause, NULL);
+		dma_wait_stats.sleeps += 1;
+		if (sleep_ns < MAX_BACKOFF_NS)
+			sleep_ns *= 2;
+	}
+}
+
+/* Blocks on the channel's interrupt through a UIO device bound to its
+ * IRQ: reading the device returns the interrupt count and writing 1
+ * unmasks the IRQ again. The chain must end with a TI_INTEN control
+ * block. Without the device this falls back to backing off. */
+static int wait_interrupt(struct dma_registers *channel, const struct timespec *deadline)
+{
+	int fd = open(dma_wait_options.uio_device, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+	{
+		perror(dma_wait_options.uio_device);
+		return wait_backoff(channel, deadline);
+	}
+	int ret = 0;
+	for (;;)
+	{
+		dma_wait_stats.polls += 1;
+		if (!(channel->cs & CS_ACTIVE))
+			break;
+		uint32_t unmask = 1;
+		if (write(fd, &unmask, sizeof unmask) != sizeof unmask)
+		{
+			perror(dma_wait_options.uio_device);
+			ret = wait_backoff(channel, deadline);
+			break;
+		}
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int n = poll(&pfd, 1, remaining_ms(deadline));
+		if (n == 0)
+		{
+			ret = -1;
+			break;
+		}
+		uint32_t count;
+		if (n > 0 && read(fd, &count, sizeof count) == sizeof count)
+			dma_wait_stats.interrupts += 1;
+	}
+	// Acknowledge the interrupt.
+	if (!(channel->cs & CS_ACTIVE))
+		channel->cs = CS_INT;
+	close(fd);
+	return ret;
+}
+
+/* Waits for channel to go idle the way dma_wait_options say, or until
+ * deadline if it is not NULL. Returns -1 with errno set to ETIMEDOUT
+ * if the deadline passes first. */
+static int wait_dma(struct dma_registers *channel, enum dma_wait_mode mode,
+		    const struct timespec *deadline)
+{
+	struct timespec start, end, cpu_start, cpu_end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+	int ret;
+	switch (mode)
+	{
+	case DMA_WAIT_SPIN:
+		ret = wait_spin(channel, deadline);
+		break;
+	case DMA_WAIT_INTERRUPT:
+		ret = wait_interrupt(channel, deadline);
+		break;
+	default:
+		ret = wait_backoff(channel, deadline);
+		break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+	dma_wait_stats.seconds += seconds_between(&start, &end);
+	dma_wait_stats.cpu_seconds += seconds_between(&cpu_start, &cpu_end);
+	if (ret)
+		errno = ETIMEDOUT;
+	return ret;
+}
+
+/* Resets the channel of lane, and the tx and rx channels with the
+ * first. A reset takes effect at once, so this waits at most a
+ * second. */
+static int reset_lane(struct lane *lane)
 {
 	#if DEBUG
 	puts("Resetting the DMA");
 	#endif
 	// Reset the DMA
-	dma->cs = CS_RESET;
+	lane->dma->cs = CS_RESET;
+	if (lane == lanes)
+	{
+		tx_dma->cs = CS_RESET;
+		rx_dma->cs = CS_RESET;
+	}
 
 	#if DEBUG
 	puts("Waiting for the DMA to reset");
 	#endif
 	// Wait for the DMA to complete
-	while (dma->cs & CS_ACTIVE)
-		;
+	struct timespec deadline;
+	get_deadline(&deadline, 1000);
+	if (wait_dma(lane->dma, DMA_WAIT_SPIN, &deadline))
+		return -1;
+	if (lane == lanes &&
+	    (wait_dma(tx_dma, DMA_WAIT_SPIN, &deadline) ||
+	     wait_dma(rx_dma, DMA_WAIT_SPIN, &deadline)))
+		return -1;
 
 	//print_dma_regs(dma);
+	return 0;
 }
 
-void run_dma(volatile struct control_block *cb)
+static int reset_dma(void)
 {
-	reset_dma();
+	return reset_lane(lanes);
+}
+
+int dma_add_channels(int count, int full)
+{
+	int channels[MAX_LANES];
+	if (count > MAX_LANES - lane_count)
+		count = MAX_LANES - lane_count;
+	int reserved = count > 0? reserve_dma_channels(count, full, channels):0;
+	for (int i = 0; i < reserved; ++i)
+	{
+		struct lane *lane = &lanes[lane_count++];
+		lane->channel = channels[i];
+		lane->dma = get_dma_channel(channels[i]);
+	}
+	return lane_count;
+}
+
+struct dma_job
+{
+	volatile struct control_block *cb;
+	struct lane *lane;
+	struct dma_job_status status;
+	struct timespec start;
+	dma_job_t *next;
+};
+
+static void start_job(dma_job_t *job)
+{
+	struct lane *lane = job->lane;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	if (reset_lane(lane))
+	{
+		// Leave it to the caller to give up on the job.
+		perror("reset DMA");
+	}
 	#if DEBUG
 	puts("Starting the DMA");
 	#endif
-	dma->conblk_ad = virtual_to_bus(cb);
-	dma->cs = DMA_CS_PANIC_PRIORITY(7) | DMA_CS_PRIORITY(7) | CS_DISDEBUG | CS_ACTIVE;
+	job->status.state = DMA_JOB_RUNNING;
+	lane->dma->conblk_ad = virtual_to_bus(job->cb);
+	lane->dma->cs = DMA_CS_PANIC_PRIORITY(7) | DMA_CS_PRIORITY(7) | CS_DISDEBUG | CS_ACTIVE;
+}
+
+/* Ends the job running on lane in state and starts the next. */
+static void end_job(struct lane *lane, enum dma_job_state state)
+{
+	dma_job_t *job = lane->head;
+	int first = lane == lanes;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	job->status.seconds = seconds_between(&job->start, &end);
+	job->status.cs = lane->dma->cs;
+	job->status.debug = lane->dma->debug;
+	if (state == DMA_JOB_DONE &&
+	    (job->status.cs & CS_ERROR || (first && tx_dma->cs & CS_ERROR)))
+		state = DMA_JOB_FAILED;
+	job->status.state = state;
+
+	// The receive chain loops for as long as it is left running,
+	// and after a cancel so may the others.
+	if (state == DMA_JOB_CANCELLED)
+	{
+		lane->dma->cs = CS_RESET;
+		if (first)
+			tx_dma->cs = CS_RESET;
+	}
+	if (first)
+		rx_dma->cs = CS_RESET;
+
+	// Clear the END flag. I don't know if this is needed or not.
+	lane->dma->cs = CS_END;
+	if (first)
+		tx_dma->cs = CS_END;
+
+	lane->head = job->next;
+	if (!lane->head)
+		lane->tail = NULL;
+	job->next = NULL;
+	if (lane->head)
+		start_job(lane->head);
+}
+
+/* Whether the chain on lane is still running, or on the first lane
+ * the tx channel is still draining. */
+static int lane_busy(const struct lane *lane)
+{
+	uint32_t cs = lane->dma->cs;
+	if (lane == lanes)
+		cs |= tx_dma->cs;
+	return cs & CS_ACTIVE;
+}
+
+/* Ends the running jobs whose chains have ended. */
+static void update_jobs(void)
+{
+	for (int i = 0; i < lane_count; ++i)
+	{
+		if (lanes[i].head && !lane_busy(&lanes[i]))
+			end_job(&lanes[i], DMA_JOB_DONE);
+	}
+}
+
+static int finished(const dma_job_t *job)
+{
+	return job->status.state >= DMA_JOB_DONE;
+}
+
+static void get_status(const dma_job_t *job, struct dma_job_status *status)
+{
+	if (!status)
+		return;
+	*status = job->status;
+	if (job->status.state == DMA_JOB_RUNNING)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		status->seconds = seconds_between(&job->start, &now);
+		status->cs = job->lane->dma->cs;
+		status->debug = job->lane->dma->debug;
+	}
+}
+
+dma_job_t *dma_submit_on(int channel, volatile struct control_block *cb)
+{
+	if (channel < 0 || channel >= lane_count)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	dma_job_t *job = calloc(1, sizeof *job);
+	if (!job)
+		return NULL;
+	struct lane *lane = &lanes[channel];
+	job->cb = cb;
+	job->lane = lane;
+	job->status.state = DMA_JOB_QUEUED;
+	update_jobs();
+	if (lane->tail)
+		lane->tail->next = job;
+	else
+		lane->head = job;
+	lane->tail = job;
+	if (lane->head == job)
+		start_job(job);
+	return job;
+}
+
+dma_job_t *dma_submit(volatile struct control_block *cb)
+{
+	return dma_submit_on(0, cb);
+}
+
+int dma_poll(dma_job_t *job, struct dma_job_status *status)
+{
+	update_jobs();
+	get_status(job, status);
+	return finished(job);
+}
+
+int dma_wait(dma_job_t *job, unsigned long timeout_ms, struct dma_job_status *status)
+{
+	struct timespec deadline;
+	const struct timespec *until = get_deadline(&deadline, timeout_ms)? &deadline : NULL;
+	struct lane *lane = job->lane;
+	enum dma_wait_mode mode = dma_wait_options.mode;
+	int ret = 0;
+
+	// Only the first channel's interrupt is wired to the UIO
+	// device.
+	if (lane != lanes && mode == DMA_WAIT_INTERRUPT)
+		mode = DMA_WAIT_BACKOFF;
+
 	#if DEBUG
 	puts("Waiting for the DMA to complete");
 	#endif
-	//print_dma_regs(dma);
-	// Wait for the DMA to complete
-	while (dma->cs & CS_ACTIVE)
-		;
-	
-	// Clear the END flag. I don't know if this is needed or not.
-	dma->cs = CS_END;
+	// Wait for the jobs up to this one in turn. The chain may have
+	// left a transfer queued on the tx channel, which does not
+	// interrupt.
+	update_jobs();
+	while (!finished(job) && !ret)
+	{
+		ret = wait_dma(lane->dma, mode, until);
+		if (!ret && lane == lanes)
+			ret = wait_dma(tx_dma, mode == DMA_WAIT_INTERRUPT? DMA_WAIT_BACKOFF:mode, until);
+		update_jobs();
+	}
+	get_status(job, status);
+	if (!finished(job))
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
 }
 
-void trace_dma(volatile struct control_block *cb)
+void dma_cancel(dma_job_t *job)
 {
-	reset_dma();
-	while (1)
+	struct lane *lane = job->lane;
+	if (job == lane->head && job->status.state == DMA_JOB_RUNNING)
+	{
+		end_job(lane, DMA_JOB_CANCELLED);
+		return;
+	}
+	for (dma_job_t **p = &lane->head, *prev = NULL; *p; prev = *p, p = &(*p)->next)
 	{
-		unsigned bus_addr = virtual_to_bus(cb);
-		unsigned src = cb->source_ad;
-		unsigned next = cb->nextconbk;
-		unsigned len = cb->txfr_len;
-		if (src >= BUS_ADDRESS)
+		if (*p == job)
 		{
-			switch (len)
-			{
-			case 1:
-				printf("%8x: src=%8x  dest=%8x  %02x        next=%8x\n",
-				       bus_addr, src, cb->dest_ad, *(volatile uint8_t *)bus_to_virtual(src), next);
-				break;
-			case 4:
-				printf("%8x: src=%8x  dest=%8x  %08x  next=%8x\n",
-				       bus_addr, src, cb->dest_ad, *(volatile uint32_t *)bus_to_virtual(src), next);
-				break;
-			default:
-				printf("%8x: src=%8x  dest=%8x  len=%d     next=%8x\n",
-				       bus_addr, src, cb->dest_ad, len, next);
-			}
+			*p = job->next;
+			if (lane->tail == job)
+				lane->tail = prev;
+			job->next = NULL;
+			job->status.state = DMA_JOB_CANCELLED;
+			return;
 		}
-		else
+	}
+}
+
+void dma_release(dma_job_t *job)
+{
+	if (!job)
+		return;
+	update_jobs();
+	if (!finished(job))
+		dma_cancel(job);
+	free(job);
+}
+
+double dma_time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int dma_lite(int channel)
+{
+	if (channel < 0 || channel >= lane_count)
+		return 0;
+	return !!(lanes[channel].dma->debug & DEBUG_LITE);
+}
+
+/* The channels cannot count the accesses they make. */
+int dma_profile(int on)
+{
+	if (!on)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+}
+
+uint64_t dma_profile_count(uintptr_t addr, size_t size)
+{
+	return 0;
+}
+
+/* At the end of the list, so that an allocation comes before any
+ * buffer standing in for it. */
+void dma_track(struct dma_memory *memory)
+{
+	struct dma_memory **link = &allocations;
+	while (*link)
+		link = &(*link)->next;
+	memory->next = NULL;
+	*link = memory;
+}
+
+int dma_untrack(struct dma_memory *memory)
+{
+	struct dma_memory **link = &allocations;
+	while (*link && *link != memory)
+		link = &(*link)->next;
+	if (!*link)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	*link = memory->next;
+	return 0;
+}
+
+int dma_alloc(struct dma_memory *memory, size_t size)
+{
+	if (sdram_alloc(memory, size))
+		return -1;
+	dma_track(memory);
+	return 0;
+}
+
+int dma_free(struct dma_memory *memory)
+{
+	if (dma_untrack(memory))
+		return -1;
+	return sdram_free(memory);
+}
+
+const struct dma_memory *dma_memory_of(volatile void *p)
+{
+	for (const struct dma_memory *memory = allocations; memory; memory = memory->next)
+	{
+		if ((uintptr_t)((const volatile char *)p - (char *)memory->virt) < memory->size)
+			return memory;
+	}
+	return NULL;
+}
+
+const struct dma_memory *dma_memory_at(uintptr_t addr)
+{
+	for (const struct dma_memory *memory = allocations; memory; memory = memory->next)
+	{
+		if (addr - memory->bus < memory->size)
+			return memory;
+	}
+	return NULL;
+}
+
+int dma_pin(dma_pinned_t *pinned, void *p, size_t size)
+{
+	uintptr_t first = (uintptr_t)p / PAGE_SIZE;
+	size_t count = size? ((uintptr_t)p + size - 1) / PAGE_SIZE - first + 1:0;
+	uint32_t *pages = malloc((count? count:1) * sizeof *pages);
+	if (!pages)
+		return -1;
+
+	// 1. Fault the pages in and keep them where they are.
+	if (mlock(p, size))
+	{
+		free(pages);
+		return -1;
+	}
+
+	// 2. Find where they are.
+	if (user_pages_to_bus(p, count, pages))
+	{
+		int error = errno;
+		munlock(p, size);
+		free(pages);
+		errno = error;
+		return -1;
+	}
+
+	pinned->addr = p;
+	pinned->size = size;
+	pinned->count = count;
+	pinned->pages = pages;
+	return 0;
+}
+
+int dma_unpin(dma_pinned_t *pinned)
+{
+	int ret = munlock(pinned->addr, pinned->size);
+	free(pinned->pages);
+	pinned->pages = NULL;
+	pinned->count = 0;
+	return ret;
+}
+
+int run_dma(volatile struct control_block *cb)
+{
+	memset(&dma_wait_stats, 0, sizeof dma_wait_stats);
+	dma_job_t *job = dma_submit(cb);
+	if (!job)
+		return -1;
+	int ret = dma_wait(job, dma_wait_options.timeout_ms, NULL);
+	dma_release(job);
+	if (ret)
+		errno = ETIMEDOUT;
+	return ret;
+}
+
+/* The first bytes at the bus address addr, as far as they are in the
+ * DMA memory, read one at a time since the uncached mapping takes no
+ * unaligned loads. */
+static uint32_t first_word(uint32_t addr)
+{
+	uint32_t word = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		volatile uint8_t *p = bus_to_virtual(addr + i);
+		if (!p)
+			break;
+		word |= (uint32_t)*p << (8 * i);
+	}
+	return word;
+}
+
+int trace_dma(volatile struct control_block *cb, dma_trace_t *trace)
+{
+	memset(&dma_wait_stats, 0, sizeof dma_wait_stats);
+	if (reset_dma())
+		return -1;
+	struct timespec until;
+	const struct timespec *deadline =
+		get_deadline(&until, dma_wait_options.timeout_ms)? &until:NULL;
+	uint32_t run = DMA_CS_PANIC_PRIORITY(7) | DMA_CS_PRIORITY(7) | CS_DISDEBUG;
+	trace->sampled = 1;
+	dma->conblk_ad = virtual_to_bus(cb);
+	dma->cs = run | CS_ACTIVE;
+
+	int ret = 0;
+	for (unsigned long polls = 1; ; ++polls)
+	{
+		// 1. Pause the channel. It stops after the beat it is on, or
+		// is held already by its DREQ, at the end of the chain or on
+		// an error. The deadline is checked as it is waited for.
+		dma->cs = run;
+		uint32_t cs;
+		unsigned long spins = 1;
+		while (!((cs = dma->cs) & (CS_PAUSED | CS_DREQ_STOPS_DMA | CS_END | CS_ERROR)))
 		{
-			// Break if src < BUS_ADDRESS unless src is UART0 FR/DR addr.
-			if(src == 0x7e201000 || src == 0x7e201018)
-			{
-                        	switch (len)
-                        	{
-                        	case 1:
-                                	printf("%8x: src=%8x  dest=%8x  %02x        next=%8x\n",
-                                       		bus_addr, src, cb->dest_ad, src, next);
-                                	break;
-                        	case 4:
-                                	printf("%8x: src=%8x  dest=%8x  %08x  next=%8x\n",
-                                       		bus_addr, src, cb->dest_ad, src, next);
-                                	break;
-                        	default:
-                                	printf("%8x: src=%8x  dest=%8x  len=%d     next=%8x\n",
-                                       		bus_addr, src, cb->dest_ad, len, next);
-                        	}
-			} 
-			else 
-			{ 
-				printf("%8x: src=%8x  dest=%8x  len=%d     next=%8x\n",
-			       		bus_addr, src, cb->dest_ad, len, next);
-				printf("src (%08x) < BUS_ADDRESS\n", src);
+			if (spins++ % 4096 == 0 && past(deadline))
 				break;
-			}
 		}
-		cb->nextconbk = 0;
-		dma->conblk_ad = bus_addr;
-		dma->cs = DMA_CS_PANIC_PRIORITY(7) | DMA_CS_PRIORITY(7) | CS_DISDEBUG | CS_ACTIVE;
-		while (dma->cs & CS_ACTIVE)
-			;
-		dma->cs = CS_END;
-		cb->nextconbk = next;
-		if (!next)
+		if (!(cs & (CS_PAUSED | CS_DREQ_STOPS_DMA | CS_END | CS_ERROR)))
+		{
+			errno = ETIMEDOUT;
+			ret = -1;
+			break;
+		}
+
+		// 2. Record the block it holds, as far as it has got.
+		uint32_t addr = dma->conblk_ad;
+		if (!addr || cs & CS_ERROR)
 			break;
-		if (next < BUS_ADDRESS)
+		uint32_t src = dma->source_ad;
+		struct dma_trace_record record =
 		{
-			// Break if next < BUS_ADDRESS unless next is UART0 FR/DR addr.
-			if(next != 0x7e201000)
-			{
-				if(next != 0x7e201018)
-				{
-					puts("next < BUS_ADDRESS");
-					break;
-				}
-			}
+			addr, src, dma->dest_ad, dma->txfr_len, first_word(src),
+		};
+
+		// 3. Let it go on while the record is stored, and the ring
+		// written out if that fills it.
+		dma->cs = run | CS_ACTIVE;
+		dma_trace_add(trace, &record);
+		dma_wait_stats.polls += 1;
+		if (polls % 4096 == 0 && past(deadline))
+		{
+			errno = ETIMEDOUT;
+			ret = -1;
+			break;
 		}
-		cb = bus_to_virtual(next);
 	}
+
+	// The tx channel drains the output that is left, and the receive
+	// chain loops for as long as it is left running.
+	if (!ret && dma->cs & CS_ERROR)
+	{
+		fprintf(stderr, "The DMA failed (CS %08x, DEBUG %08x)\n",
+			(unsigned)dma->cs, (unsigned)dma->debug);
+		errno = EIO;
+		ret = -1;
+	}
+	if (ret)
+		dma->cs = CS_RESET;
+	else if (wait_dma(tx_dma, DMA_WAIT_SPIN, deadline))
+		ret = -1;
+	rx_dma->cs = CS_RESET;
+	dma->cs = CS_END;
+	return ret;
 }
@@ -1,31 +1,201 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "mem.h"
+#include "trace.h"
 
-/* 64 MB to play with */
-#define BUS_ADDRESS 0xfb000000
+/* 64 MB to play with unless dma_memory_size says otherwise */
 #define MEMORY_SIZE 0x04000000
 
 struct control_block;
-extern void *physical_memory;
+
+/* The DMA memory setup() gets, of dma_memory_size bytes, which may be
+ * changed before it. */
+extern size_t dma_memory_size;
+extern struct dma_memory dma_memory;
+
+/* How many of the first, rx and tx channels setup() reserves, in that
+ * order, must be full ones, whose control blocks may use the 2D mode.
+ * 2 unless changed before setup(), as bf's gadgets and receive chain
+ * use it. */
+extern int dma_full_channels;
+
+/* How run_dma() waits for the chain to finish. */
+enum dma_wait_mode
+{
+	DMA_WAIT_SPIN,		// poll CS back to back
+	DMA_WAIT_BACKOFF,	// poll less and less often, sleeping in between
+	DMA_WAIT_INTERRUPT,	// block on the channel's IRQ through a UIO device
+};
+
+struct dma_wait_options
+{
+	enum dma_wait_mode mode;
+	unsigned long timeout_ms;	// 0 waits for ever
+	const char *uio_device;		// for DMA_WAIT_INTERRUPT
+};
+
+/* What the waits of the most recent run_dma() cost. */
+struct dma_wait_stats
+{
+	double seconds;		// wall clock time spent waiting
+	double cpu_seconds;	// CPU time spent waiting
+	unsigned long polls;	// reads of CS
+	unsigned long sleeps;
+	unsigned long interrupts;
+};
+
+extern struct dma_wait_options dma_wait_options;
+extern struct dma_wait_stats dma_wait_stats;
+
+/* Bus addresses of the registers of two more channels reserved by
+ * setup(). A chain may start them by writing their CONBLK_AD and CS.
+ * run_dma() does not return until the tx channel has gone idle, and
+ * stops the rx channel, whose chain need not end, once it returns. */
+extern uint32_t tx_dma_registers;
+extern uint32_t rx_dma_registers;
+
+/* A chain launched by dma_submit(). Jobs on a channel run one after
+ * another in the order they were submitted; a job is finished once its
+ * chain has ended and, on the first channel, the tx channel has
+ * drained. */
+typedef struct dma_job dma_job_t;
+
+enum dma_job_state
+{
+	DMA_JOB_QUEUED,		// waiting for the jobs before it
+	DMA_JOB_RUNNING,
+	DMA_JOB_DONE,
+	DMA_JOB_FAILED,		// the channel flagged an error
+	DMA_JOB_CANCELLED,
+};
+
+struct dma_job_status
+{
+	enum dma_job_state state;
+	uint32_t cs;		// CS and DEBUG as the job finished
+	uint32_t debug;
+	double seconds;		// since the job started, or how long it ran
+};
 
 extern void setup(void);
 extern void cleanup(void);
-extern void run_dma(volatile struct control_block *cb);
-extern void trace_dma(volatile struct control_block *cb);
+
+/* Reserves up to count more channels, each running jobs of its own
+ * alongside the first, and returns how many there are now. The first
+ * full of them are full channels, as reserve_dma_channels() has them,
+ * for chains using the 2D mode. Only chains on the first channel
+ * (channel 0) may use the tx and rx channels. */
+extern int dma_add_channels(int count, int full);
+
+/* Queues the chain at cb on the first channel and returns its job,
+ * starting it at once if no other job there is unfinished. Returns
+ * NULL if out of memory. */
+extern dma_job_t *dma_submit(volatile struct control_block *cb);
+/* The same on channel, counted from 0 as for dma_add_channels(). */
+extern dma_job_t *dma_submit_on(int channel, volatile struct control_block *cb);
+/* Notes the progress of the jobs without waiting and fills in status
+ * if it is not NULL. Returns 1 if job has finished, otherwise 0. */
+extern int dma_poll(dma_job_t *job, struct dma_job_status *status);
+/* Waits for job as dma_wait_options.mode says, for at most timeout_ms
+ * if that is not 0, and fills in status if it is not NULL. Returns
+ * -1 with errno set to ETIMEDOUT if job is still unfinished. For
+ * DMA_WAIT_INTERRUPT the chain must end with a TI_INTEN control
+ * block. */
+extern int dma_wait(dma_job_t *job, unsigned long timeout_ms,
+		    struct dma_job_status *status);
+/* Stops job if it is running, or takes it off the queue. */
+extern void dma_cancel(dma_job_t *job);
+/* Cancels job if it is unfinished and frees it. */
+extern void dma_release(dma_job_t *job);
+
+/* Seconds on the clock jobs are timed by, from some fixed point. */
+extern double dma_time(void);
+
+/* Whether channel, counted as for dma_add_channels(), is a lite one,
+ * whose control blocks move at most 64 KB and have no 2D mode. */
+extern int dma_lite(int channel);
+
+/* Counts of the SDRAM accesses the DMA makes, where they can be had:
+ * the emulator keeps them, the hardware cannot. dma_profile(1) starts
+ * counting afresh and dma_profile(0) stops; starting returns -1 with
+ * errno ENOSYS where there are no counts. */
+extern int dma_profile(int on);
+/* The accesses to the size bytes at bus address addr since counting
+ * started, control block loads included. */
+extern uint64_t dma_profile_count(uintptr_t addr, size_t size);
+
+/* An ordinary buffer of the process locked in place, with the bus
+ * address of each page it touches, for the DMA to reach without a
+ * copy through the DMA memory. */
+typedef struct
+{
+	void *addr;
+	size_t size;
+	size_t count;		// pages
+	uint32_t *pages;	// bus address of each
+} dma_pinned_t;
+
+/* Locks the size bytes at p into memory and looks up their pages.
+ * Returns -1 with errno set if they cannot be locked or looked up,
+ * ENOSYS on the emulator, which has no bus addresses for the host's
+ * memory. */
+extern int dma_pin(dma_pinned_t *pinned, void *p, size_t size);
+extern int dma_unpin(dma_pinned_t *pinned);
+
+/* Runs the chain at cb and waits for it as dma_wait_options say.
+ * Returns -1 with errno set to ETIMEDOUT, having stopped the channels,
+ * if it has not finished within the timeout. */
+extern int run_dma(volatile struct control_block *cb);
+
+/* Runs the chain at cb as run_dma() does, recording into trace the
+ * control blocks the first channel runs. The emulator records every
+ * one of them. The board has no way to stop a channel between two
+ * blocks, so it lets the chain run at full speed and samples it,
+ * pausing the channel as often as it can to record the block it is
+ * on, and sets trace->sampled. Returns -1 with errno set to ETIMEDOUT
+ * as run_dma() does, or to EIO if the channel stopped on an error. */
+extern int trace_dma(volatile struct control_block *cb, dma_trace_t *trace);
 extern void print_control_block(volatile struct control_block *cb);
 
-/* This is only for virtual addresses pointing to in
- * [physical_memory, physical_memory + MEMORY_SIZE). */
+/* Gets more DMA memory, of size bytes, as sdram_alloc() does on the
+ * board, and keeps it for virtual_to_bus() and bus_to_virtual() to
+ * find. Returns -1 with errno set if there is not the room. */
+extern int dma_alloc(struct dma_memory *memory, size_t size);
+extern int dma_free(struct dma_memory *memory);
+
+/* Has virtual_to_bus() take the bytes at memory->virt, which may be
+ * an ordinary buffer being filled in for the DMA memory at
+ * memory->bus, to be there until dma_untrack(). bus_to_virtual() still
+ * gives the DMA memory. Returns -1 with errno EINVAL if memory was not
+ * tracked. */
+extern void dma_track(struct dma_memory *memory);
+extern int dma_untrack(struct dma_memory *memory);
+
+/* The allocation of dma_alloc() p is in, or the bus address addr
+ * is in, or NULL. */
+extern const struct dma_memory *dma_memory_of(volatile void *p);
+extern const struct dma_memory *dma_memory_at(uintptr_t addr);
+
+/* This is only for virtual addresses pointing into dma_memory or an
+ * allocation of dma_alloc(); the others give 0. */
 static inline uintptr_t virtual_to_bus(volatile void *p)
 {
-	return (void *)p - physical_memory + BUS_ADDRESS;
+	if ((uintptr_t)((const volatile char *)p - (char *)dma_memory.virt) < dma_memory.size)
+		return dma_memory_to_bus(&dma_memory, p);
+	const struct dma_memory *memory = dma_memory_of(p);
+	return memory? dma_memory_to_bus(memory, p):0;
 }
 
+/* The others give NULL. */
 static inline void *bus_to_virtual(uintptr_t addr)
 {
-	return (char *)physical_memory + (addr - BUS_ADDRESS);
+	if (addr - dma_memory.bus < dma_memory.size)
+		return dma_memory_to_virtual(&dma_memory, addr);
+	const struct dma_memory *memory = dma_memory_at(addr);
+	return memory? dma_memory_to_virtual(memory, addr):NULL;
 }
 
 #endif
@@ -1,8 +1,11 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include "dma.h"
 #include "mem.h"
 
@@ -23,27 +26,57 @@ int unmap_dma_registers(void)
 {
 	if (!dma)
 		return 0;
-	return io_unmap((void *)dma, DMA0_14_SIZE);
+	if (io_unmap((void *)dma, DMA0_14_SIZE))
+		return -1;
+	dma = NULL;
+	return 0;
 }
 
+/* The kernel's DMA driver hands out channels through the dmachans
+ * mask, a bit set for each free one, and does no locking of its own.
+ * Every change to it is made holding an exclusive lock on OWNERS_PATH,
+ * which also records the process holding each channel reserved here,
+ * so a channel whose holder died without giving it back can be taken
+ * again, and only its holder may give it back. A process is known by
+ * its PID and its start time, so that another process given the PID
+ * of one that died is not taken for it. */
+#define OWNERS_PATH "/run/lock/dmachans.owners"
+#define CHANNELS 15
+
+struct owner
+{
+	int32_t pid;		// 0 if the channel is not reserved here
+	uint32_t reserved;
+	uint64_t start;		// in clock ticks since boot, 0 if unknown
+};
+
 static int get_dma_channel_fd(void)
 {
 	static int dma_channel_fd = -1;
 	if (dma_channel_fd == -1)
-		dma_channel_fd = open("/sys/module/dma/parameters/dmachans", O_RDWR);
+		dma_channel_fd = open("/sys/module/dma/parameters/dmachans", O_RDWR | O_CLOEXEC);
 	else
 		lseek(dma_channel_fd, 0, SEEK_SET);
 	return dma_channel_fd;
 }
 
-int reserve_dma_channel(void)
+/* The file is opened once, while the process may still be privileged,
+ * and kept open. */
+static int get_owners_fd(void)
+{
+	static int owners_fd = -1;
+	if (owners_fd == -1)
+		owners_fd = open(OWNERS_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	return owners_fd;
+}
+
+static int read_mask(int *mask)
 {
 	int dma_channel_fd = get_dma_channel_fd();
 
 	if (dma_channel_fd == -1)
 		return -1;
-	int channel = -1;
-	char buf[10];
+	char buf[16];
 	ssize_t amount = read(dma_channel_fd, buf, sizeof buf - 1);
 	if (amount <= 0)
 		return -1;
@@ -53,69 +86,205 @@ int reserve_dma_channel(void)
 		return -1;
 	}
 	buf[amount-1] = 0;
-	int mask = atoi(buf);
-	static const char channels[] = {4, 5, 8, 9, 10, 11, 12, 13, 14};
-	for (int i = 0; i < sizeof channels; ++i)
-	{
-		if (mask & (1 << channels[i]))
-		{
-			// Channel is not reserved by the GPU at
-			// least!
-			channel = channels[i];
-			break;
-		}
-	}
-	if (channel == -1)
+	*mask = atoi(buf);
+	return 0;
+}
+
+static int write_mask(int mask)
+{
+	int dma_channel_fd = get_dma_channel_fd();
+
+	if (dma_channel_fd == -1)
 		return -1;
-	// Clear the corresponding bit and write the mask back.
-	mask &= ~(1 << channel);
+	char buf[16];
 	sprintf(buf, "%d\n", mask);
-	lseek(dma_channel_fd, 0, SEEK_SET);
 	size_t len = strlen(buf);
-	amount = write(dma_channel_fd, buf, len);
-
-	if (amount != len)
-		channel = -1;
-	return channel;
+	return write(dma_channel_fd, buf, len) == len? 0:-1;
 }
 
-int unreserve_dma_channel(int channel)
+/* Locks the channels and reads the mask and the owners. Returns the
+ * file descriptor to unlock_channels() with, or -1. */
+static int lock_channels(int *mask, struct owner owners[CHANNELS])
 {
-	if (channel < 0 || channel > 14)
+	int fd = get_owners_fd();
+	if (fd == -1)
 		return -1;
-
-	int dma_channel_fd = get_dma_channel_fd();
-	if (dma_channel_fd == -1)
+	while (flock(fd, LOCK_EX))
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+	memset(owners, 0, CHANNELS * sizeof *owners);
+	if (pread(fd, owners, CHANNELS * sizeof *owners, 0) < 0 || read_mask(mask))
+	{
+		flock(fd, LOCK_UN);
 		return -1;
-	int ret = -1;
-	char buf[10];
-	ssize_t amount = read(dma_channel_fd, buf, sizeof buf - 1);
+	}
+	return fd;
+}
+
+static int unlock_channels(int fd, int mask, const struct owner owners[CHANNELS])
+{
+	int ret = 0;
+	if (write_mask(mask) ||
+	    pwrite(fd, owners, CHANNELS * sizeof *owners, 0) != CHANNELS * sizeof *owners)
+		ret = -1;
+	flock(fd, LOCK_UN);
+	return ret;
+}
+
+/* The time the process pid started, from /proc/PID/stat, or 0 if it
+ * cannot be read. */
+static uint64_t start_time(pid_t pid)
+{
+	char path[32], buf[1024];
+	snprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	ssize_t amount = read(fd, buf, sizeof buf - 1);
+	close(fd);
 	if (amount <= 0)
-		return -1;
-	if (buf[amount-1] != '\n')
+		return 0;
+	buf[amount] = 0;
+
+	// The command name, in parentheses, may hold spaces and
+	// parentheses itself; the start time is the 20th field after it.
+	char *p = strrchr(buf, ')');
+	for (int field = 0; p && field < 20; ++field)
+		p = strchr(p + 1, ' ');
+	return p? strtoull(p + 1, NULL, 10):0;
+}
+
+/* Whether owner is still running. One we may not signal exists too,
+ * unless it started at another time than the one recorded. */
+static int alive(const struct owner *owner)
+{
+	if (kill(owner->pid, 0) && errno != EPERM)
+		return 0;
+	return !owner->start || start_time(owner->pid) == owner->start;
+}
+
+/* This process, as the owners record it. */
+static struct owner self(void)
+{
+	static struct owner me;
+	if (!me.pid || me.pid != getpid())
 	{
-		fputs("This shouldn't happen!\n", stderr);
-		return -1;
+		me.pid = getpid();
+		me.start = start_time(me.pid);
 	}
-	buf[amount-1] = 0;
-	int mask = atoi(buf);
+	return me;
+}
+
+static void reset_channel(int channel)
+{
+	if (dma)
+		((struct dma_registers *)(dma + channel * 0x100))->cs = CS_RESET;
+}
+
+/* The channels that may be reserved, the full ones first. Channels 7
+ * to 14 are lite ones. */
+static const char candidates[] = {4, 5, 8, 9, 10, 11, 12, 13, 14};
+#define FULL_CANDIDATES 2
 
-	if (mask & (1 << channel))
+/* Reserves channel, if it is free or its owner has gone, for this
+ * process. Returns whether it did. */
+static int take_channel(int channel, int *mask, struct owner owners[CHANNELS])
+{
+	if (!(*mask & (1 << channel)))
+	{
+		// Reserved, by the GPU if it has no owner here. Take it
+		// back if its owner has gone, stopping whatever it left
+		// running.
+		if (!owners[channel].pid || alive(&owners[channel]))
+			return 0;
+		reset_channel(channel);
+	}
+	// Clear the corresponding bit.
+	*mask &= ~(1 << channel);
+	owners[channel] = self();
+	return 1;
+}
+
+int reserve_dma_channels(int count, int full, int channels[])
+{
+	struct owner owners[CHANNELS];
+	int mask;
+	int fd = lock_channels(&mask, owners);
+	if (fd == -1)
 		return -1;
 
-	mask |= 1 << channel;
+	// 1. The full channels asked for.
+	int reserved = 0;
+	for (int i = 0; i < FULL_CANDIDATES && reserved < full && reserved < count; ++i)
+	{
+		if (take_channel(candidates[i], &mask, owners))
+			channels[reserved++] = candidates[i];
+	}
 
-	sprintf(buf, "%d\n", mask);
-	lseek(dma_channel_fd, 0, SEEK_SET);
-	size_t len = strlen(buf);
-	amount = write(dma_channel_fd, buf, len);
+	// 2. The others, lite ones first so that the full ones are left
+	// to those that need them.
+	for (int i = 0; i < sizeof candidates && reserved >= full && reserved < count; ++i)
+	{
+		int channel = candidates[(FULL_CANDIDATES + i) % sizeof candidates];
+		if (take_channel(channel, &mask, owners))
+			channels[reserved++] = channel;
+	}
+	if (unlock_channels(fd, mask, owners))
+		return -1;
+	return reserved;
+}
 
-	if (amount == len)
-		ret = 0;
+int reserve_dma_channel(void)
+{
+	int channel;
+	int reserved = reserve_dma_channels(1, 1, &channel);
+	if (reserved == 0)
+		errno = 0;
+	return reserved == 1? channel:-1;
+}
+
+int unreserve_dma_channels(int count, const int channels[])
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (channels[i] < 0 || channels[i] >= CHANNELS)
+			return -1;
+	}
+	struct owner owners[CHANNELS];
+	int mask;
+	int fd = lock_channels(&mask, owners);
+	if (fd == -1)
+		return -1;
 
+	// Only channels this process holds are given back.
+	struct owner me = self();
+	int ret = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		int channel = channels[i];
+		if (mask & (1 << channel) || owners[channel].pid != me.pid ||
+		    owners[channel].start != me.start)
+		{
+			ret = -1;
+			continue;
+		}
+		mask |= 1 << channel;
+		memset(&owners[channel], 0, sizeof owners[channel]);
+	}
+	if (unlock_channels(fd, mask, owners))
+		ret = -1;
+	else if (ret)
+		errno = EPERM;
 	return ret;
 }
 
+int unreserve_dma_channel(int channel)
+{
+	return unreserve_dma_channels(1, &channel);
+}
+
 struct dma_registers *get_dma_channel(int channel)
 {
 	if (!dma || channel < 0 || channel > 14)
@@ -126,3 +295,8 @@ struct dma_registers *get_dma_channel(int channel)
 	*enable |= (1 << channel);
 	return (struct dma_registers *)(dma + channel * 0x100);
 }
+
+uint32_t get_dma_channel_bus_address(int channel)
+{
+	return DMA0_BASE + channel * 0x100;
+}
@@ -18,15 +18,33 @@ struct dma_registers
 {
 	volatile uint32_t cs;		// control and status
 	volatile uint32_t conblk_ad;	// control block address
-	volatile struct control_block cb;// control block
+	volatile uint32_t ti;		// the control block being run
+	volatile uint32_t source_ad;
+	volatile uint32_t dest_ad;
+	volatile uint32_t txfr_len;
+	volatile uint32_t stride;
+	volatile uint32_t nextconbk;
+	volatile uint32_t debug;	// debug and error flags
 };
 
 int map_dma_registers(void);
 int unmap_dma_registers(void);
 
+/* Reserves up to count free channels, and channels left reserved by
+ * processes that have died, into channels. The first full of them are
+ * full channels, and if there are not that many free it reserves no
+ * more; the others are lite ones while any are free, whose control
+ * blocks move at most 64 KB and have no 2D mode. Returns how many, or
+ * -1. */
+int reserve_dma_channels(int count, int full, int channels[]);
+/* Reserves a full channel. */
 int reserve_dma_channel(void);
+/* Gives back channels this process reserved. Returns -1, with errno
+ * EPERM, if one of them was not, and leaves that one be. */
+int unreserve_dma_channels(int count, const int channels[]);
 int unreserve_dma_channel(int channel);
 struct dma_registers *get_dma_channel(int channel);
+uint32_t get_dma_channel_bus_address(int channel);
 
 enum
 {
@@ -48,6 +66,14 @@ enum
 	CS_ACTIVE			= 1 << 0, // RW
 };
 
+enum
+{
+	DEBUG_LITE			= 1 << 28, // RO
+	DEBUG_READ_ERROR		= 1 << 2, // RC
+	DEBUG_FIFO_ERROR		= 1 << 1, // RC
+	DEBUG_READ_LAST_NOT_SET_ERROR	= 1 << 0, // RC
+};
+
 #define DMA_CS_PRIORITY(n) ((n) << CS_PRIORITY_SHIFT)
 #define DMA_CS_PANIC_PRIORITY(n) ((n) << CS_PANIC_PRIORITY_SHIFT)
 
@@ -55,6 +81,7 @@ enum
 {
 	TI_NO_WIDE_BURSTS		= 1 << 26,
 	TI_WAITS_MASK			= 0x1f << 21,
+	TI_PERMAP_SHIFT			= 16,
 	TI_PERMAP_MASK			= 0x1f << 16,
 	TI_BURST_LENGTH_MASK		= 0xf << 12,
 	TI_SRC_IGNORE			= 1 << 11,
@@ -70,4 +97,13 @@ enum
 	TI_INTEN			= 1 << 0,
 };
 
+#define DMA_TI_PERMAP(n) ((n) << TI_PERMAP_SHIFT)
+
+/* Peripheral DREQ numbers for TI_PERMAP. */
+enum
+{
+	DREQ_UART_TX			= 12,
+	DREQ_UART_RX			= 14,
+};
+
 #endif
@@ -0,0 +1,110 @@
+#ifndef DMA_AWAIT_HPP
+#define DMA_AWAIT_HPP
+
+/* C++20 awaitables over the dma_submit() job API in common.h. A
+ * coroutine does
+ *
+ *	dma::job job(cb);
+ *	dma_job_status status = co_await job;
+ *
+ * and is resumed by dma::run_pending(), which the host calls from its
+ * own loop (or dma::run_all() to drive every suspended coroutine to
+ * completion). Jobs still run one after another on the channel; what
+ * this buys is the host doing other work while they do. */
+
+#include <coroutine>
+#include <ctime>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "common.h"
+}
+
+namespace dma
+{
+
+struct waiter
+{
+	dma_job_t *job;
+	std::coroutine_handle<> handle;
+};
+
+inline std::vector<waiter> &pending()
+{
+	static std::vector<waiter> waiters;
+	return waiters;
+}
+
+/* Owns a submitted job and cancels it if it is dropped unfinished. */
+class job
+{
+public:
+	explicit job(volatile struct control_block *cb) : job_(dma_submit(cb)) {}
+	job(job &&other) noexcept : job_(std::exchange(other.job_, nullptr)) {}
+	job(const job &) = delete;
+	job &operator=(const job &) = delete;
+	~job() { dma_release(job_); }
+
+	explicit operator bool() const { return job_ != nullptr; }
+	dma_job_t *get() const { return job_; }
+	void cancel() { dma_cancel(job_); }
+
+	bool await_ready() { return dma_poll(job_, &status_); }
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		pending().push_back({job_, handle});
+	}
+	dma_job_status await_resume()
+	{
+		dma_poll(job_, &status_);
+		return status_;
+	}
+
+private:
+	dma_job_t *job_;
+	dma_job_status status_{};
+};
+
+/* Resumes the coroutines whose jobs have finished and returns how many
+ * are still waiting. */
+inline size_t run_pending()
+{
+	std::vector<waiter> ready;
+	auto &waiters = pending();
+	for (size_t i = 0; i < waiters.size();)
+	{
+		if (dma_poll(waiters[i].job, nullptr))
+		{
+			ready.push_back(waiters[i]);
+			waiters.erase(waiters.begin() + i);
+		}
+		else
+			++i;
+	}
+	for (auto &w : ready)
+		w.handle.resume();
+	return waiters.size();
+}
+
+/* Calls run_pending() until nothing is waiting, sleeping sleep_ns
+ * between rounds that resume nothing. */
+inline void run_all(long sleep_ns = 100000)
+{
+	for (;;)
+	{
+		size_t before = pending().size();
+		size_t after = run_pending();
+		if (!after)
+			break;
+		if (after >= before)
+		{
+			struct timespec pause = { 0, sleep_ns };
+			nanosleep(&pause, nullptr);
+		}
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* Builds dma_await.hpp as C++20 and runs it on the emulator: each of a
+ * few coroutines awaits a job copying a buffer in the DMA memory and
+ * checks the copy once resumed. */
+
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "dma_await.hpp"
+
+extern "C" {
+#include "dma.h"
+}
+
+/* A coroutine that starts at once and frees itself when it ends. */
+struct task
+{
+	struct promise_type
+	{
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
+
+enum { COPIES = 4, COPY_SIZE = 64 };
+
+static int copied;
+
+static task copy(volatile struct control_block *cb, const uint8_t *src, const uint8_t *dest)
+{
+	dma::job job(cb);
+	if (!job)
+	{
+		std::fputs("dma_submit failed\n", stderr);
+		std::exit(1);
+	}
+	dma_job_status status = co_await job;
+	if (status.state != DMA_JOB_DONE || std::memcmp(src, dest, COPY_SIZE))
+	{
+		std::fprintf(stderr, "copy %p ended in state %d\n", (const void *)src,
+			     (int)status.state);
+		std::exit(1);
+	}
+	++copied;
+}
+
+int main()
+{
+	setup();
+	auto *cbs = (volatile struct control_block *)dma_memory.virt;
+	auto *bytes = (uint8_t *)dma_memory.virt + 0x1000;
+	for (int i = 0; i < COPIES; ++i)
+	{
+		uint8_t *src = bytes + 2 * i * COPY_SIZE;
+		uint8_t *dest = src + COPY_SIZE;
+		for (int j = 0; j < COPY_SIZE; ++j)
+			src[j] = i * COPY_SIZE + j;
+		std::memset(dest, 0, COPY_SIZE);
+		volatile struct control_block *cb = &cbs[i];
+		cb->ti = TI_SRC_INC | TI_DEST_INC;
+		cb->source_ad = virtual_to_bus(src);
+		cb->dest_ad = virtual_to_bus(dest);
+		cb->txfr_len = COPY_SIZE;
+		cb->stride = 0;
+		cb->nextconbk = 0;
+		copy(cb, src, dest);
+	}
+	dma::run_all();
+	cleanup();
+	if (copied != COPIES)
+	{
+		std::fprintf(stderr, "%d of %d copies finished\n", copied, COPIES);
+		return 1;
+	}
+	std::printf("dma_await: %d awaited copies\n", copied);
+	return 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bulk.h"
+#include "common.h"
+#include "dma.h"
+#include "mem.h"
+
+/* Times dma_memcpy() and dma_memset() with each setting against the
+ * CPU's memcpy() and memset() on the same buffers in the DMA memory,
+ * and prints the fastest settings for each size class of bulk.c. On
+ * the emulator the DMA's times are the simulated ones and the CPU's
+ * those of the host on ordinary memory, so only the board's numbers
+ * compare the two. Then it times taking an ordinary buffer to the DMA
+ * memory through a CPU copy into it against dma_memcpy_user() straight
+ * from the buffer pinned, which the emulator cannot do.
+ *
+ * With -r it instead times setup() in processes launched together, to
+ * show whether reserving channels and memory holds them up. */
+
+#define MAX_SIZE 0x1000000
+#define MIN_SECONDS 0.05
+#define MAX_REPEATS 1000
+
+static const size_t sizes[] =
+{
+	0x40, 0x100, 0x1000, 0x4000, 0x40000, 0x100000, MAX_SIZE,
+};
+#define SIZE_COUNT (sizeof sizes / sizeof *sizes)
+
+static const int bursts[] = { 0, 1, 3, 7, 15 };
+#define BURST_COUNT (sizeof bursts / sizeof *bursts)
+
+static volatile struct control_block *cbs;
+static volatile uint8_t *src;
+static volatile uint8_t *dest;
+
+static double cpu_time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Returns the MB/s of copying (filling) size bytes with the CPU. */
+static double cpu_rate(size_t size, int fill)
+{
+	int repeats = 0;
+	double start = cpu_time(), seconds;
+	do
+	{
+		if (fill)
+			memset((void *)dest, 0, size);
+		else
+			memcpy((void *)dest, (void *)src, size);
+		seconds = cpu_time() - start;
+	} while (++repeats < MAX_REPEATS && seconds < MIN_SECONDS);
+	return size * repeats / seconds / 1e6;
+}
+
+/* Returns the MB/s of copying (filling) size bytes with the DMA, having
+ * checked the result. */
+static double dma_rate(size_t size, int fill, const struct dma_bulk_settings *settings)
+{
+	int repeats = 0;
+	double start = dma_time(), seconds;
+	do
+	{
+		int ret = fill? dma_memset(0, cbs, dest, 0xa5, size, settings):
+			dma_memcpy(0, cbs, dest, src, size, settings);
+		if (ret)
+		{
+			perror(fill? "dma_memset":"dma_memcpy");
+			cleanup();
+			exit(1);
+		}
+		if (!repeats)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				if (dest[i] != (fill? 0xa5:src[i]))
+				{
+					fprintf(stderr, "%s of %zu bytes is wrong at %zu\n",
+						fill? "dma_memset":"dma_memcpy", size, i);
+					cleanup();
+					exit(1);
+				}
+			}
+		}
+		seconds = dma_time() - start;
+	} while (++repeats < MAX_REPEATS && seconds < MIN_SECONDS);
+	return size * repeats / seconds / 1e6;
+}
+
+/* Returns the MB/s of getting size bytes of buffer to dest: with
+ * pinned NULL by the CPU copying them into src and the DMA on to dest,
+ * otherwise by the DMA straight from pinned. */
+static double staging_rate(uint8_t *buffer, const dma_pinned_t *pinned, size_t size)
+{
+	int repeats = 0;
+	double start = cpu_time(), seconds;
+	do
+	{
+		int ret;
+		if (pinned)
+			ret = dma_memcpy_user(0, cbs, pinned, 0, dest, size, 0, NULL);
+		else
+		{
+			memcpy((void *)src, buffer, size);
+			ret = dma_memcpy(0, cbs, dest, src, size, NULL);
+		}
+		if (ret)
+		{
+			perror(pinned? "dma_memcpy_user":"dma_memcpy");
+			cleanup();
+			exit(1);
+		}
+		seconds = cpu_time() - start;
+	} while (++repeats < MAX_REPEATS && seconds < MIN_SECONDS);
+	return size * repeats / seconds / 1e6;
+}
+
+static void zero_copy(void)
+{
+	uint8_t *buffer = aligned_alloc(PAGE_SIZE, MAX_SIZE);
+	if (!buffer)
+	{
+		perror("aligned_alloc");
+		cleanup();
+		exit(1);
+	}
+	for (size_t i = 0; i < MAX_SIZE; ++i)
+		buffer[i] = i * 13 + (i >> 8);
+
+	dma_pinned_t pinned;
+	if (dma_pin(&pinned, buffer, MAX_SIZE))
+	{
+		perror("\nzero-copy: dma_pin");
+		free(buffer);
+		return;
+	}
+	printf("\n%9s %12s %12s\n", "bytes", "staged", "zero-copy");
+	for (size_t i = 0; i < SIZE_COUNT; ++i)
+	{
+		size_t size = sizes[i];
+		double staged = staging_rate(buffer, NULL, size);
+		double direct = staging_rate(buffer, &pinned, size);
+		if (memcmp((void *)dest, buffer, size))
+		{
+			fprintf(stderr, "dma_memcpy_user of %zu bytes is wrong\n", size);
+			cleanup();
+			exit(1);
+		}
+		printf("%9zu %7.1f MB/s %7.1f MB/s\n", size, staged, direct);
+	}
+	dma_unpin(&pinned);
+	free(buffer);
+}
+
+/* Each process of startup_latency() sets up and cleans up this many
+ * times. */
+#define STARTUP_ROUNDS 20
+
+/* Has n processes start together and each time STARTUP_ROUNDS setups,
+ * and returns their mean and worst times, in seconds, through mean and
+ * max. */
+static void time_setups(int n, double *mean, double *max)
+{
+	int go[2], times[2];
+	if (pipe(go) || pipe(times))
+	{
+		perror("pipe");
+		exit(1);
+	}
+	for (int i = 0; i < n; ++i)
+	{
+		pid_t pid = fork();
+		if (pid == -1)
+		{
+			perror("fork");
+			exit(1);
+		}
+		if (pid)
+			continue;
+
+		// Wait for the others to be forked, then set up and
+		// clean up, sending the parent the time of each setup.
+		close(go[1]);
+		close(times[0]);
+		char c;
+		if (read(go[0], &c, 1) < 0)
+			_exit(1);
+		for (int round = 0; round < STARTUP_ROUNDS; ++round)
+		{
+			double start = cpu_time();
+			setup();
+			double seconds = cpu_time() - start;
+			cleanup();
+			if (write(times[1], &seconds, sizeof seconds) != sizeof seconds)
+				_exit(1);
+		}
+		_exit(0);
+	}
+	close(go[0]);
+	close(times[1]);
+	close(go[1]);
+
+	int count = 0;
+	double seconds, sum = 0;
+	*max = 0;
+	while (read(times[0], &seconds, sizeof seconds) == sizeof seconds)
+	{
+		sum += seconds;
+		if (seconds > *max)
+			*max = seconds;
+		++count;
+	}
+	close(times[0]);
+	int status, failed = 0;
+	while (wait(&status) > 0)
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+	if (failed || count != n * STARTUP_ROUNDS)
+	{
+		fprintf(stderr, "%d of %d setups finished\n", count, n * STARTUP_ROUNDS);
+		exit(1);
+	}
+	*mean = sum / count;
+}
+
+/* Prints the times of setup() in 1 to procs processes launched
+ * together. Each takes the smallest memory, as only the time to get
+ * it counts here, and any channels, so that they are not held to the
+ * two full ones there are to reserve. */
+static void startup_latency(int procs)
+{
+	dma_memory_size = 4 << 20;
+	dma_full_channels = 0;
+	printf("%9s %12s %12s\n", "processes", "mean setup", "worst setup");
+	for (int n = 1; n <= procs; ++n)
+	{
+		double mean, max;
+		time_setups(n, &mean, &max);
+		printf("%9d %9.3f ms %9.3f ms\n", n, mean * 1e3, max * 1e3);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int procs = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+		{
+			char *end;
+			procs = strtol(optarg, &end, 0);
+			if (*end || procs < 1)
+				goto usage;
+			break;
+		}
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc)
+	{
+	usage:
+		fprintf(stderr, "Usage: %s [-r processes]\n"
+			"  -r  time setup() in 1 up to this many processes launched\n"
+			"      together instead; each takes 3 of the 9 channels, so\n"
+			"      at most 3 run at once on the board\n",
+			argv[0]);
+		exit(1);
+	}
+	if (procs)
+	{
+		startup_latency(procs);
+		return 0;
+	}
+
+	setup();
+	cbs = dma_memory.virt;
+	src = (volatile uint8_t *)dma_memory.virt + 0x100000;
+	dest = src + MAX_SIZE;
+	for (size_t i = 0; i < MAX_SIZE; ++i)
+		src[i] = i * 7 + (i >> 8);
+
+	// The fastest memcpy settings found for each class, at the
+	// largest size in it.
+	struct dma_bulk_settings best[DMA_BULK_CLASSES] = { { 0 } };
+	printf("%9s %12s %12s %-14s %12s %12s %-14s\n", "bytes", "CPU memcpy",
+	       "DMA memcpy", "settings", "CPU memset", "DMA memset", "settings");
+	for (size_t i = 0; i < SIZE_COUNT; ++i)
+	{
+		size_t size = sizes[i];
+		double top[2] = { 0, 0 };
+		struct dma_bulk_settings fastest[2];
+		for (int fill = 0; fill < 2; ++fill)
+		{
+			for (int wide = 0; wide < 2; ++wide)
+			{
+				for (size_t b = 0; b < BURST_COUNT; ++b)
+				{
+					struct dma_bulk_settings settings = { wide, bursts[b], 0 };
+					double rate = dma_rate(size, fill, &settings);
+					if (rate > top[fill])
+					{
+						top[fill] = rate;
+						fastest[fill] = settings;
+					}
+				}
+			}
+		}
+		char copy[32], fill[32];
+		snprintf(copy, sizeof copy, "%s burst %d",
+			 fastest[0].wide? "wide":"narrow", fastest[0].burst);
+		snprintf(fill, sizeof fill, "%s burst %d",
+			 fastest[1].wide? "wide":"narrow", fastest[1].burst);
+		printf("%9zu %7.1f MB/s %7.1f MB/s %-14s %7.1f MB/s %7.1f MB/s %-14s\n",
+		       size, cpu_rate(size, 0), top[0], copy, cpu_rate(size, 1), top[1], fill);
+
+		int class = 0;
+		while (size > dma_bulk_class_sizes[class])
+			++class;
+		best[class] = fastest[0];
+	}
+
+	puts("\nFastest settings for each size class of bulk.c:");
+	for (int i = 0; i < DMA_BULK_CLASSES; ++i)
+		printf("\t{ %d, %d, %d },\n", best[i].wide, best[i].burst, best[i].waits);
+
+	zero_copy();
+
+	cleanup();
+	return 0;
+}
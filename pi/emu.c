@@ -0,0 +1,1096 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "dma.h"
+#include "emu.h"
+#include "uart.h"
+
+/* A software model of the BCM2835 DMA channels bf uses. It provides
+ * the same setup()/run_dma() surface as common.c so bf can be linked
+ * against it and run on an ordinary host. The first GB of SDRAM below
+ * the peripherals is reserved in anonymous memory, and dma_alloc()
+ * stands in for the firmware, handing it out downwards from the top
+ * so that the first 64 MB lands where the carve-out would; every SDRAM
+ * alias of what has been handed out is accepted. The peripherals modelled are UART0, whose DR is
+ * wired to stdin/stdout and whose FIFOs move a character per character
+ * time, and the CS and CONBLK_AD registers of the tx and rx channels,
+ * which the first may use to start them. The channels take turns by
+ * simulated time and contend for the AXI bus and the open rows of the
+ * SDRAM. */
+
+#define SDRAM_TOP 0x3f000000
+#define PERIPHERAL_BASE 0x7e000000
+#define PERIPHERAL_SIZE 0x01000000
+#define UART0_DR 0x7e201000
+#define UART0_FR 0x7e201018
+#define DMA_REGISTERS 0x7e007000
+/* The tx and rx channels, unless EMU_DMA_CHANNELS names others as
+ * "tx,rx", as the board may hand out any that are free. */
+#define TX_DMA_CHANNEL 5
+#define RX_DMA_CHANNEL 6
+
+/* The channels are all full ones unless EMU_DMA_LITE is set. Then they
+ * are as the board hands them out: the first is full, the tx and rx
+ * channels are lite if numbered 7 or up, and the others added are the
+ * lite ones 8 and up, as only 4 and 5 are full there. A lite channel
+ * has no 2D mode and moves at most 64 KB a control block, and a block
+ * asking for more faults. */
+#define FIRST_LITE_CHANNEL 7
+#define LITE_MAX_LEN 0xffff
+
+/* Cost model in DMA clock cycles. Loading a control block is a 32
+ * byte read from uncached SDRAM; each 32-bit beat of a transfer costs
+ * a read and a write on the AXI bus and peripheral accesses go
+ * through the slower APB bridge. These are estimates; adjust them to
+ * match a measurement on a board. */
+#define CB_CYCLES 24
+#define BEAT_CYCLES 4
+#define PERIPHERAL_CYCLES 20
+#define DMA_CLOCK_MHZ 250
+
+/* Of those, fetching a control block holds the shared AXI bus for
+ * CB_BUS_CYCLES and each beat for BUS_BEAT_CYCLES; the rest is latency
+ * that other channels can fill. A channel waits when the others keep
+ * the bus busy, so adding channels stops paying off at about
+ * (CB_CYCLES + BEAT_CYCLES) / (CB_BUS_CYCLES + BUS_BEAT_CYCLES) of
+ * them for single beat blocks. */
+#define CB_BUS_CYCLES 4
+#define BUS_BEAT_CYCLES 2
+
+/* The beats after the first of a burst (TI_BURST_LENGTH) follow
+ * back to back, on the bus and off it. */
+#define BURST_BEAT_CYCLES 1
+
+/* The SDRAM keeps one row open in each bank, and an access to another
+ * row of the bank waits for it to be closed and the new one opened.
+ * Rows of 2 KB interleaved across 8 banks are again estimates. */
+#define SDRAM_ROW_SIZE 0x800
+#define SDRAM_BANKS 8
+#define ROW_MISS_CYCLES 16
+
+/* The nine channels bf may reserve less the tx and rx channels. */
+#define MAX_LANES 7
+
+/* Ten bits per character at 115200 baud, and the depth of the PL011
+ * transmit FIFO. */
+#define UART_BYTE_CYCLES (DMA_CLOCK_MHZ * 1000000ull * 10 / 115200)
+#define UART_FIFO_DEPTH 16
+
+struct channel
+{
+	uint32_t cs;
+	uint32_t conblk_ad;
+	uint64_t time;		// simulated cycle the channel has reached
+	uint64_t cbs;		// control blocks run since its job started
+	uint64_t bytes;		// and bytes moved
+	uint64_t row_misses;	// and SDRAM rows opened
+	int lite;
+};
+
+/* A channel jobs run on, each with its own queue. The first drives
+ * the tx and rx channels. */
+struct lane
+{
+	struct channel *channel;
+	dma_job_t *head;	// the job running, if any
+	dma_job_t *tail;
+	uint64_t start;		// cycle the running job started
+	struct timespec clock;	// and the host time
+};
+
+size_t dma_memory_size = MEMORY_SIZE;
+struct dma_memory dma_memory;
+int dma_full_channels = 2;
+uint32_t tx_dma_registers = DMA_REGISTERS + TX_DMA_CHANNEL * 0x100;
+uint32_t rx_dma_registers = DMA_REGISTERS + RX_DMA_CHANNEL * 0x100;
+struct emu_stats emu_stats;
+struct dma_wait_options dma_wait_options = { DMA_WAIT_BACKOFF, 0, "/dev/uio0" };
+struct dma_wait_stats dma_wait_stats;
+
+static int emu_error;
+static int lite_channels;		// whether EMU_DMA_LITE is set
+static uint8_t *window;			// the SDRAM from address 0
+static uint32_t sdram_low = SDRAM_TOP;	// the lowest address handed out
+static struct dma_memory *allocations;	// of dma_alloc(), dma_memory too
+static struct channel channels[2 + MAX_LANES];	// the first lane's, tx, rx, the other lanes'
+static int channel_count = 3;
+static struct channel *current;		// the channel being stepped
+static uint64_t now;			// the latest cycle a channel was stepped at or a job ended
+static uint64_t bus_free;		// cycle the AXI bus is next free
+static struct lane lanes[MAX_LANES];
+static int lane_count = 1;
+static uint64_t uart_tx_done;		// cycle the transmit FIFO empties
+static uint64_t uart_rx_next;		// cycle the next character arrives
+static uint8_t uart_rx_fifo[UART_FIFO_DEPTH];
+static int uart_rx_count;
+static int uart_rx_eof;
+static uint8_t stdin_buffer[4096];	// read from stdin and not yet received
+static size_t stdin_pos, stdin_len;
+static int stdin_eof;
+static uint32_t open_rows[SDRAM_BANKS];	// the row open in each bank, plus 1
+static uint32_t *profile;		// accesses to each 32 bytes, if counted
+
+void setup(void)
+{
+	lite_channels = getenv("EMU_DMA_LITE") != NULL;
+	const char *names = getenv("EMU_DMA_CHANNELS");
+	if (names)
+	{
+		int tx, rx;
+		char end;
+		if (sscanf(names, "%d,%d%c", &tx, &rx, &end) != 2 ||
+		    tx < 0 || tx > 14 || rx < 0 || rx > 14 || tx == rx)
+		{
+			fputs("EMU_DMA_CHANNELS must be two channels from 0 to 14, "
+			      "as tx,rx\n", stderr);
+			exit(1);
+		}
+		tx_dma_registers = DMA_REGISTERS + tx * 0x100;
+		rx_dma_registers = DMA_REGISTERS + rx * 0x100;
+	}
+	channels[1].lite = lite_channels &&
+		tx_dma_registers >= DMA_REGISTERS + FIRST_LITE_CHANNEL * 0x100;
+	channels[2].lite = lite_channels &&
+		rx_dma_registers >= DMA_REGISTERS + FIRST_LITE_CHANNEL * 0x100;
+	window = mmap(NULL, SDRAM_TOP, PROT_NONE,
+		      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (window == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+	if (dma_alloc(&dma_memory, dma_memory_size))
+	{
+		perror("dma_alloc");
+		exit(1);
+	}
+	for (int i = 0; i < MAX_LANES; ++i)
+		lanes[i].channel = i? &channels[2 + i] : &channels[0];
+}
+
+void cleanup(void)
+{
+	if (dma_free(&dma_memory))
+	{
+		perror("dma_free");
+		exit(1);
+	}
+	if (munmap(window, SDRAM_TOP))
+	{
+		perror("munmap");
+		exit(1);
+	}
+	window = NULL;
+	sdram_low = SDRAM_TOP;
+}
+
+/* At the end of the list, so that an allocation comes before any
+ * buffer standing in for it. */
+void dma_track(struct dma_memory *memory)
+{
+	struct dma_memory **link = &allocations;
+	while (*link)
+		link = &(*link)->next;
+	memory->next = NULL;
+	*link = memory;
+}
+
+int dma_untrack(struct dma_memory *memory)
+{
+	struct dma_memory **link = &allocations;
+	while (*link && *link != memory)
+		link = &(*link)->next;
+	if (!*link)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	*link = memory->next;
+	return 0;
+}
+
+int dma_alloc(struct dma_memory *memory, size_t size)
+{
+	// 1 MB aligned, as the firmware is asked for on the board.
+	size = (size + 0xfffff) & ~(size_t)0xfffff;
+	if (!size || size > sdram_low)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	uint32_t base = sdram_low - size;
+	if (mprotect(window + base, size, PROT_READ|PROT_WRITE))
+		return -1;
+	sdram_low = base;
+	memory->virt = window + base;
+	memory->bus = 0xc0000000 | base;
+	memory->size = size;
+	memory->handle = 0;
+	dma_track(memory);
+	return 0;
+}
+
+/* Only the latest allocation is handed out again; the others are
+ * emptied but stay where they are. */
+int dma_free(struct dma_memory *memory)
+{
+	if (dma_untrack(memory))
+		return -1;
+	uint32_t base = memory->bus & 0x3fffffff;
+	int ret = madvise(memory->virt, memory->size, MADV_DONTNEED);
+	if (base == sdram_low)
+	{
+		sdram_low += memory->size;
+		if (mprotect(memory->virt, memory->size, PROT_NONE))
+			ret = -1;
+	}
+	memory->virt = NULL;
+	memory->size = 0;
+	return ret;
+}
+
+const struct dma_memory *dma_memory_of(volatile void *p)
+{
+	for (const struct dma_memory *memory = allocations; memory; memory = memory->next)
+	{
+		if ((uintptr_t)((const volatile char *)p - (char *)memory->virt) < memory->size)
+			return memory;
+	}
+	return NULL;
+}
+
+const struct dma_memory *dma_memory_at(uintptr_t addr)
+{
+	for (const struct dma_memory *memory = allocations; memory; memory = memory->next)
+	{
+		if (addr - memory->bus < memory->size)
+			return memory;
+	}
+	return NULL;
+}
+
+void print_control_block(volatile struct control_block *cb)
+{
+	printf("TI:  %08x\n"
+	       "Src: %08x\n"
+	       "Dst: %08x\n"
+	       "Len: %08x\n"
+	       "Std: %08x\n"
+	       "Nxt: %08x\n",
+	       cb->ti, cb->source_ad, cb->dest_ad, cb->txfr_len,
+	       cb->stride, cb->nextconbk);
+}
+
+static inline int is_peripheral(uint32_t addr)
+{
+	return addr - PERIPHERAL_BASE < PERIPHERAL_SIZE;
+}
+
+/* Returns a host pointer for the SDRAM bus address addr if
+ * [addr, addr + len) lies in what has been handed out, otherwise
+ * NULL. The peripherals sit inside the 0x4 alias and take
+ * precedence. */
+static inline uint8_t *sdram(uint32_t addr, uint32_t len)
+{
+	uint32_t offset = (addr & 0x3fffffff) - sdram_low;
+	if (offset >= SDRAM_TOP - sdram_low || SDRAM_TOP - sdram_low - offset < len ||
+	    is_peripheral(addr))
+		return NULL;
+	return window + sdram_low + offset;
+}
+
+/* Accounts for the current channel accessing the len bytes of SDRAM
+ * at p, which sdram() returned: opens their rows in turn if need be
+ * and counts the access if profiling. */
+static inline void touch(const uint8_t *p, uint32_t len)
+{
+	uint32_t offset = p - window;
+	uint32_t last = (offset + (len? len - 1:0)) / SDRAM_ROW_SIZE;
+	for (uint32_t row = offset / SDRAM_ROW_SIZE; row <= last; ++row)
+	{
+		uint32_t *open = &open_rows[row % SDRAM_BANKS];
+		if (*open != row + 1)
+		{
+			*open = row + 1;
+			current->time += ROW_MISS_CYCLES;
+			current->row_misses += 1;
+		}
+	}
+	if (profile)
+		profile[offset / 32] += 1;
+}
+
+/* What uart_input() returns while nothing has arrived on stdin. */
+#define NO_INPUT (-2)
+
+/* Whether stdin has a character or its end to give. It never blocks,
+ * so that a run that reads no input does not wait on a terminal or an
+ * open pipe. */
+static int stdin_ready(void)
+{
+	if (stdin_pos < stdin_len || stdin_eof)
+		return 1;
+	struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+	if (poll(&fd, 1, 0) == 0)
+		return 0;
+	ssize_t n = read(STDIN_FILENO, stdin_buffer, sizeof stdin_buffer);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		stdin_eof = 1;
+	else
+	{
+		stdin_pos = 0;
+		stdin_len = n;
+	}
+	return 1;
+}
+
+/* The next character of stdin, EOF at its end or NO_INPUT if there is
+ * none yet. */
+static int uart_input(void)
+{
+	if (!stdin_ready())
+		return NO_INPUT;
+	return stdin_pos < stdin_len? stdin_buffer[stdin_pos++] : EOF;
+}
+
+/* Moves the characters that have arrived by the current channel's
+ * time into the receive FIFO. Input that is there is taken to arrive
+ * back to back from the start of the run, and after the end of stdin
+ * NULs follow. While stdin has nothing, the line is looked at again a
+ * character later. A character arriving at a full FIFO is lost, as on
+ * the PL011. */
+static void uart_receive(void)
+{
+	while (uart_rx_next <= current->time)
+	{
+		int c = uart_rx_eof? EOF:uart_input();
+		if (c == NO_INPUT)
+		{
+			uart_rx_next = current->time + UART_BYTE_CYCLES;
+			break;
+		}
+		if (c == EOF)
+		{
+			uart_rx_eof = 1;
+			c = 0;
+		}
+		if (uart_rx_count < UART_FIFO_DEPTH)
+			uart_rx_fifo[uart_rx_count++] = c;
+		else if (!uart_rx_eof)
+			emu_stats.uart_overruns += 1;
+		uart_rx_next += UART_BYTE_CYCLES;
+	}
+}
+
+/* Waits for a character in the receive FIFO, for a character's time
+ * at most. Returns 0 if none has come. */
+static int uart_rx_wait(void)
+{
+	uart_receive();
+	if (!uart_rx_count)
+	{
+		current->time = uart_rx_next;
+		uart_receive();
+	}
+	return uart_rx_count > 0;
+}
+
+/* The cycle at which the transmit FIFO next has room. */
+static inline uint64_t uart_tx_space(void)
+{
+	uint64_t busy = UART_FIFO_DEPTH * (uint64_t)UART_BYTE_CYCLES;
+	return uart_tx_done > busy? uart_tx_done - busy : 0;
+}
+
+/* Returns the tx or rx channel whose registers contain addr, if
+ * any. */
+static struct channel *channel_registers(uint32_t addr)
+{
+	if (addr - tx_dma_registers < 0x100)
+		return &channels[1];
+	if (addr - rx_dma_registers < 0x100)
+		return &channels[2];
+	return NULL;
+}
+
+static uint8_t peripheral_read(uint32_t addr)
+{
+	struct channel *c = channel_registers(addr);
+	if (c)
+		return addr & 0xff? 0:c->cs;
+
+	switch (addr)
+	{
+	case UART0_DR:
+	{
+		// A read of an empty FIFO waits for the next character,
+		// and reads 0 if it does not come.
+		if (!uart_rx_wait())
+			return 0;
+		uint8_t c = uart_rx_fifo[0];
+		memmove(uart_rx_fifo, uart_rx_fifo + 1, --uart_rx_count);
+		return c;
+	}
+	case UART0_FR:
+		emu_stats.uart_polls += 1;
+		uart_receive();
+		return (current->time < uart_tx_space()? FR_TXFF : 0) |
+			(uart_rx_count? 0 : FR_RXFE);
+	default:
+		return 0;
+	}
+}
+
+static void peripheral_write(uint32_t addr, uint8_t value)
+{
+	struct channel *c = channel_registers(addr);
+	if (c)
+	{
+		uint32_t offset = addr & 0xff;
+		if (offset == 0 && value & CS_ACTIVE && !(c->cs & CS_ACTIVE))
+		{
+			c->cs = CS_ACTIVE;
+			c->time = current->time;
+		}
+		else if (offset - 4 < 4)
+		{
+			int shift = (offset - 4) * 8;
+			c->conblk_ad &= ~(0xffu << shift);
+			c->conblk_ad |= (uint32_t)value << shift;
+		}
+		return;
+	}
+	switch (addr)
+	{
+	case UART0_DR:
+	{
+		// A write to a full FIFO is lost on the hardware; here
+		// it just waits.
+		uint64_t start = current->time > uart_tx_done?
+			current->time : uart_tx_done;
+		uart_tx_done = start + UART_BYTE_CYCLES;
+		emu_stats.uart_bytes += 1;
+		putchar(value);
+		break;
+	}
+	}
+}
+
+static void fault(uint32_t cb_addr, const char *what, uint32_t addr)
+{
+	fprintf(stderr, "emu: cb %08x: bad %s address %08x\n",
+		cb_addr, what, addr);
+	emu_error = 1;
+}
+
+/* Reads one byte of a transfer. */
+static inline int read_byte(uint32_t addr, uint8_t *value)
+{
+	uint8_t *p = sdram(addr, 1);
+	if (p)
+		*value = *p;
+	else if (is_peripheral(addr))
+		*value = peripheral_read(addr);
+	else
+		return -1;
+	return 0;
+}
+
+static inline int write_byte(uint32_t addr, uint8_t value)
+{
+	uint8_t *p = sdram(addr, 1);
+	if (p)
+		*p = value;
+	else if (is_peripheral(addr))
+		peripheral_write(addr, value);
+	else
+		return -1;
+	return 0;
+}
+
+/* Performs one row of a transfer one byte at a time. Without
+ * TI_SRC_INC (TI_DEST_INC) the source (destination) address stays
+ * put, so every beat of the transfer touches the same
+ * width-sized word. */
+static int transfer_row(uint32_t cb_addr, uint32_t ti,
+			uint32_t src, uint32_t dest, uint32_t len)
+{
+	uint32_t src_width = ti & TI_SRC_WIDTH? 16:4;
+	uint32_t dest_width = ti & TI_DEST_WIDTH? 16:4;
+	int paced = (ti & (TI_DEST_DREQ | TI_PERMAP_MASK)) ==
+		(TI_DEST_DREQ | DMA_TI_PERMAP(DREQ_UART_TX));
+	int fed = (ti & (TI_SRC_DREQ | TI_PERMAP_MASK)) ==
+		(TI_SRC_DREQ | DMA_TI_PERMAP(DREQ_UART_RX));
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		uint8_t value = 0;
+		// The UART holds DREQ while its transmit FIFO has room
+		// and the channel stalls between beats until it does.
+		if (paced && i % 4 == 0 && current->time < uart_tx_space())
+			current->time = uart_tx_space();
+		// Likewise while its receive FIFO holds a character.
+		if (fed && i % 4 == 0)
+			uart_rx_wait();
+		uint32_t s = src + (ti & TI_SRC_INC? i : i % src_width);
+		uint32_t d = dest + (ti & TI_DEST_INC? i : i % dest_width);
+		if (!(ti & TI_SRC_IGNORE) && read_byte(s, &value))
+		{
+			fault(cb_addr, "source", s);
+			return -1;
+		}
+		if (!(ti & TI_DEST_IGNORE) && write_byte(d, value))
+		{
+			fault(cb_addr, "destination", d);
+			return -1;
+		}
+	}
+	if (is_peripheral(src) || is_peripheral(dest))
+		current->time += PERIPHERAL_CYCLES;
+	return 0;
+}
+
+/* Executes the control block at bus address addr and returns the
+ * address of the next one, or 0 when the chain ends. The block is
+ * copied out before the transfer just as the hardware loads it into
+ * the channel registers, so a block that rewrites itself only sees
+ * the change the next time it is loaded. */
+static inline uint32_t step(uint32_t addr)
+{
+	const struct control_block *p = (const void *)sdram(addr, sizeof *p);
+	if (!p || (addr & 0x1f))
+	{
+		fault(addr, "control block", addr);
+		return 0;
+	}
+	struct control_block cb = *p;
+	uint32_t ti = cb.ti;
+	// While stdin has nothing, DREQ stays low and the channel waits at
+	// a block paced by it, a character's time at a go.
+	if ((ti & (TI_SRC_DREQ | TI_PERMAP_MASK)) ==
+	    (TI_SRC_DREQ | DMA_TI_PERMAP(DREQ_UART_RX)) &&
+	    !uart_rx_count && !uart_rx_eof && !stdin_ready() && !uart_rx_wait())
+		return addr;
+	touch((const uint8_t *)p, sizeof *p);
+	uint32_t rows = 1;
+	uint32_t len = cb.txfr_len & 0x3fffffff;
+	if (current->lite && (ti & TI_TDMODE || len > LITE_MAX_LEN))
+	{
+		fprintf(stderr, "emu: cb %08x: %s on a lite channel\n", addr,
+			ti & TI_TDMODE? "2D mode":"a transfer over 64 KB");
+		emu_error = 1;
+		return 0;
+	}
+	if (ti & TI_TDMODE)
+	{
+		rows = (len >> 16) + 1;
+		len &= 0xffff;
+	}
+
+	// A beat moves 128 bits if both ends are that wide, and only the
+	// first beat of a burst pays the full cost. Wait states hold off
+	// the channel but leave the bus to the others.
+	uint32_t width = (ti & (TI_SRC_WIDTH | TI_SRC_IGNORE)) &&
+		(ti & (TI_DEST_WIDTH | TI_DEST_IGNORE))? 16:4;
+	uint64_t beats = rows * (uint64_t)((len + width - 1) / width);
+	uint64_t burst = ((ti & TI_BURST_LENGTH_MASK) >> 12) + 1;
+	uint64_t bursts = (beats + burst - 1) / burst;
+	uint64_t waits = (ti & TI_WAITS_MASK) >> 21;
+	uint64_t start = current->time > bus_free? current->time : bus_free;
+	bus_free = start + CB_BUS_CYCLES + bursts * BUS_BEAT_CYCLES +
+		(beats - bursts) * BURST_BEAT_CYCLES;
+	current->time = start + CB_CYCLES + bursts * BEAT_CYCLES +
+		(beats - bursts) * BURST_BEAT_CYCLES + beats * waits;
+	current->cbs += 1;
+	current->bytes += rows * (uint64_t)len;
+
+	if (!(ti & (TI_TDMODE | TI_SRC_IGNORE | TI_DEST_IGNORE)) &&
+	    (ti & (TI_SRC_INC | TI_DEST_INC)) == (TI_SRC_INC | TI_DEST_INC))
+	{
+		// The common case: a linear SDRAM to SDRAM copy.
+		uint8_t *src = sdram(cb.source_ad, len);
+		uint8_t *dest = sdram(cb.dest_ad, len);
+		if (src && dest)
+		{
+			touch(src, len);
+			touch(dest, len);
+			if (len == 4)
+				memmove(dest, src, 4);
+			else if (len == 1)
+				*dest = *src;
+			else
+				memmove(dest, src, len);
+			return cb.nextconbk;
+		}
+	}
+	if ((ti & (TI_TDMODE | TI_SRC_INC | TI_DEST_IGNORE | TI_DEST_INC)) == TI_DEST_INC)
+	{
+		// A fill, of zeroes or of a word the source stays on.
+		uint32_t src_width = ti & TI_SRC_WIDTH? 16:4;
+		uint8_t *src = ti & TI_SRC_IGNORE? NULL:sdram(cb.source_ad, src_width);
+		uint8_t *dest = sdram(cb.dest_ad, len);
+		if (dest && (src || ti & TI_SRC_IGNORE))
+		{
+			touch(dest, len);
+			if (!src)
+				memset(dest, 0, len);
+			else
+			{
+				touch(src, src_width);
+				for (uint32_t i = 0; i < len; ++i)
+					dest[i] = src[i % src_width];
+			}
+			return cb.nextconbk;
+		}
+	}
+
+	uint32_t src = cb.source_ad;
+	uint32_t dest = cb.dest_ad;
+	for (uint32_t row = 0; row < rows; ++row)
+	{
+		uint8_t *p;
+		if (!(ti & TI_SRC_IGNORE) && (p = sdram(src, 1)))
+			touch(p, ti & TI_SRC_INC? len:1);
+		if (!(ti & TI_DEST_IGNORE) && (p = sdram(dest, 1)))
+			touch(p, ti & TI_DEST_INC? len:1);
+		if (transfer_row(addr, ti, src, dest, len))
+			return 0;
+		src += (int16_t)(cb.stride & 0xffff);
+		dest += (int16_t)(cb.stride >> 16);
+		if (ti & TI_SRC_INC)
+			src += len;
+		if (ti & TI_DEST_INC)
+			dest += len;
+	}
+	return cb.nextconbk;
+}
+
+static void report(const struct timespec *start, int uart)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+	fflush(stdout);
+	fprintf(stderr, "emu: %llu CBs, %llu bytes, %llu row misses, ~%llu cycles "
+		"(%.3f s at %d MHz), %.1f M CBs/s host\n",
+		(unsigned long long)emu_stats.cbs,
+		(unsigned long long)emu_stats.bytes,
+		(unsigned long long)emu_stats.row_misses,
+		(unsigned long long)emu_stats.cycles,
+		emu_stats.cycles / (DMA_CLOCK_MHZ * 1e6), DMA_CLOCK_MHZ,
+		seconds > 0? emu_stats.cbs / seconds / 1e6 : 0.0);
+	if (uart && (emu_stats.uart_bytes || emu_stats.uart_polls || emu_stats.rx_cbs))
+		fprintf(stderr, "emu: uart %llu bytes, %llu FR polls, %llu overruns, "
+			"%llu tx CBs, %llu rx CBs, %.0f bytes/s\n",
+			(unsigned long long)emu_stats.uart_bytes,
+			(unsigned long long)emu_stats.uart_polls,
+			(unsigned long long)emu_stats.uart_overruns,
+			(unsigned long long)emu_stats.tx_cbs,
+			(unsigned long long)emu_stats.rx_cbs,
+			emu_stats.cycles? emu_stats.uart_bytes *
+			(DMA_CLOCK_MHZ * 1e6) / emu_stats.cycles : 0.0);
+}
+
+/* Clears the registers and counts of c, which stays the kind of channel
+ * it is, and brings it to the current simulated time. */
+static void reset_channel(struct channel *c)
+{
+	int lite = c->lite;
+	memset(c, 0, sizeof *c);
+	c->lite = lite;
+	c->time = now;
+}
+
+/* Starts the chain at cb on lane's channel at the current simulated
+ * time. The first lane starts the UART afresh as well. */
+static void start(struct lane *lane, volatile struct control_block *cb)
+{
+	struct channel *c = lane->channel;
+	clock_gettime(CLOCK_MONOTONIC, &lane->clock);
+	lane->start = now;
+	reset_channel(c);
+	c->cs = CS_ACTIVE;
+	c->conblk_ad = virtual_to_bus(cb);
+	if (lane == lanes)
+	{
+		memset(&emu_stats, 0, sizeof emu_stats);
+		reset_channel(&channels[1]);
+		reset_channel(&channels[2]);
+		uart_tx_done = now;
+		uart_rx_next = now + UART_BYTE_CYCLES;
+		uart_rx_count = 0;
+		uart_rx_eof = 0;
+		memset(open_rows, 0, sizeof open_rows);
+	}
+}
+
+/* Whether the chain on lane is still running, or on the first lane
+ * the tx channel is still draining. */
+static int lane_busy(const struct lane *lane)
+{
+	uint32_t cs = lane->channel->cs;
+	if (lane == lanes)
+		cs |= channels[1].cs;
+	return cs & CS_ACTIVE;
+}
+
+/* The cycle lane has reached. */
+static uint64_t lane_time(const struct lane *lane)
+{
+	uint64_t t = lane->channel->time;
+	if (lane == lanes && t < channels[1].time)
+		t = channels[1].time;
+	return t;
+}
+
+/* Steps whichever active channel is furthest behind and returns it,
+ * or NULL once the lanes' channels have all finished and the tx
+ * channel has drained. Like common.c, the rx channel only runs
+ * alongside them and is stopped wherever it is. */
+static struct channel *advance(void)
+{
+	struct channel *c = NULL;
+	int busy = 0;
+	for (int i = 0; i < channel_count; ++i)
+	{
+		if (channels[i].cs & CS_ACTIVE)
+		{
+			busy |= i != 2;
+			if (!c || channels[i].time < c->time)
+				c = &channels[i];
+		}
+	}
+	if (!busy)
+		return NULL;
+	current = c;
+	if (now < c->time)
+		now = c->time;
+	c->conblk_ad = step(c->conblk_ad);
+	if (!c->conblk_ad)
+		c->cs = CS_END;
+	return c;
+}
+
+/* Fills in emu_stats for the job ending on lane. */
+static void finish(struct lane *lane)
+{
+	struct channel *c = lane->channel;
+	uint64_t end = lane_time(lane);
+	emu_stats.cbs = c->cbs;
+	emu_stats.bytes = c->bytes;
+	emu_stats.row_misses = c->row_misses;
+	if (lane == lanes)
+	{
+		emu_stats.tx_cbs = channels[1].cbs;
+		emu_stats.rx_cbs = channels[2].cbs;
+		emu_stats.bytes += channels[1].bytes + channels[2].bytes;
+		emu_stats.row_misses += channels[1].row_misses + channels[2].row_misses;
+		if (end < uart_tx_done)
+			end = uart_tx_done;
+	}
+	else
+		emu_stats.tx_cbs = emu_stats.rx_cbs = 0;
+	emu_stats.cycles = end - lane->start;
+	if (emu_error)
+		exit(1);
+}
+
+struct dma_job
+{
+	volatile struct control_block *cb;
+	struct lane *lane;
+	struct dma_job_status status;
+	dma_job_t *next;
+};
+
+/* How many control blocks dma_poll() runs before returning. */
+#define POLL_STEPS 1000000
+
+static void start_job(dma_job_t *job)
+{
+	job->status.state = DMA_JOB_RUNNING;
+	start(job->lane, job->cb);
+}
+
+/* Ends the job running on lane in state and starts the next. */
+static void end_job(struct lane *lane, enum dma_job_state state)
+{
+	dma_job_t *job = lane->head;
+	finish(lane);
+	// The host sees the job end only once it has, so what it does
+	// next starts no earlier.
+	if (now < lane_time(lane))
+		now = lane_time(lane);
+	job->status.seconds = emu_stats.cycles / (DMA_CLOCK_MHZ * 1e6);
+	job->status.cs = lane->channel->cs;
+	job->status.state = state;
+	lane->channel->cs = 0;
+	if (lane == lanes)
+		channels[1].cs = channels[2].cs = 0;
+
+	lane->head = job->next;
+	if (!lane->head)
+		lane->tail = NULL;
+	job->next = NULL;
+	if (lane->head)
+		start_job(lane->head);
+}
+
+/* Ends the running jobs whose chains have ended. */
+static void end_jobs(void)
+{
+	for (int i = 0; i < lane_count; ++i)
+	{
+		if (lanes[i].head && !lane_busy(&lanes[i]))
+			end_job(&lanes[i], DMA_JOB_DONE);
+	}
+}
+
+/* Runs the channels for at most steps control blocks, or until a
+ * chain ends, ending the jobs that finish. Stopping there lets the
+ * host give the channel its next job before the others run on. */
+static void update_jobs(uint64_t steps)
+{
+	while (steps--)
+	{
+		struct channel *c = advance();
+		if (!c || !(c->cs & CS_ACTIVE))
+		{
+			end_jobs();
+			break;
+		}
+	}
+}
+
+static int finished(const dma_job_t *job)
+{
+	return job->status.state >= DMA_JOB_DONE;
+}
+
+static void get_status(const dma_job_t *job, struct dma_job_status *status)
+{
+	if (!status)
+		return;
+	*status = job->status;
+	if (job->status.state == DMA_JOB_RUNNING)
+	{
+		status->seconds = (lane_time(job->lane) - job->lane->start) /
+			(DMA_CLOCK_MHZ * 1e6);
+		status->cs = job->lane->channel->cs;
+	}
+}
+
+int dma_add_channels(int count, int full)
+{
+	if (count > MAX_LANES - lane_count)
+		count = MAX_LANES - lane_count;
+	if (lite_channels && full > 0)
+		count = 0;
+	for (int i = 0; i < count; ++i)
+		lanes[lane_count++].channel->lite = lite_channels;
+	channel_count = 2 + lane_count;
+	return lane_count;
+}
+
+dma_job_t *dma_submit_on(int channel, volatile struct control_block *cb)
+{
+	if (channel < 0 || channel >= lane_count)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	dma_job_t *job = calloc(1, sizeof *job);
+	if (!job)
+		return NULL;
+	struct lane *lane = &lanes[channel];
+	job->cb = cb;
+	job->lane = lane;
+	job->status.state = DMA_JOB_QUEUED;
+	if (lane->tail)
+		lane->tail->next = job;
+	else
+		lane->head = job;
+	lane->tail = job;
+	if (lane->head == job)
+		start_job(job);
+	return job;
+}
+
+dma_job_t *dma_submit(volatile struct control_block *cb)
+{
+	return dma_submit_on(0, cb);
+}
+
+/* The emulator runs only when asked, so polling runs a slice of the
+ * chains. */
+int dma_poll(dma_job_t *job, struct dma_job_status *status)
+{
+	if (!finished(job))
+		update_jobs(POLL_STEPS);
+	get_status(job, status);
+	return finished(job);
+}
+
+/* The host waits for nothing here, so whatever the mode the wait
+ * costs no CPU time; it lasts as long as the run in simulated time.
+ * The timeout is in simulated time too, that of job itself. */
+int dma_wait(dma_job_t *job, unsigned long timeout_ms, struct dma_job_status *status)
+{
+	uint64_t limit = timeout_ms * (DMA_CLOCK_MHZ * 1000ull);
+	struct lane *lane = job->lane;
+	while (!finished(job))
+	{
+		if (limit && job == lane->head && lane_time(lane) - lane->start > limit)
+		{
+			get_status(job, status);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		update_jobs(limit? 1000:POLL_STEPS);
+	}
+	get_status(job, status);
+	return 0;
+}
+
+void dma_cancel(dma_job_t *job)
+{
+	struct lane *lane = job->lane;
+	if (job == lane->head && job->status.state == DMA_JOB_RUNNING)
+	{
+		end_job(lane, DMA_JOB_CANCELLED);
+		return;
+	}
+	for (dma_job_t **p = &lane->head, *prev = NULL; *p; prev = *p, p = &(*p)->next)
+	{
+		if (*p == job)
+		{
+			*p = job->next;
+			if (lane->tail == job)
+				lane->tail = prev;
+			job->next = NULL;
+			job->status.state = DMA_JOB_CANCELLED;
+			return;
+		}
+	}
+}
+
+void dma_release(dma_job_t *job)
+{
+	if (!job)
+		return;
+	if (!finished(job))
+		dma_cancel(job);
+	free(job);
+}
+
+double dma_time(void)
+{
+	return now / (DMA_CLOCK_MHZ * 1e6);
+}
+
+int dma_lite(int channel)
+{
+	if (channel < 0 || channel >= lane_count)
+		return 0;
+	return lanes[channel].channel->lite;
+}
+
+int dma_profile(int on)
+{
+	free(profile);
+	profile = NULL;
+	if (on && !(profile = calloc(SDRAM_TOP / 32, sizeof *profile)))
+		return -1;
+	return 0;
+}
+
+uint64_t dma_profile_count(uintptr_t addr, size_t size)
+{
+	uint64_t count = 0;
+	if (!profile || !sdram(addr, 1))
+		return 0;
+	size_t start = addr & 0x3fffffff;
+	size_t end = start + size;
+	if (end > SDRAM_TOP)
+		end = SDRAM_TOP;
+	for (size_t i = start / 32; i < (end + 31) / 32; ++i)
+		count += profile[i];
+	return count;
+}
+
+/* The emulated DMA reaches only its own memory. */
+int dma_pin(dma_pinned_t *pinned, void *p, size_t size)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int dma_unpin(dma_pinned_t *pinned)
+{
+	return 0;
+}
+
+int run_dma(volatile struct control_block *cb)
+{
+	memset(&dma_wait_stats, 0, sizeof dma_wait_stats);
+	dma_job_t *job = dma_submit(cb);
+	if (!job)
+		return -1;
+	struct dma_job_status status;
+	int ret = dma_wait(job, dma_wait_options.timeout_ms, &status);
+	if (ret)
+		fprintf(stderr, "emu: timed out after %lu ms\n",
+			dma_wait_options.timeout_ms);
+	dma_release(job);
+	report(&lanes[0].clock, 1);
+	dma_wait_stats.seconds = status.seconds;
+	if (ret)
+		errno = ETIMEDOUT;
+	return ret;
+}
+
+int trace_dma(volatile struct control_block *cb, dma_trace_t *trace)
+{
+	memset(&dma_wait_stats, 0, sizeof dma_wait_stats);
+	start(lanes, cb);
+
+	for (;;)
+	{
+		// Take the block the first channel is on before the step,
+		// which may write over its source, and keep it if the step
+		// was that channel's.
+		struct dma_trace_record record = { 0 };
+		const struct control_block *p = NULL;
+		if (channels[0].cs & CS_ACTIVE)
+			p = (const void *)sdram(channels[0].conblk_ad, sizeof *p);
+		if (p)
+		{
+			const uint8_t *data = sdram(p->source_ad, 4);
+			record.cb = channels[0].conblk_ad;
+			record.source_ad = p->source_ad;
+			record.dest_ad = p->dest_ad;
+			record.txfr_len = p->txfr_len;
+			if (data)
+				memcpy(&record.data, data, 4);
+		}
+		struct channel *c = advance();
+		if (!c)
+			break;
+		if (c == channels && p)
+			dma_trace_add(trace, &record);
+	}
+
+	finish(lanes);
+	report(&lanes[0].clock, 1);
+	for (int i = 0; i < 3; ++i)
+		reset_channel(&channels[i]);
+	return 0;
+}
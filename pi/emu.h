@@ -0,0 +1,24 @@
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+
+/* Counters for the job that finished last, or the most recent
+ * trace_dma(), on the emulated channels. The tx, rx and UART counts
+ * are those of the first channel's last job. */
+struct emu_stats
+{
+	uint64_t cbs;		// control blocks executed by the job's channel
+	uint64_t bytes;		// bytes transferred
+	uint64_t row_misses;	// SDRAM rows opened
+	uint64_t cycles;	// estimated DMA clock cycles
+	uint64_t tx_cbs;	// control blocks executed by the tx channel
+	uint64_t rx_cbs;	// control blocks executed by the rx channel
+	uint64_t uart_bytes;	// bytes written to UART0 DR
+	uint64_t uart_polls;	// reads of UART0 FR
+	uint64_t uart_overruns;	// characters lost to a full receive FIFO
+};
+
+extern struct emu_stats emu_stats;
+
+#endif
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "mbox.h"
+
+/* The tags of the property interface used, and the codes a request
+ * and its reply start with. */
+#define TAG_ALLOCATE_MEMORY	0x3000c
+#define TAG_LOCK_MEMORY		0x3000d
+#define TAG_UNLOCK_MEMORY	0x3000e
+#define TAG_RELEASE_MEMORY	0x3000f
+#define PROCESS_REQUEST		0x00000000
+#define REQUEST_SUCCESSFUL	0x80000000
+
+#define IOCTL_MBOX_PROPERTY _IOWR(100, 0, char *)
+
+static int mbox_fd = -1;
+
+int open_mbox(void)
+{
+	if (mbox_fd != -1)
+		return 0;
+	mbox_fd = open("/dev/vcio", O_RDWR|O_CLOEXEC);
+	return mbox_fd == -1? -1:0;
+}
+
+int close_mbox(void)
+{
+	if (mbox_fd == -1)
+		return 0;
+	int ret = close(mbox_fd);
+	mbox_fd = -1;
+	return ret;
+}
+
+/* Sends a request of a single tag with count words of arguments, and
+ * returns its first word of reply, or 0 with errno set. It makes a
+ * single system call, so a signal handler may call it. */
+static uint32_t property(uint32_t tag, int count, const uint32_t args[])
+{
+	if (mbox_fd == -1)
+	{
+		errno = EBADF;
+		return 0;
+	}
+
+	// 1. The buffer size, the request code, the tag, the size of
+	// its value buffer, the request size, the value and the end
+	// tag.
+	uint32_t buffer[10] __attribute__((aligned(16)));
+	int i = 0;
+	buffer[i++] = 0;
+	buffer[i++] = PROCESS_REQUEST;
+	buffer[i++] = tag;
+	buffer[i++] = 4 * count;
+	buffer[i++] = 4 * count;
+	for (int j = 0; j < count; ++j)
+		buffer[i++] = args[j];
+	buffer[i++] = 0;
+	buffer[0] = 4 * i;
+
+	// 2. The firmware replies in place.
+	if (ioctl(mbox_fd, IOCTL_MBOX_PROPERTY, buffer) < 0)
+		return 0;
+	if (buffer[1] != REQUEST_SUCCESSFUL)
+	{
+		errno = EIO;
+		return 0;
+	}
+	return buffer[5];
+}
+
+uint32_t mbox_alloc(uint32_t size, uint32_t align, uint32_t flags)
+{
+	uint32_t args[] = { size, align, flags };
+	errno = 0;
+	uint32_t handle = property(TAG_ALLOCATE_MEMORY, 3, args);
+	if (!handle && !errno)
+		errno = ENOMEM;
+	return handle;
+}
+
+uint32_t mbox_lock(uint32_t handle)
+{
+	errno = 0;
+	uint32_t bus = property(TAG_LOCK_MEMORY, 1, &handle);
+	if (!bus && !errno)
+		errno = EINVAL;
+	return bus;
+}
+
+/* Both return a status of 0 on success. */
+int mbox_unlock(uint32_t handle)
+{
+	errno = 0;
+	if (property(TAG_UNLOCK_MEMORY, 1, &handle) || errno)
+	{
+		errno = errno? errno:EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int mbox_release(uint32_t handle)
+{
+	errno = 0;
+	if (property(TAG_RELEASE_MEMORY, 1, &handle) || errno)
+	{
+		errno = errno? errno:EINVAL;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef MBOX_H
+#define MBOX_H
+
+#include <stdint.h>
+
+/* Flags for mbox_alloc(). */
+enum
+{
+	MBOX_MEM_DISCARDABLE	= 1 << 0, // the GPU may take it back
+	MBOX_MEM_DIRECT		= 1 << 2, // at the uncached 0xC alias
+	MBOX_MEM_COHERENT	= 2 << 2, // at the L2 coherent 0x8 alias
+	MBOX_MEM_ZERO		= 1 << 4, // cleared
+	MBOX_MEM_NO_INIT	= 1 << 5,
+	MBOX_MEM_HINT_PERMALOCK	= 1 << 6, // likely to stay locked
+};
+
+/* The firmware's property interface, through /dev/vcio, which only
+ * root or the video group may open. */
+int open_mbox(void);
+int close_mbox(void);
+
+/* Allocates size bytes of the GPU's memory aligned to align, which
+ * must be a power of 2. Returns its handle, or 0 with errno set. */
+uint32_t mbox_alloc(uint32_t size, uint32_t align, uint32_t flags);
+/* Locks the allocation in place and returns its bus address, or 0
+ * with errno set. */
+uint32_t mbox_lock(uint32_t handle);
+int mbox_unlock(uint32_t handle);
+int mbox_release(uint32_t handle);
+
+#endif
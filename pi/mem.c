@@ -1,14 +1,16 @@
+#include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
+#include "mbox.h"
 #include "mem.h"
 
-#define PAGE_SIZE 4096
-
 static int dev_mem_fd = -1;
+static int pagemap_fd = -1;
+static int carve_out_taken;
 
 int open_dev_mem(void)
 {
@@ -40,7 +42,10 @@ static inline size_t round_up(size_t size)
 static void *physical_map(uintptr_t physical_address, size_t size)
 {
 	if (dev_mem_fd == -1)
+	{
+		errno = EBADF;
 		return NULL;
+	}
 	uintptr_t addr = round_down(physical_address);
 	ptrdiff_t delta = physical_address - addr;
 	size = round_up(size + delta);
@@ -64,6 +69,13 @@ static inline uintptr_t bus_to_physical(uintptr_t p)
 	return p - 0x7e000000 + 0x3f000000;
 }
 
+/* The uncached alias of SDRAM the DMA sees physical address p at,
+ * the one the window mapped by sdram_map() is used through. */
+static inline uintptr_t physical_to_bus(uintptr_t p)
+{
+	return p | 0xc0000000;
+}
+
 void *io_map(uintptr_t bus_address, size_t size)
 {
 	return physical_map(bus_to_physical(bus_address), size);
@@ -83,3 +95,116 @@ int sdram_unmap(void *p, size_t size)
 {
 	return physical_unmap(p, size);
 }
+
+int sdram_alloc(struct dma_memory *memory, size_t size)
+{
+	size = round_up(size);
+
+	// 1. From the firmware, at the uncached alias the carve-out is
+	// used through and aligned to 1 MB like it.
+	uint32_t handle = mbox_alloc(size, 0x100000, MBOX_MEM_DIRECT);
+	if (handle)
+	{
+		uint32_t bus = mbox_lock(handle);
+		void *p = bus? sdram_map(bus & 0x3fffffff, size):NULL;
+		if (p)
+		{
+			memory->virt = p;
+			memory->bus = bus;
+			memory->size = size;
+			memory->handle = handle;
+			return 0;
+		}
+		int error = errno;
+		if (bus)
+			mbox_unlock(handle);
+		mbox_release(handle);
+		errno = error;
+	}
+
+	// 2. Otherwise out of the carve-out, all of which the first
+	// allocation to need it takes.
+	if (carve_out_taken || size > CARVE_OUT_SIZE)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	void *p = sdram_map(CARVE_OUT_BASE, size);
+	if (!p)
+		return -1;
+	carve_out_taken = 1;
+	memory->virt = p;
+	memory->bus = physical_to_bus(CARVE_OUT_BASE);
+	memory->size = size;
+	memory->handle = 0;
+	return 0;
+}
+
+int sdram_free(struct dma_memory *memory)
+{
+	int ret = sdram_unmap(memory->virt, memory->size);
+	if (!memory->handle)
+		carve_out_taken = 0;
+	else if (mbox_unlock(memory->handle) | mbox_release(memory->handle))
+		ret = -1;
+	memory->virt = NULL;
+	memory->size = 0;
+	return ret;
+}
+
+/* The kernel only shows the frame numbers in pagemap to those who
+ * opened it with CAP_SYS_ADMIN, so it is opened while still root and
+ * kept. */
+int open_pagemap(void)
+{
+	if (pagemap_fd != -1)
+		return 0;
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY|O_CLOEXEC);
+	return pagemap_fd == -1? -1:0;
+}
+
+int close_pagemap(void)
+{
+	if (pagemap_fd == -1)
+		return 0;
+	int ret = close(pagemap_fd);
+	pagemap_fd = -1;
+	return ret;
+}
+
+int user_pages_to_bus(const void *p, size_t count, uint32_t bus[])
+{
+	if (pagemap_fd == -1)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	uintptr_t page = (uintptr_t)p / PAGE_SIZE;
+	for (size_t i = 0; i < count; ++i)
+	{
+		// Bit 63 says the page is present and bits 0-54 hold
+		// its frame number, which reads as 0 without the
+		// capability.
+		uint64_t entry;
+		if (pread(pagemap_fd, &entry, sizeof entry,
+			  (page + i) * sizeof entry) != sizeof entry)
+		{
+			errno = errno? errno:EIO;
+			return -1;
+		}
+		uint64_t frame = entry & ((1ull << 55) - 1);
+		if (!(entry >> 63) || !frame)
+		{
+			errno = entry >> 63? EPERM:EFAULT;
+			return -1;
+		}
+		// The DMA only reaches the first 1 GB.
+		if (frame >= 0x40000000 / PAGE_SIZE)
+		{
+			errno = ERANGE;
+			return -1;
+		}
+		bus[i] = physical_to_bus(frame * PAGE_SIZE);
+	}
+	return 0;
+}
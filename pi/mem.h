@@ -1,8 +1,27 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define PAGE_SIZE 4096
+
+/* 64 MB at the top of the first GB hidden from Linux at boot, with
+ * mem= or a reserved-memory node, for when the firmware cannot give
+ * the DMA any memory. */
+#define CARVE_OUT_BASE 0x3b000000
+#define CARVE_OUT_SIZE 0x04000000
+
+/* Memory the DMA can reach, contiguous on the bus. */
+struct dma_memory
+{
+	void *virt;
+	uintptr_t bus;
+	size_t size;
+	uint32_t handle;		// the firmware's, 0 for the carve-out
+	struct dma_memory *next;	// for its owner to keep a list
+};
+
 int open_dev_mem(void);
 int close_dev_mem(void);
 void *io_map(uintptr_t bus_address, size_t size);
@@ -11,4 +30,31 @@ int io_unmap(void *p, size_t size);
 void *sdram_map(uintptr_t address, size_t size);
 int sdram_unmap(void *p, size_t size);
 
+/* Gets size bytes from the firmware through the mailbox, which must
+ * be open, or failing that the carve-out if it is free and large
+ * enough, and maps them; /dev/mem must be open. Returns -1 with errno
+ * set if neither has the room. */
+int sdram_alloc(struct dma_memory *memory, size_t size);
+int sdram_free(struct dma_memory *memory);
+
+static inline uintptr_t dma_memory_to_bus(const struct dma_memory *memory,
+					  volatile void *p)
+{
+	return (const volatile char *)p - (char *)memory->virt + memory->bus;
+}
+
+static inline void *dma_memory_to_virtual(const struct dma_memory *memory,
+					  uintptr_t addr)
+{
+	return (char *)memory->virt + (addr - memory->bus);
+}
+
+int open_pagemap(void);
+int close_pagemap(void);
+/* Looks up through /proc/self/pagemap the bus addresses of the count
+ * pages from the one p is in, which must be resident, as after
+ * mlock(). Returns -1 with errno EPERM if pagemap was opened without
+ * CAP_SYS_ADMIN. */
+int user_pages_to_bus(const void *p, size_t count, uint32_t bus[]);
+
 #endif
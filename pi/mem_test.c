@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mbox.h"
+#include "mem.h"
+
+/* Runs sdram_alloc() and sdram_free() against a fake firmware. Linked
+ * with --wrap for open, ioctl, mmap and munmap, it answers the
+ * property requests mbox.c makes of /dev/vcio itself and hands out
+ * anonymous memory for mappings of /dev/mem, so that every way the
+ * mailbox can fail, and the fallback on the carve-out, can be had on
+ * any host. */
+
+int __real_open(const char *path, int flags, ...);
+int __real_ioctl(int fd, unsigned long request, ...);
+void *__real_mmap(void *addr, size_t size, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t size);
+
+#define TAG_ALLOCATE_MEMORY	0x3000c
+#define TAG_LOCK_MEMORY		0x3000d
+#define TAG_UNLOCK_MEMORY	0x3000e
+#define TAG_RELEASE_MEMORY	0x3000f
+#define REQUEST_SUCCESSFUL	0x80000000
+
+/* Where the fake firmware's allocations are, in SDRAM. */
+#define GPU_BASE 0x1e000000
+#define MAX_HANDLES 8
+
+enum handle_state { FREE, ALLOCATED, LOCKED, UNLOCKED, RELEASED };
+
+static struct
+{
+	int vcio_fd;
+	int mem_fd;
+	int no_vcio;		// /dev/vcio cannot be opened
+	int no_memory;		// allocations fail
+	int no_lock;		// locks fail
+	uint32_t no_map;	// mappings of this physical address fail
+	enum handle_state handles[MAX_HANDLES + 1];
+	uint32_t sizes[MAX_HANDLES + 1];	// as asked for
+	int maps;		// mappings of /dev/mem not yet unmapped
+} fake;
+
+static int failures;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	if (!strcmp(path, "/dev/vcio"))
+	{
+		if (fake.no_vcio)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+		return fake.vcio_fd = __real_open("/dev/null", O_RDWR);
+	}
+	if (!strcmp(path, "/dev/mem"))
+		return fake.mem_fd = __real_open("/dev/null", O_RDWR);
+	int mode = 0;
+	if (flags & O_CREAT)
+	{
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return __real_open(path, flags, mode);
+}
+
+/* Answers a request of one tag as the firmware does, in place. */
+static void property(uint32_t *buffer)
+{
+	uint32_t size = buffer[0], tag = buffer[2], count = buffer[3] / 4;
+	CHECK(buffer[1] == 0);
+	CHECK(buffer[4] == buffer[3]);
+	CHECK(size == 4 * (6 + count));
+	CHECK(buffer[5 + count] == 0);
+
+	uint32_t *value = &buffer[5];
+	uint32_t handle = value[0];
+	int valid = handle > 0 && handle <= MAX_HANDLES;
+	buffer[1] = REQUEST_SUCCESSFUL;
+	switch (tag)
+	{
+	case TAG_ALLOCATE_MEMORY:
+		CHECK(count == 3);
+		CHECK(value[1] == 0x100000);
+		CHECK(value[2] == MBOX_MEM_DIRECT);
+		CHECK(value[0] % 0x1000 == 0);
+		{
+			uint32_t h = 1;
+			while (h <= MAX_HANDLES && fake.handles[h] != FREE)
+				++h;
+			if (fake.no_memory || h > MAX_HANDLES)
+				value[0] = 0;
+			else
+			{
+				fake.handles[h] = ALLOCATED;
+				fake.sizes[h] = value[0];
+				value[0] = h;
+			}
+		}
+		break;
+	case TAG_LOCK_MEMORY:
+		CHECK(count == 1);
+		CHECK(valid && fake.handles[handle] == ALLOCATED);
+		if (fake.no_lock || !valid)
+			value[0] = 0;
+		else
+		{
+			fake.handles[handle] = LOCKED;
+			value[0] = 0xc0000000 | (GPU_BASE + handle * 0x1000000);
+		}
+		break;
+	case TAG_UNLOCK_MEMORY:
+		CHECK(count == 1);
+		CHECK(valid && fake.handles[handle] == LOCKED);
+		if (valid)
+			fake.handles[handle] = UNLOCKED;
+		value[0] = 0;
+		break;
+	case TAG_RELEASE_MEMORY:
+		CHECK(count == 1);
+		CHECK(valid && (fake.handles[handle] == ALLOCATED ||
+				fake.handles[handle] == UNLOCKED));
+		if (valid)
+			fake.handles[handle] = RELEASED;
+		value[0] = 0;
+		break;
+	default:
+		buffer[1] = 0x80000001;
+	}
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+	if (fd != fake.vcio_fd)
+		return __real_ioctl(fd, request, arg);
+	property(arg);
+	return 0;
+}
+
+void *__wrap_mmap(void *addr, size_t size, int prot, int flags, int fd, off_t offset)
+{
+	if (fd != fake.mem_fd)
+		return __real_mmap(addr, size, prot, flags, fd, offset);
+	CHECK(flags & MAP_SHARED);
+	if (offset == fake.no_map)
+	{
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+	void *p = __real_mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		++fake.maps;
+	return p;
+}
+
+int __wrap_munmap(void *addr, size_t size)
+{
+	--fake.maps;
+	return __real_munmap(addr, size);
+}
+
+/* Clears the fake firmware's state and failures for the next case. */
+static void reset(void)
+{
+	memset(&fake, 0, sizeof fake);
+	fake.vcio_fd = fake.mem_fd = -1;
+	fake.no_map = -1;
+}
+
+/* Opens the devices, the mailbox failing to open if no_vcio. */
+static void start(const char *name)
+{
+	if (open_dev_mem())
+	{
+		perror(name);
+		exit(1);
+	}
+	CHECK(open_mbox() == (fake.no_vcio? -1:0));
+}
+
+static void finish(void)
+{
+	CHECK(fake.maps == 0);
+	close_mbox();
+	close_dev_mem();
+	reset();
+}
+
+int main(void)
+{
+	struct dma_memory memory, other;
+	reset();
+
+	// The firmware has the memory: it is locked, mapped at its
+	// physical address and given back in full. Sizes round up to
+	// pages.
+	start("firmware");
+	CHECK(sdram_alloc(&memory, 0x200001) == 0);
+	CHECK(memory.handle == 1);
+	CHECK(memory.bus == (0xc0000000 | (GPU_BASE + 0x1000000)));
+	CHECK(memory.size == 0x201000 && fake.sizes[1] == 0x201000);
+	CHECK(fake.handles[1] == LOCKED);
+	((volatile uint8_t *)memory.virt)[memory.size - 1] = 1;
+	CHECK(sdram_alloc(&other, 0x1000) == 0);
+	CHECK(other.handle == 2);
+	CHECK(sdram_free(&other) == 0);
+	CHECK(sdram_free(&memory) == 0);
+	CHECK(fake.handles[1] == RELEASED && fake.handles[2] == RELEASED);
+	finish();
+
+	// The firmware has none: the carve-out is taken, once at a time.
+	fake.no_memory = 1;
+	start("carve-out");
+	CHECK(sdram_alloc(&memory, 0x100000) == 0);
+	CHECK(memory.handle == 0);
+	CHECK(memory.bus == (0xc0000000 | CARVE_OUT_BASE));
+	errno = 0;
+	CHECK(sdram_alloc(&other, 0x1000) == -1 && errno == ENOMEM);
+	CHECK(sdram_free(&memory) == 0);
+	CHECK(sdram_alloc(&memory, CARVE_OUT_SIZE) == 0);
+	CHECK(sdram_free(&memory) == 0);
+	errno = 0;
+	CHECK(sdram_alloc(&memory, CARVE_OUT_SIZE + 1) == -1 && errno == ENOMEM);
+	finish();
+
+	// A lock that fails releases the memory unlocked.
+	fake.no_lock = 1;
+	start("lock");
+	CHECK(sdram_alloc(&memory, 0x1000) == 0);
+	CHECK(memory.handle == 0);
+	CHECK(fake.handles[1] == RELEASED);
+	CHECK(sdram_free(&memory) == 0);
+	finish();
+
+	// A mapping that fails unlocks and releases it.
+	fake.no_map = GPU_BASE + 0x1000000;
+	start("map");
+	CHECK(sdram_alloc(&memory, 0x1000) == 0);
+	CHECK(memory.handle == 0);
+	CHECK(fake.handles[1] == RELEASED);
+	CHECK(sdram_free(&memory) == 0);
+	finish();
+
+	// Without /dev/vcio only the carve-out is left.
+	fake.no_vcio = 1;
+	start("no mailbox");
+	errno = 0;
+	CHECK(mbox_alloc(0x1000, 0x100000, MBOX_MEM_DIRECT) == 0 && errno == EBADF);
+	CHECK(sdram_alloc(&memory, 0x1000) == 0);
+	CHECK(memory.handle == 0);
+	CHECK(sdram_free(&memory) == 0);
+	finish();
+
+	if (failures)
+	{
+		fprintf(stderr, "mem: %d checks failed\n", failures);
+		return 1;
+	}
+	puts("mem: mailbox and carve-out checks passed");
+	return 0;
+}
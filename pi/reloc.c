@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "reloc.h"
+
+void reloc_init(reloc_t *reloc, uintptr_t base, size_t size)
+{
+	reloc->base = base;
+	reloc->size = size;
+	reloc->offsets = NULL;
+	reloc->count = 0;
+	reloc->capacity = 0;
+}
+
+void reloc_free(reloc_t *reloc)
+{
+	free(reloc->offsets);
+	reloc->offsets = NULL;
+	reloc->count = 0;
+	reloc->capacity = 0;
+}
+
+int reloc_add(reloc_t *reloc, uintptr_t addr)
+{
+	assert(addr >= reloc->base && addr - reloc->base <= reloc->size - 4);
+	if (reloc->count == reloc->capacity)
+	{
+		size_t capacity = reloc->capacity? reloc->capacity * 2:1024;
+		uint32_t *offsets = realloc(reloc->offsets, capacity * sizeof *offsets);
+		if (!offsets)
+			return -1;
+		reloc->offsets = offsets;
+		reloc->capacity = capacity;
+	}
+	reloc->offsets[reloc->count++] = addr - reloc->base;
+	return 0;
+}
+
+void reloc_apply(volatile void *image, const uint32_t *offsets, size_t count,
+		 uint32_t delta)
+{
+	assert(delta % RELOC_ALIGN == 0);
+	reloc_shift(image, offsets, count, delta);
+}
+
+void reloc_shift(volatile void *image, const uint32_t *offsets, size_t count,
+		 uint32_t delta)
+{
+	if (!delta)
+		return;
+	volatile uint8_t *bytes = image;
+	for (size_t i = 0; i < count; ++i)
+		*(volatile uint32_t *)(bytes + offsets[i]) += delta;
+}
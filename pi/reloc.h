@@ -0,0 +1,43 @@
+#ifndef RELOC_H
+#define RELOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* How far apart two copies of an image must be. Tables are indexed by
+ * writing the low byte or half of an address, so only whole 64 KB
+ * blocks may move without rebuilding them. */
+#define RELOC_ALIGN 0x10000
+
+/* The words of an image, built at the bus address base, that hold bus
+ * addresses in it. A copy of the image at another base runs there
+ * once reloc_apply() has patched them. Each word is recorded by its
+ * offset from base, in the order it was stored. */
+typedef struct
+{
+	uintptr_t base;
+	size_t size;
+	uint32_t *offsets;
+	size_t count;
+	size_t capacity;
+} reloc_t;
+
+void reloc_init(reloc_t *reloc, uintptr_t base, size_t size);
+void reloc_free(reloc_t *reloc);
+
+/* Records the word at the bus address addr in the image. Returns -1 if
+ * there is no memory for it. */
+int reloc_add(reloc_t *reloc, uintptr_t addr);
+
+/* Moves the count words at offsets in the copy of an image at image by
+ * delta, the distance from where it was built to where the copy is, a
+ * multiple of RELOC_ALIGN. */
+void reloc_apply(volatile void *image, const uint32_t *offsets, size_t count,
+		 uint32_t delta);
+
+/* The same for words that hold addresses outside the image, such as
+ * those of a DMA channel's registers, which may move by any delta. */
+void reloc_shift(volatile void *image, const uint32_t *offsets, size_t count,
+		 uint32_t delta);
+
+#endif
@@ -9,14 +9,13 @@
 #include <sys/types.h>
 
 #include "dma.h"
+#include "mbox.h"
 #include "mem.h"
 
 #define TARGET_UID 1001
 
-/* 64 MB to play with */
-#define BUS_ADDRESS 0xfb000000u
-#define SDRAM_BASE  0x3b000000
-#define MEMORY_SIZE 0x04000000
+/* The control blocks, tables and data */
+#define MEMORY_SIZE 0x4000
 
 #define BUS_SDRAM_ADDR   0xc0000000u
 #define PAGE_OFFSET      0x80000000u
@@ -30,18 +29,19 @@ typedef volatile uint8_t vuint8_t;
 typedef volatile uint32_t vuint32_t;
 
 static struct dma_registers *dma;
-static void *physical_memory;
+static struct dma_memory memory;
 
-/* This is only for virtual addresses pointing to in
- * [physical_memory, physical_memory + MEMORY_SIZE). */
+#define BUS_ADDRESS (memory.bus)
+
+/* This is only for virtual addresses pointing to in memory. */
 static inline uintptr_t virtual_to_bus(volatile void *p)
 {
-	return (void *)p - physical_memory + BUS_ADDRESS;
+	return dma_memory_to_bus(&memory, p);
 }
 
 static inline void *bus_to_virtual(uintptr_t addr)
 {
-	return (char *)physical_memory + (addr - BUS_ADDRESS);
+	return dma_memory_to_virtual(&memory, addr);
 }
 
 static void setup(void)
@@ -68,12 +68,16 @@ static void setup(void)
 	}
 	printf("dma_channel = %d\n", dma_channel);
 	dma = get_dma_channel(dma_channel);
-	physical_memory = sdram_map(SDRAM_BASE, MEMORY_SIZE);
-	if (physical_memory == MAP_FAILED)
+
+	// The chain keeps running once the process has gone, so the
+	// memory is never given back.
+	open_mbox();
+	if (sdram_alloc(&memory, MEMORY_SIZE))
 	{
-		perror("sdram_map");
+		perror("sdram_alloc");
 		exit(1);
 	}
+	close_mbox();
 
 	if (close_dev_mem())
 	{
@@ -0,0 +1,162 @@
+#!/bin/sh
+# Runs the programs here on bf-emu in each mode and compares what they
+# print with NAME.out, and the control blocks and cycles each took
+# with cycles.txt, so that a change to the gadgets, the compiler or
+# the emulator's cost model shows up as a diff. -u writes the files
+# afresh from this run instead, for a change that is meant to alter
+# them. Run from pi/ by make check.
+#
+#   hw, squares, scan, mul, off	loops, idioms, products and offsets
+#   rev				',' input from input.txt
+#   far				moves across tape pages
+#   wrapt			the wrap-around tape of -t
+#   big				over the 32 KB the jump table takes
+#   batch0-3			no I/O, run side by side by -j, and on one
+#				channel where the others are lite
+#   trace			bftrace -d placing the interpreter's reads
+#				of hw.bf in the file
+#
+# EMU_DMA_CHANNELS has the emulator use other tx and rx channels, and
+# EMU_DMA_LITE lite channels where the board has them.
+
+cd "$(dirname "$0")" || exit 1
+bf=../bf-emu
+bftrace=../bftrace
+update=0
+[ "$1" = -u ] && update=1
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+fail=0
+
+# hello.bf repeated until it compacts to more than 32 KB.
+i=0
+while [ $i -lt 72 ]
+do
+	cat ../hello.bf
+	i=$((i + 1))
+done > "$work/big.bf"
+
+# run MODE NAME PROGRAM [bf-emu options]: runs PROGRAM, checks its
+# output against NAME.out and notes its counts under MODE.
+run()
+{
+	mode=$1 name=$2 program=$3
+	shift 3
+	if ! "$bf" "$@" "$program" < input.txt > "$work/out" 2> "$work/err"
+	then
+		echo "FAIL $mode $name: bf-emu failed"
+		cat "$work/err"
+		fail=1
+		return
+	fi
+	if [ $update = 1 ] && [ ! -e "$work/$name.seen" ]
+	then
+		cp "$work/out" "$name.out"
+		touch "$work/$name.seen"
+	elif ! cmp -s "$work/out" "$name.out"
+	then
+		echo "FAIL $mode $name: output differs from $name.out"
+		fail=1
+	fi
+	sed -n 's/^emu: \([0-9]*\) CBs, .* ~\([0-9]*\) cycles .*/\1 \2/p' "$work/err" |
+		head -n 1 | sed "s/^/$mode $name /" >> "$work/cycles.txt"
+}
+
+for p in hw squares rev scan mul off far
+do
+	run interp $p $p.bf
+	run compile $p $p.bf -c
+done
+for p in hw squares scan mul off wrapt
+do
+	run wrap $p $p.bf -t 128
+done
+run interp big "$work/big.bf"
+if ! grep -q 'compiling instead of interpreting' "$work/err"
+then
+	echo "FAIL interp big: no notice that the program was compiled"
+	fail=1
+fi
+
+# The interpreter's first read of the program is the first '+', and the
+# first '[' is the 9th byte of line 2.
+if ! "$bf" -x "$work/trace" hw.bf > /dev/null 2>&1 ||
+	! "$bftrace" -d "$work/trace" > "$work/dump"
+then
+	echo "FAIL trace: bf-emu -x or bftrace failed"
+	fail=1
+elif ! grep -q '  hw.bf:2:1$' "$work/dump" ||
+	! grep -q 'hw.bf:2:9$' "$work/dump"
+then
+	echo "FAIL trace: the reads of hw.bf are not placed in it"
+	fail=1
+fi
+
+# The second run of each program copies the interpreter from the image
+# the first left in the cache, and must do just what a build does. So
+# must the third, on other tx and rx channels, which the image's
+# gadgets are patched for.
+cached()
+{
+	run "$@" -C "$work/cache"
+	if ! grep -q 'from the image cache' "$work/err"
+	then
+		echo "FAIL $1 $2: the image was not taken from the cache"
+		fail=1
+	fi
+}
+for p in hw rev scan
+do
+	run cold $p $p.bf -C "$work/cache"
+	cached warm $p $p.bf
+	export EMU_DMA_CHANNELS=9,12
+	cached moved $p $p.bf
+	unset EMU_DMA_CHANNELS
+done
+
+# batch MODE: runs the programs of a batch, which finish in any order,
+# and checks their output against batch.out.
+batch()
+{
+	if ! "$bf" -j 2 batch0.bf batch1.bf batch2.bf batch3.bf < /dev/null \
+		> "$work/out" 2> "$work/err"
+	then
+		echo "FAIL $1: bf-emu failed"
+		cat "$work/err"
+		fail=1
+		return
+	fi
+	sort "$work/out" > "$work/sorted"
+	if [ $update = 1 ]
+	then
+		cp "$work/sorted" batch.out
+	elif ! cmp -s "$work/sorted" batch.out
+	then
+		echo "FAIL $1: output differs from batch.out"
+		fail=1
+	fi
+}
+batch batch
+
+# With only lite channels to add, which have no 2D mode, the batch runs
+# on the first channel alone.
+export EMU_DMA_LITE=1
+batch lite
+unset EMU_DMA_LITE
+if ! grep -q 'Running on the 1 free full DMA channels of 2' "$work/err"
+then
+	echo "FAIL lite: the batch was not kept to the full channel"
+	fail=1
+fi
+
+if [ $update = 1 ]
+then
+	cp "$work/cycles.txt" cycles.txt
+elif ! diff -u cycles.txt "$work/cycles.txt"
+then
+	echo "FAIL control blocks or cycles differ from cycles.txt"
+	fail=1
+fi
+[ $fail = 0 ] && echo "bf-emu: all checks passed"
+exit $fail
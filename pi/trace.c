@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+static int write_header(dma_trace_t *trace)
+{
+	struct dma_trace_header header;
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, DMA_TRACE_MAGIC, sizeof header.magic);
+	header.version = DMA_TRACE_VERSION;
+	header.sampled = trace->sampled;
+	header.symbol_count = trace->symbol_count;
+	header.source_count = trace->source_count;
+	header.record_count = trace->written;
+	if (fseek(trace->fp, 0, SEEK_SET) ||
+	    fwrite(&header, sizeof header, 1, trace->fp) != 1)
+		return -1;
+	return 0;
+}
+
+int dma_trace_open(dma_trace_t *trace, const char *path, size_t capacity)
+{
+	memset(trace, 0, sizeof *trace);
+	trace->records = malloc(capacity * sizeof *trace->records);
+	if (!trace->records)
+		return -1;
+	trace->capacity = capacity;
+	trace->fp = fopen(path, "wb");
+	if (!trace->fp || write_header(trace))
+	{
+		int error = errno;
+		if (trace->fp)
+			fclose(trace->fp);
+		free(trace->records);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int dma_trace_symbol(dma_trace_t *trace, const char *name, uintptr_t addr,
+		     size_t size)
+{
+	struct dma_trace_symbol symbol = { addr, size, strlen(name) };
+	if (fwrite(&symbol, sizeof symbol, 1, trace->fp) != 1 ||
+	    fwrite(name, symbol.name_len, 1, trace->fp) != 1)
+		return -1;
+	++trace->symbol_count;
+	return 0;
+}
+
+int dma_trace_source(dma_trace_t *trace, const char *path, uintptr_t addr,
+		     size_t count, const struct dma_trace_position positions[])
+{
+	struct dma_trace_source source = { addr, count, strlen(path) };
+	if (fwrite(&source, sizeof source, 1, trace->fp) != 1 ||
+	    (source.path_len && fwrite(path, source.path_len, 1, trace->fp) != 1) ||
+	    (count && fwrite(positions, sizeof *positions, count, trace->fp) != count))
+		return -1;
+	++trace->source_count;
+	return 0;
+}
+
+int dma_trace_flush(dma_trace_t *trace)
+{
+	size_t count = trace->count;
+	trace->count = 0;
+	if (!count)
+		return 0;
+	if (fwrite(trace->records, sizeof *trace->records, count, trace->fp) != count)
+	{
+		if (!trace->error)
+			trace->error = errno;
+		return -1;
+	}
+	trace->written += count;
+	return 0;
+}
+
+int dma_trace_close(dma_trace_t *trace)
+{
+	dma_trace_flush(trace);
+	if (write_header(trace) && !trace->error)
+		trace->error = errno;
+	if (fclose(trace->fp) && !trace->error)
+		trace->error = errno;
+	free(trace->records);
+	trace->records = NULL;
+	trace->fp = NULL;
+	if (trace->error)
+	{
+		errno = trace->error;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A trace file is a struct dma_trace_header, then symbol_count symbols
+ * naming ranges of bus addresses, each a struct dma_trace_symbol
+ * followed by name_len bytes of name, then source_count sources, then
+ * record_count records. A source gives the place in a file of each
+ * byte of a program the chain reads: a struct dma_trace_source,
+ * path_len bytes of path and a struct dma_trace_position for each of
+ * the count bytes from addr. All of it is in the host's byte order. */
+#define DMA_TRACE_MAGIC "dmatrace"
+#define DMA_TRACE_VERSION 2
+
+struct dma_trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t sampled;	// the records are samples of a run at full speed
+	uint32_t symbol_count;
+	uint32_t source_count;
+	uint64_t record_count;
+};
+
+struct dma_trace_symbol
+{
+	uint32_t addr;
+	uint32_t size;
+	uint32_t name_len;
+};
+
+struct dma_trace_source
+{
+	uint32_t addr;
+	uint32_t count;
+	uint32_t path_len;
+};
+
+struct dma_trace_position
+{
+	uint32_t line;		// from 1
+	uint32_t column;	// from 1
+};
+
+/* A control block as the tracer found the channel running it. */
+struct dma_trace_record
+{
+	uint32_t cb;		// bus address of the control block
+	uint32_t source_ad;
+	uint32_t dest_ad;
+	uint32_t txfr_len;
+	uint32_t data;		// the first bytes at the source, 0 if not memory
+};
+
+/* Records gathered in a ring allocated up front and written out each
+ * time it fills, so that taking one is a store. */
+typedef struct
+{
+	FILE *fp;
+	struct dma_trace_record *records;
+	size_t capacity;
+	size_t count;		// in the ring
+	uint64_t written;	// to the file
+	uint32_t symbol_count;
+	uint32_t source_count;
+	int sampled;
+	int error;		// errno of the first write that failed
+} dma_trace_t;
+
+/* Creates the trace file path with a ring of capacity records. Returns
+ * -1 with errno set if it cannot be created. */
+int dma_trace_open(dma_trace_t *trace, const char *path, size_t capacity);
+
+/* Names the size bytes at the bus address addr, before any record is
+ * taken. Returns -1 with errno set if it cannot be written. */
+int dma_trace_symbol(dma_trace_t *trace, const char *name, uintptr_t addr,
+		     size_t size);
+
+/* Gives the places in the file path of the count bytes at the bus
+ * address addr, after the symbols and before any record. Returns -1
+ * with errno set if they cannot be written. */
+int dma_trace_source(dma_trace_t *trace, const char *path, uintptr_t addr,
+		     size_t count, const struct dma_trace_position positions[]);
+
+/* Writes out the records in the ring and empties it. Returns -1 with
+ * errno set if they cannot be written, and they are lost. */
+int dma_trace_flush(dma_trace_t *trace);
+
+/* Writes out the rest, completes the header and closes the file.
+ * Returns -1 with errno set if any of it could not be written. */
+int dma_trace_close(dma_trace_t *trace);
+
+static inline void dma_trace_add(dma_trace_t *trace,
+				 const struct dma_trace_record *record)
+{
+	trace->records[trace->count++] = *record;
+	if (trace->count == trace->capacity)
+		dma_trace_flush(trace);
+}
+
+#endif
@@ -88,6 +88,9 @@ void init_uart(struct gpio_registers *gpio, struct uart0_registers *uart0)
 	uart0->imsc = IMSC_CTSMIM | IMSC_RXIM | IMSC_TXIM | IMSC_RTIM | 
 		IMSC_FEIM | IMSC_PEIM | IMSC_BEIM | IMSC_OEIM;
 
+	// Let the FIFOs pace DMA channels through their DREQs.
+	uart0->dmacr = DMACR_TXDMAE | DMACR_RXDMAE;
+
 	// Enable UART0.
 	uart0->cr = CR_UARTEN | CR_TXE | CR_RXE;
 }
@@ -114,6 +114,13 @@ enum
 	CR_RXE		= 1 << 9, // Receive enable.
 };
 
+enum
+{
+	DMACR_RXDMAE	= 1 << 0, // Receive DMA enable.
+	DMACR_TXDMAE	= 1 << 1, // Transmit DMA enable.
+	DMACR_DMAONERR	= 1 << 2, // DMA on error.
+};
+
 int map_gpio_registers(void);
 int map_uart0_registers(void);
 int unmap_gpio_registers(void);